@@ -0,0 +1,936 @@
+#include "src/fth.c"
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+
+#define BENCH_OPS 4096
+#define BENCH_RUNS 2000
+
+// The same loop with every handler working on the stack in memory, so the
+// top-of-stack cache can be measured against it
+#define FTH_RUN_NAME fth_run_switch_nocache
+#define FTH_RUN_THREADED 0
+#define FTH_RUN_TOS_CACHE 0
+#include "src/run.inl"
+
+// fth.c only builds the switch loop when it runs it
+#if FTH_COMPUTED_GOTO
+#define FTH_RUN_NAME fth_run_switch
+#define FTH_RUN_THREADED 0
+#define FTH_RUN_TOS_CACHE FTH_TOS_CACHE
+#include "src/run.inl"
+
+#define FTH_RUN_NAME fth_run_threaded_nocache
+#define FTH_RUN_THREADED 1
+#define FTH_RUN_TOS_CACHE 0
+#include "src/run.inl"
+#endif
+
+typedef fth_result_t(*bench_engine)(fth_vm*);
+
+typedef struct {
+    const char *name;
+    bench_engine run;
+} bench_variant;
+
+typedef struct {
+    const char *name;
+    void(*build)(fth_chunk*);
+} bench_workload;
+
+static FILE *report = NULL;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// Constants are pooled up front so every workload stays on the 1-byte CONSTANT path
+static void prepare(fth_chunk *chunk) {
+    for (int i = 0; i < 256; i++)
+        chunk_add_constant(chunk, i & 1 ? fth_number(i + .5) : fth_integer(i));
+}
+
+static void write_constant(fth_chunk *chunk, int index) {
+    chunk_write(chunk, FTH_OP_CONSTANT, 1);
+    chunk_write(chunk, (uint8_t)index, 1);
+}
+
+static void finish(fth_chunk *chunk) {
+    write_constant(chunk, 0);
+    chunk_write(chunk, FTH_OP_RETURN, 1);
+}
+
+static void build_constants(fth_chunk *chunk) {
+    for (int i = 0; i < BENCH_OPS; i++) {
+        write_constant(chunk, i & 0xff);
+        if ((i & 0xff) == 0xff)
+            chunk_write(chunk, FTH_OP_CLEAR, 1);
+    }
+    chunk_write(chunk, FTH_OP_CLEAR, 1);
+    finish(chunk);
+}
+
+static void build_rstack(fth_chunk *chunk) {
+    write_constant(chunk, 1);
+    for (int i = 0; i < BENCH_OPS / 2; i++) {
+        chunk_write(chunk, FTH_OP_PUSH, 1);
+        chunk_write(chunk, FTH_OP_POP, 1);
+    }
+    chunk_write(chunk, FTH_OP_CLEAR, 1);
+    finish(chunk);
+}
+
+static void build_mixed(fth_chunk *chunk) {
+    for (int i = 0; i < BENCH_OPS / 4; i++) {
+        write_constant(chunk, i & 0xff);
+        chunk_write(chunk, FTH_OP_PUSH, 1);
+        chunk_write(chunk, FTH_OP_POP, 1);
+        chunk_write(chunk, FTH_OP_CLEAR, 1);
+    }
+    finish(chunk);
+}
+
+static void build_arith(fth_chunk *chunk) {
+    write_constant(chunk, 3);
+    for (int i = 0; i < BENCH_OPS / 8; i++) {
+        write_constant(chunk, 2);
+        chunk_write(chunk, FTH_OP_ADD, 1);
+        chunk_write(chunk, FTH_OP_DUP, 1);
+        chunk_write(chunk, FTH_OP_MUL, 1);
+        write_constant(chunk, 7);
+        chunk_write(chunk, FTH_OP_SWAP, 1);
+        chunk_write(chunk, FTH_OP_OVER, 1);
+        chunk_write(chunk, FTH_OP_DIV, 1);
+        chunk_write(chunk, FTH_OP_SUB, 1);
+    }
+    chunk_write(chunk, FTH_OP_CLEAR, 1);
+    finish(chunk);
+}
+
+// Stack-neutral source workloads for the peephole pass, each repeated
+// PEEPHOLE_REPEAT times and then terminated with a literal for RETURN to
+// consume. Repeated literals share pool entries, so the pool stays small
+#define PEEPHOLE_REPEAT 32
+#define STRING_LITERALS 4096
+#define STRING_DISTINCT 16
+#define ALLOC_BATCH 4096
+#define GC_SCRIPTS 20000
+#define LEXER_LINES 32768
+
+static const char *peephole_sources[][2] = {
+    {"arith", "1 2 + 3 * 4 - 2 / drop "},
+    {"rstack", "1 >r 2 >r r> r> + drop "},
+    {"constants", "1 2 3 4 5 drop drop drop drop drop "},
+    {"shuffle", "7 dup drop 8 swap swap over over * + + drop "}
+};
+
+static int chunk_count_instructions(fth_chunk *chunk) {
+    int count = 0;
+    for (int offset = 0; offset < garry_count(chunk->data); count++)
+        offset += op_length(chunk->data[offset]);
+    return count;
+}
+
+static void compile_source(fth_chunk *chunk, const char *snippet) {
+    size_t length = strlen(snippet);
+    int repeat = PEEPHOLE_REPEAT;
+    char *source = malloc(length * repeat + 2);
+    for (int i = 0; i < repeat; i++)
+        memcpy(source + i * length, snippet, length);
+    source[length * repeat] = '0';
+    source[length * repeat + 1] = '\0';
+    fth_vm vm = {0};
+    fth_parser parser;
+    parser_init(&parser, &vm, (const unsigned char*)source);
+    if (fth_compile(&parser, chunk) != FTH_OK) {
+        fprintf(report, "compile failed: %s\n", parser.error);
+        exit(1);
+    }
+    free(source);
+}
+
+#define CACHE_SNIPPETS 16
+#define CACHE_EXECS 100000
+
+#define PROGRAM_THREADS 4
+#define PROGRAM_RUNS 20000
+
+typedef struct {
+    const fth_program *program;
+    int failures;
+} bench_program_thread;
+
+static void* program_thread(void *arg) {
+    bench_program_thread *thread = arg;
+    fth_vm vm;
+    fth_init(&vm);
+    for (int i = 0; i < PROGRAM_RUNS; i++) {
+        fth_value value;
+        stack_reset(&vm);
+        if (fth_run_program(&vm, thread->program) != FTH_OK ||
+            fth_stack_pop(&vm, &value) != FTH_OK ||
+            !fth_is_integer(value) || fth_as_integer(value) != 6561 ||
+            fth_stack_pop(&vm, &value) != FTH_OK ||
+            !fth_is_string(value) || fth_string_length(value) != 27)
+            thread->failures++;
+    }
+    fth_destroy(&vm);
+    return NULL;
+}
+
+#if FTH_THREADS
+#define POOL_SCRIPTS 4000
+#define POOL_QUEUE 64
+#define POOL_SCRIPT_SIZE 1024
+
+// Every script squares its own number through a word of its own and goes
+// through a float and an integer literal on the way, so a compile that saw
+// another thread's scratch space or a result run on the wrong VM comes out
+// as the wrong number
+static void pool_script(char *script, int i) {
+    int length = sprintf(script, ": sq%d dup * ; %d.25 drop ", i, i);
+    for (int j = 0; j < 32; j++)
+        length += sprintf(script + length, "%d 2 * 1 + drop ", i + j);
+    sprintf(script + length, "%d sq%d 1 + dup", i, i);
+}
+
+static void pool_done(void *user, fth_vm *vm, fth_result_t result) {
+    fth_value value;
+    int64_t *slot = user;
+    *slot = result == FTH_OK && fth_stack_pop(vm, &value) == FTH_OK && fth_is_integer(value) ? (int64_t)fth_as_integer(value) : -1;
+}
+
+// The queue is kept small, so submitting often finds it full and waits
+static double pool_time(fth_pool *pool, char (*scripts)[POOL_SCRIPT_SIZE], int64_t *results, int *failures) {
+    double start = now_ns();
+    for (int i = 0; i < POOL_SCRIPTS; i++)
+        while (!fth_pool_submit(pool, (const unsigned char*)scripts[i], pool_done, &results[i]))
+            sched_yield();
+    fth_pool_wait(pool);
+    double elapsed = now_ns() - start;
+    for (int i = 0; i < POOL_SCRIPTS; i++)
+        if (results[i] != (int64_t)i * i + 1)
+            (*failures)++;
+    return elapsed;
+}
+#endif
+
+#if FTH_JIT
+static fth_result_t fth_run_jit(fth_vm *vm) {
+    if (!vm->chunk->jit && !jit_compile(vm->chunk)) {
+        fprintf(report, "jit_compile failed\n");
+        exit(1);
+    }
+    return ((fth_jit_fn)vm->chunk->jit)(vm);
+}
+#endif
+
+// Straight-line arithmetic the interpreter runs over and over, on integers,
+// on floats, and on both at once so nothing can be quickened
+static const char *quicken_sources[][2] = {
+    {"int", "7 3 + 2 * 5 - 2 / 4 over + over - drop drop "},
+    {"float", "7.5 3.5 + 2.0 * 5.0 - 2.0 / 4.5 over + over - drop drop "},
+    {"mixed", "7.5 3 + 2 * 5.0 - 2 / 4 over + over - drop drop "}
+};
+
+static double bench_run(fth_vm *vm, fth_chunk *chunk, bench_engine engine) {
+    double best = 0;
+    for (int i = 0; i < BENCH_RUNS; i++) {
+        vm->chunk = chunk;
+        vm->sp = chunk->data;
+        double start = now_ns();
+        fth_result_t result = engine(vm);
+        double elapsed = now_ns() - start;
+        if (result != FTH_OK) {
+            fprintf(report, "engine failed: %s\n", vm->error);
+            exit(1);
+        }
+        if (!i || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+// Benchmark suite: generated workloads at several sizes, each the best of
+// SUITE_REPEAT timed runs after a warm-up. Inputs come from a fixed seed, so
+// every run times the same work and results can be checked against a saved
+// baseline (see --json and --baseline)
+#define SUITE_REPEAT 15
+#define SUITE_MAX 64
+#define SUITE_STACK_OPS (1 << 20)
+#define SUITE_CONSTANT_OPS (1 << 16)
+
+typedef struct {
+    const char *name;
+    int size;
+    double value;
+    const char *unit;
+    bool higher;
+} suite_result;
+
+static suite_result suite_results[SUITE_MAX];
+static int suite_count = 0;
+
+static void suite_record(const char *name, int size, double value, const char *unit, bool higher) {
+    if (suite_count < SUITE_MAX)
+        suite_results[suite_count++] = (suite_result) {name, size, value, unit, higher};
+    fprintf(report, "suite: %-10s %8d %10.2f %s\n", name, size, value, unit);
+}
+
+static uint32_t suite_state;
+
+static uint32_t suite_random(void) {
+    suite_state ^= suite_state << 13;
+    suite_state ^= suite_state >> 17;
+    suite_state ^= suite_state << 5;
+    return suite_state;
+}
+
+// Valid source of at least `size` bytes mixing every kind of token, calls
+// only go to the last few definitions so lookups stay short
+static char* suite_source(int size) {
+    static const char *builtins[] = {"+", "-", "*", "dup", "drop", "swap", "over", ">r", "r>"};
+    static const char *exprs[] = {"$2<", "$1~2~", "$1", "$r>"};
+    char *source = malloc(size + 128);
+    int length = 0, words = 0;
+    suite_state = 0x9e3779b9;
+    while (length < size) {
+        uint32_t r = suite_random();
+        switch (r % 8) {
+            case 0:
+                length += sprintf(source + length, "%u", r >> 12);
+                break;
+            case 1:
+                length += sprintf(source + length, "%u.%u", r >> 20, r >> 24);
+                break;
+            case 2:
+                length += sprintf(source + length, "\"s%u\"", r >> 28);
+                break;
+            case 3:
+                length += sprintf(source + length, "\"a longer string literal %u\"", r >> 16);
+                break;
+            case 4:
+                length += sprintf(source + length, "%s", builtins[(r >> 8) % 9]);
+                break;
+            case 5:
+                length += sprintf(source + length, "%s", exprs[(r >> 8) % 4]);
+                break;
+            case 6:
+                length += sprintf(source + length, ": w%d dup %u + ;", words++, r >> 24);
+                break;
+            case 7:
+                if (words)
+                    length += sprintf(source + length, "w%d", words - 1 - (int)((r >> 8) % (words < 8 ? words : 8)));
+                else
+                    length += sprintf(source + length, "# nothing defined yet\n0");
+                break;
+        }
+        source[length++] = (r >> 4) % 8 ? ' ' : '\n';
+    }
+    source[length] = '\0';
+    return source;
+}
+
+static double suite_lex(const char *source) {
+    double best = 0;
+    for (int i = 0; i <= SUITE_REPEAT; i++) {
+        fth_parser parser;
+        parser_init(&parser, NULL, (const unsigned char*)source);
+        double start = now_ns();
+        for (fth_token token = next_token(&parser); token.type != FTH_TOKEN_EOF; token = next_token(&parser))
+            if (token.type == FTH_TOKEN_ERROR) {
+                fprintf(report, "suite lex failed at line %d\n", token.line);
+                exit(1);
+            }
+        double elapsed = now_ns() - start;
+        if (i == 1 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+static double suite_compile(const char *source) {
+    double best = 0;
+    for (int i = 0; i <= SUITE_REPEAT; i++) {
+        fth_vm vm;
+        fth_init(&vm);
+        fth_chunk chunk;
+        chunk_init(&chunk);
+        fth_parser parser;
+        parser_init(&parser, &vm, (const unsigned char*)source);
+        double start = now_ns();
+        fth_result_t result = fth_compile(&parser, &chunk);
+        double elapsed = now_ns() - start;
+        if (result != FTH_OK) {
+            fprintf(report, "suite compile failed: %s\n", parser.error);
+            exit(1);
+        }
+        chunk_free(&chunk);
+        fth_destroy(&vm);
+        if (i == 1 || elapsed < best)
+            best = elapsed;
+    }
+    return best;
+}
+
+// `ops` instructions in stack-neutral groups chosen at random, using the
+// first `constants` entries of the pool
+static int suite_chunk(fth_chunk *chunk, int ops, int constants) {
+    chunk_init(chunk);
+    for (int i = 0; i < constants; i++)
+        chunk_add_constant(chunk, i & 1 ? fth_number(i + .5) : fth_integer(i));
+    suite_state = 0x2545f491;
+    int count = 0;
+    while (count < ops) {
+        uint32_t r = suite_random();
+        write_constant(chunk, (r >> 8) % constants);
+        switch (r % 4) {
+            case 0:
+                write_constant(chunk, (r >> 16) % constants);
+                chunk_write(chunk, FTH_OP_ADD, 1);
+                count += 2;
+                break;
+            case 1:
+                chunk_write(chunk, FTH_OP_DUP, 1);
+                chunk_write(chunk, FTH_OP_MUL, 1);
+                count += 2;
+                break;
+            case 2:
+                chunk_write(chunk, FTH_OP_PUSH, 1);
+                chunk_write(chunk, FTH_OP_POP, 1);
+                count += 2;
+                break;
+            case 3:
+                write_constant(chunk, (r >> 16) % constants);
+                chunk_write(chunk, FTH_OP_SWAP, 1);
+                chunk_write(chunk, FTH_OP_OVER, 1);
+                chunk_write(chunk, FTH_OP_SUB, 1);
+                chunk_write(chunk, FTH_OP_DROP, 1);
+                count += 5;
+                break;
+        }
+        chunk_write(chunk, FTH_OP_DROP, 1);
+        count += 2;
+    }
+    finish(chunk);
+    return count + 2;
+}
+
+// Through fth_run, so the engine is whichever one a caller would get
+static double suite_run(fth_chunk *chunk) {
+    fth_vm vm;
+    fth_init(&vm);
+    double best = 0;
+    for (int i = 0; i <= SUITE_REPEAT * 4; i++) {
+        vm.chunk = chunk;
+        vm.sp = chunk->data;
+        double start = now_ns();
+        fth_result_t result = fth_run(&vm);
+        double elapsed = now_ns() - start;
+        if (result != FTH_OK) {
+            fprintf(report, "suite run failed: %s\n", vm.error);
+            exit(1);
+        }
+        if (i == 1 || elapsed < best)
+            best = elapsed;
+    }
+    fth_destroy(&vm);
+    return best;
+}
+
+// Pushes to `depth` and pops back down, about SUITE_STACK_OPS times in all
+static double suite_stack(int depth) {
+    fth_vm vm;
+    fth_init(&vm);
+    int rounds = SUITE_STACK_OPS / (depth * 2);
+    double best = 0;
+    for (int i = 0; i <= SUITE_REPEAT; i++) {
+        int64_t sum = 0;
+        double start = now_ns();
+        for (int round = 0; round < rounds; round++) {
+            for (int j = 0; j < depth; j++)
+                fth_stack_push(&vm, fth_integer(j));
+            for (int j = 0; j < depth; j++) {
+                fth_value value;
+                fth_stack_pop(&vm, &value);
+                sum += fth_as_integer(value);
+            }
+        }
+        double elapsed = now_ns() - start;
+        if (sum != (int64_t)depth * (depth - 1) / 2 * rounds) {
+            fprintf(report, "suite stack mismatch at depth %d\n", depth);
+            exit(1);
+        }
+        if (i == 1 || elapsed < best)
+            best = elapsed;
+    }
+    fth_destroy(&vm);
+    return best / (rounds * depth * 2);
+}
+
+static void bench_suite(void) {
+    static const int source_sizes[] = {4 << 10, 64 << 10, 1 << 20};
+    for (int i = 0; i < 3; i++) {
+        char *source = suite_source(source_sizes[i]);
+        size_t length = strlen(source);
+        suite_record("lex", source_sizes[i], length / suite_lex(source) * 1e3, "MB/s", true);
+        suite_record("compile", source_sizes[i], length / suite_compile(source) * 1e3, "MB/s", true);
+        free(source);
+    }
+    static const int dispatch_sizes[] = {1 << 10, 16 << 10, 256 << 10};
+    for (int i = 0; i < 3; i++) {
+        fth_chunk chunk;
+        int ops = suite_chunk(&chunk, dispatch_sizes[i], 16);
+        suite_record("dispatch", dispatch_sizes[i], suite_run(&chunk) / ops, "ns/op", false);
+        chunk_free(&chunk);
+    }
+    static const int depths[] = {16, 256, 1000};
+    for (int i = 0; i < 3; i++)
+        suite_record("stack", depths[i], suite_stack(depths[i]), "ns/op", false);
+    // Most of the biggest pool is only in reach of CONSTANT_LONG
+    static const int pools[] = {16, 256, 4096};
+    for (int i = 0; i < 3; i++) {
+        fth_chunk chunk;
+        chunk_init(&chunk);
+        for (int j = 0; j < pools[i]; j++)
+            chunk_add_constant(&chunk, j & 1 ? fth_number(j + .5) : fth_integer(j));
+        for (int j = 0; j < SUITE_CONSTANT_OPS; j++) {
+            chunk_write_constant(&chunk, (j * 7) % pools[i], 1);
+            chunk_write(&chunk, FTH_OP_DROP, 1);
+        }
+        finish(&chunk);
+        suite_record("constants", pools[i], suite_run(&chunk) / (SUITE_CONSTANT_OPS * 2 + 2), "ns/op", false);
+        chunk_free(&chunk);
+    }
+}
+
+static bool suite_write(const char *path) {
+#ifdef FTH_NAN_BOXING
+    const char *values = "nan-boxed";
+#else
+    const char *values = "tagged";
+#endif
+    FILE *out = fopen(path, "w");
+    if (!out)
+        return false;
+    fprintf(out, "{\"version\":1,\"config\":{\"value_bytes\":%zu,\"values\":\"%s\",\"jit\":%s,\"computed_goto\":%s,\"compiler\":\"%s\"},\"results\":[\n",
+            sizeof(fth_value), values, FTH_JIT ? "true" : "false", FTH_COMPUTED_GOTO ? "true" : "false", __VERSION__);
+    for (int i = 0; i < suite_count; i++)
+        fprintf(out, "{\"name\":\"%s\",\"size\":%d,\"value\":%.4f,\"unit\":\"%s\",\"better\":\"%s\"}%s\n",
+                suite_results[i].name, suite_results[i].size, suite_results[i].value, suite_results[i].unit,
+                suite_results[i].higher ? "higher" : "lower", i + 1 < suite_count ? "," : "");
+    fprintf(out, "]}\n");
+    fclose(out);
+    return true;
+}
+
+// Reads back a file from suite_write, one result per line, and reports how
+// far each result has moved. Returns the number of regressions beyond
+// `tolerance` percent, or -1 when the baseline can't be read
+static int suite_compare(const char *path, double tolerance) {
+    FILE *in = fopen(path, "r");
+    if (!in)
+        return -1;
+    char line[512];
+    int regressions = 0, compared = 0;
+    while (fgets(line, sizeof(line), in)) {
+        char name[64];
+        int size;
+        double value;
+        if (sscanf(line, "{\"name\":\"%63[^\"]\",\"size\":%d,\"value\":%lf", name, &size, &value) != 3)
+            continue;
+        for (int i = 0; i < suite_count; i++) {
+            suite_result *result = &suite_results[i];
+            if (strcmp(result->name, name) || result->size != size || value <= 0)
+                continue;
+            double change = (result->value - value) / value * 100;
+            bool regressed = result->higher ? change < -tolerance : change > tolerance;
+            fprintf(report, "baseline: %-10s %8d %10.2f -> %10.2f %s (%+.1f%%)%s\n", name, size, value, result->value, result->unit, change, regressed ? " REGRESSION" : "");
+            regressions += regressed;
+            compared++;
+        }
+    }
+    fclose(in);
+    return compared ? regressions : -1;
+}
+
+// Engine comparisons and the timing tables, correctness is check.c's
+static int bench_tables(void) {
+    bench_workload workloads[] = {
+        {"constants", build_constants},
+        {"rstack", build_rstack},
+        {"mixed", build_mixed},
+        {"arith", build_arith}
+    };
+    bench_variant variants[] = {
+        {"switch", fth_run_switch_nocache},
+        {"switch+tos", fth_run_switch},
+#if FTH_COMPUTED_GOTO
+        {"threaded", fth_run_threaded_nocache},
+        {"threaded+tos", fth_run_threaded},
+#endif
+#if FTH_JIT
+        {"jit", fth_run_jit},
+#endif
+    };
+    int n_variants = sizeof(variants) / sizeof(variants[0]);
+    fprintf(report, "fth_value: %zu bytes\n", sizeof(fth_value));
+
+    // Templated snippets at a high rate, with a cache that holds all of them,
+    // one that holds half and none at all
+    char snippets[CACHE_SNIPPETS][64];
+    for (int i = 0; i < CACHE_SNIPPETS; i++)
+        snprintf(snippets[i], sizeof(snippets[i]), "%d dup * 3 + \"template %d\" drop 2 / drop 0", i, i);
+    int capacities[] = { CACHE_SNIPPETS, CACHE_SNIPPETS / 2, 0 };
+    for (int c = 0; c < 3; c++) {
+        fth_vm vm;
+        fth_init_ex(&vm, &(fth_config) { .compile_cache = capacities[c] });
+        double start = now_ns();
+        for (int i = 0; i < CACHE_EXECS; i++) {
+            fth_exec(&vm, (const unsigned char*)snippets[i % CACHE_SNIPPETS]);
+            stack_reset(&vm);
+        }
+        fprintf(report, "cache %2d: %.0f ns/exec, %zu hits, %zu misses, %zu evictions\n", capacities[c], (now_ns() - start) / CACHE_EXECS, vm.cache.hits, vm.cache.misses, vm.cache.evictions);
+        fth_destroy(&vm);
+    }
+
+    // One program shared by VMs on several threads, against compiling the
+    // same source on every run
+    const char *shared = ": sq dup * ; : sq4 sq sq ; \"a string too long to inline\" 3 sq4 sq 0";
+    fth_program *program = fth_compile_program((const unsigned char*)shared, NULL);
+    pthread_t threads[PROGRAM_THREADS];
+    bench_program_thread program_threads[PROGRAM_THREADS];
+    for (int i = 0; i < PROGRAM_THREADS; i++) {
+        program_threads[i] = (bench_program_thread) { program, 0 };
+        pthread_create(&threads[i], NULL, program_thread, &program_threads[i]);
+    }
+    int failures = 0;
+    for (int i = 0; i < PROGRAM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        failures += program_threads[i].failures;
+    }
+    double exec = 0, run = 0;
+    for (int pass = 0; pass < 2; pass++) {
+        fth_vm vm;
+        fth_init(&vm);
+        double start = now_ns();
+        for (int i = 0; i < PROGRAM_RUNS; i++) {
+            stack_reset(&vm);
+            if (pass)
+                fth_run_program(&vm, program);
+            else {
+                fth_reset(&vm);
+                fth_exec(&vm, (const unsigned char*)shared);
+            }
+        }
+        *(pass ? &run : &exec) = (now_ns() - start) / PROGRAM_RUNS;
+        fth_destroy(&vm);
+    }
+    fprintf(report, "program: %d threads x %d runs, %d failures, exec %.0f ns/run, program %.0f ns/run\n", PROGRAM_THREADS, PROGRAM_RUNS, failures, exec, run);
+    if (failures)
+        return 1;
+
+    // Independent scripts compiled and run on one worker, then on one per
+    // core (at least PROGRAM_THREADS, so the queue is contended even here),
+    // and the shared program submitted alongside
+#if FTH_THREADS
+    char (*scripts)[POOL_SCRIPT_SIZE] = malloc(POOL_SCRIPTS * POOL_SCRIPT_SIZE);
+    int64_t *results = malloc(POOL_SCRIPTS * sizeof(int64_t));
+    for (int i = 0; i < POOL_SCRIPTS; i++)
+        pool_script(scripts[i], i);
+    int workers = pool_cores() > PROGRAM_THREADS ? pool_cores() : PROGRAM_THREADS;
+    double pool_elapsed[2];
+    for (int pass = 0; pass < 2; pass++) {
+        memset(results, 0, POOL_SCRIPTS * sizeof(int64_t));
+        fth_pool *pool = fth_pool_create(pass ? workers : 1, POOL_QUEUE, NULL);
+        pool_elapsed[pass] = pool_time(pool, scripts, results, &failures);
+        for (int i = 0; i < PROGRAM_RUNS / 100; i++)
+            while (!fth_pool_submit_program(pool, program, pool_done, &results[i]))
+                sched_yield();
+        fth_pool_destroy(pool);
+        for (int i = 0; i < PROGRAM_RUNS / 100; i++)
+            if (results[i] != 6561)
+                failures++;
+    }
+    free(scripts);
+    free(results);
+    fprintf(report, "pool: %d scripts, %d failures, 1 worker %.0f ns/script, %d workers %.0f ns/script (%.2fx on %d cores)\n", POOL_SCRIPTS, failures, pool_elapsed[0] / POOL_SCRIPTS, workers, pool_elapsed[1] / POOL_SCRIPTS, pool_elapsed[0] / pool_elapsed[1], pool_cores());
+    if (failures)
+        return 1;
+#endif
+    fth_free_program(program);
+    fprintf(report, "%-12s %8s", "workload", "ops");
+    for (int j = 0; j < n_variants; j++)
+        fprintf(report, " %14s", variants[j].name);
+    fprintf(report, "   (ns/op, best of %d)\n", BENCH_RUNS);
+    for (int i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++) {
+        fth_chunk chunk;
+        chunk_init(&chunk);
+        prepare(&chunk);
+        workloads[i].build(&chunk);
+        int ops = chunk_count_instructions(&chunk);
+        fth_vm vm;
+        fth_init(&vm);
+        fprintf(report, "%-12s %8d", workloads[i].name, ops);
+        for (int j = 0; j < n_variants; j++)
+            fprintf(report, " %14.2f", bench_run(&vm, &chunk, variants[j].run) / ops);
+        fprintf(report, "\n");
+        fth_destroy(&vm);
+        chunk_free(&chunk);
+    }
+
+    fprintf(report, "\n%-12s %10s %10s %9s %12s %12s\n", "peephole", "dispatch", "optimized", "saved", "ns/run", "optimized");
+    for (int i = 0; i < sizeof(peephole_sources) / sizeof(peephole_sources[0]); i++) {
+        fth_chunk plain, optimized;
+        chunk_init(&plain);
+        chunk_init(&optimized);
+        compile_source(&plain, peephole_sources[i][1]);
+        compile_source(&optimized, peephole_sources[i][1]);
+        chunk_optimize(&optimized);
+        int before = chunk_count_instructions(&plain);
+        int after = chunk_count_instructions(&optimized);
+        fth_vm vm;
+        fth_init(&vm);
+        double a = bench_run(&vm, &plain, fth_run);
+        double b = bench_run(&vm, &optimized, fth_run);
+        fprintf(report, "%-12s %10d %10d %8.1f%% %12.0f %12.0f\n", peephole_sources[i][0], before, after, 100.0 * (before - after) / before, a, b);
+        fth_destroy(&vm);
+        chunk_free(&plain);
+        chunk_free(&optimized);
+    }
+
+    // The same arithmetic before and after it has been quickened, the first
+    // run rewrites it and the best of the rest is what's reported
+    fprintf(report, "\nquicken");
+    for (int i = 0; i < sizeof(quicken_sources) / sizeof(quicken_sources[0]); i++) {
+        fth_chunk chunk;
+        chunk_init(&chunk);
+        compile_source(&chunk, quicken_sources[i][1]);
+        fth_vm vm;
+        fth_init(&vm);
+        fprintf(report, "%s %s %.0f ns/run", i ? "," : ":", quicken_sources[i][0], bench_run(&vm, &chunk, fth_run));
+        fth_destroy(&vm);
+        chunk_free(&chunk);
+    }
+    fprintf(report, "\n");
+
+    // What the profiler costs, and the pairs it would suggest fusing next
+    for (int i = 0; i < sizeof(peephole_sources) / sizeof(peephole_sources[0]); i++) {
+        fth_chunk chunk;
+        chunk_init(&chunk);
+        compile_source(&chunk, peephole_sources[i][1]);
+        chunk_optimize(&chunk);
+        fth_vm vm;
+        fth_init(&vm);
+        double plain = bench_run(&vm, &chunk, fth_run);
+        fth_profile_start(&vm);
+        double profiled = bench_run(&vm, &chunk, fth_run);
+        fth_profile *profile = fth_profile_stop(&vm);
+        fth_profile_entry pairs[3];
+        int count = fth_profile_entries(profile, FTH_PROFILE_PAIRS, pairs, 3);
+        fprintf(report, "%sprofile %-10s %8.0f ns/run, profiled %8.0f ns/run, top pairs", i ? "" : "\n", peephole_sources[i][0], plain, profiled);
+        for (int j = 0; j < count && j < 3; j++)
+            fprintf(report, " %s+%s", pairs[j].name, pairs[j].next);
+        fprintf(report, "\n");
+        fth_profile_free(profile);
+        fth_destroy(&vm);
+        chunk_free(&chunk);
+    }
+
+    // Literal-heavy compile: every long literal after the first of its kind
+    // is a lookup in the intern table rather than a new object, and short
+    // ones are stored in the value and never reach the heap
+    static const char *literal_formats[] = { "\"literal number %d\" drop ", "\"l%d\" drop " };
+    for (int f = 0; f < 2; f++) {
+        char *literals = malloc(STRING_LITERALS * 32 + 2);
+        char *cursor = literals;
+        for (int i = 0; i < STRING_LITERALS; i++)
+            cursor += sprintf(cursor, literal_formats[f], i % STRING_DISTINCT);
+        strcpy(cursor, "0");
+        double best = 0;
+        int objects = 0;
+        for (int i = 0; i < BENCH_RUNS / 10; i++) {
+            fth_vm vm;
+            fth_init(&vm);
+            fth_chunk chunk;
+            chunk_init(&chunk);
+            fth_parser parser;
+            parser_init(&parser, &vm, (const unsigned char*)literals);
+            double start = now_ns();
+            fth_compile(&parser, &chunk);
+            double elapsed = now_ns() - start;
+            if (!i || elapsed < best)
+                best = elapsed;
+            objects = vm.strings ? vm.strings->count : 0;
+            chunk_free(&chunk);
+            fth_destroy(&vm);
+        }
+        free(literals);
+        fprintf(report, "%sstrings: %d %s literals, %d objects, %.1f ns/literal compile\n", f ? "" : "\n", STRING_LITERALS, f ? "short" : "long", objects, best / STRING_LITERALS);
+    }
+
+    // Object churn through the arena against the malloc it replaced: a
+    // batch of short strings allocated, then freed, then released in bulk
+    fth_vm vm;
+    fth_init(&vm);
+    fth_string **batch = malloc(ALLOC_BATCH * sizeof(fth_string*));
+    double arena = 0, system = 0;
+    for (int i = 0; i < BENCH_RUNS / 10; i++) {
+        double start = now_ns();
+        for (int j = 0; j < ALLOC_BATCH; j++)
+            batch[j] = fth_string_new(&vm, (const unsigned char*)"request", 7, true);
+        for (int j = 0; j < ALLOC_BATCH; j++)
+            fth_obj_destroy(&vm, &batch[j]->obj);
+        double elapsed = now_ns() - start;
+        if (!i || elapsed < arena)
+            arena = elapsed;
+        start = now_ns();
+        for (int j = 0; j < ALLOC_BATCH; j++) {
+            batch[j] = malloc(sizeof(fth_string) + 8);
+            memcpy(batch[j]->data, "request", 8);
+        }
+        for (int j = 0; j < ALLOC_BATCH; j++)
+            free(batch[j]);
+        elapsed = now_ns() - start;
+        if (!i || elapsed < system)
+            system = elapsed;
+    }
+    for (int j = 0; j < ALLOC_BATCH; j++)
+        batch[j] = fth_string_new(&vm, (const unsigned char*)"request", 7, true);
+    double start = now_ns();
+    fth_reset(&vm);
+    double reset = now_ns() - start;
+    free(batch);
+    fth_destroy(&vm);
+    fprintf(report, "alloc: %d objects, arena %.1f ns/object, malloc %.1f ns/object, reset %.0f ns\n", ALLOC_BATCH, arena / ALLOC_BATCH, system / ALLOC_BATCH, reset);
+
+    // A long-running VM fed scripts with literals it never sees again: the
+    // heap should stay around gc_min_heap however many scripts it runs
+    fth_config gc_config = { .gc_min_heap = 64 * 1024 };
+    fth_init_ex(&vm, &gc_config);
+    size_t peak = 0;
+    for (int i = 0; i < GC_SCRIPTS; i++) {
+        char script[64];
+        snprintf(script, sizeof(script), "\"script number %d\" \"shared by all of them\" drop drop 0", i);
+        fth_exec(&vm, (const unsigned char*)script);
+        if (vm.gc.bytes_allocated > peak)
+            peak = vm.gc.bytes_allocated;
+    }
+    fprintf(report, "gc: %d scripts, %zu collections, peak heap %zu bytes, pause avg %.0f ns max %llu ns\n", GC_SCRIPTS, vm.gc.collections, peak, vm.gc.collections ? (double)vm.gc.total_pause_ns / vm.gc.collections : 0, (unsigned long long)vm.gc.max_pause_ns);
+    fth_destroy(&vm);
+
+    // Raw token throughput over a large generated script, the token/line
+    // checksum has to agree between SIMD and FTH_NO_SIMD builds
+    char *script = malloc(LEXER_LINES * 96 + 1);
+    char *cursor = script;
+    for (int i = 0; i < LEXER_LINES; i++)
+        cursor += sprintf(cursor, i & 1 ? "  : word%d dup *   over + ; # squares and sums\n" : "\t\"literal %d\" drop 12 4.5 $1< swap\n", i);
+    size_t script_length = cursor - script;
+    double lexer = 0;
+    unsigned long long checksum = 0;
+    for (int i = 0; i < BENCH_RUNS / 20; i++) {
+        fth_parser parser;
+        parser_init(&parser, NULL, (const unsigned char*)script);
+        checksum = 0;
+        double start = now_ns();
+        for (fth_token token = next_token(&parser); token.type != FTH_TOKEN_EOF; token = next_token(&parser))
+            checksum = checksum * 31 + token.type + token.length * 7 + token.line * 131 + (token.begin - (const unsigned char*)script);
+        double elapsed = now_ns() - start;
+        if (!i || elapsed < lexer)
+            lexer = elapsed;
+    }
+    fprintf(report, "lexer: %zu bytes, %.0f MB/s, checksum %016llx\n", script_length, script_length / lexer * 1e3, checksum);
+
+    // Cold start: compiling the same script against loading its image
+    char image_path[] = "/tmp/fth-bench-XXXXXX";
+    close(mkstemp(image_path));
+    double compile = 0, load = 0;
+    for (int i = 0; i < BENCH_RUNS / 100; i++) {
+        fth_vm vm;
+        fth_init(&vm);
+        double start = now_ns();
+        fth_chunk *chunk = fth_compile_chunk(&vm, (const unsigned char*)script);
+        double elapsed = now_ns() - start;
+        if (!i || elapsed < compile)
+            compile = elapsed;
+        if (!i)
+            fth_save_chunk(&vm, chunk, image_path);
+        fth_destroy(&vm);
+        fth_init(&vm);
+        start = now_ns();
+        chunk = fth_load_chunk(&vm, image_path);
+        elapsed = now_ns() - start;
+        if (!chunk) {
+            fprintf(report, "image load failed: %s\n", vm.error);
+            return 1;
+        }
+        if (!i || elapsed < load)
+            load = elapsed;
+        fth_destroy(&vm);
+    }
+    unlink(image_path);
+    fprintf(report, "image: compile %.0f us, load %.0f us\n", compile / 1e3, load / 1e3);
+
+    // The same script's line table against 8-byte pairs, and the first
+    // lookup, which decodes all of it
+    fth_init(&vm);
+    fth_chunk *chunk = fth_compile_chunk(&vm, (const unsigned char*)script);
+    start = now_ns();
+    int last = get_line(chunk, garry_count(chunk->data) - 1);
+    double decode = now_ns() - start;
+    fprintf(report, "lines: %d changes to line %d, %d bytes (%zu as pairs), first lookup %.0f us\n", garry_count(chunk->line_index), last, garry_count(chunk->lines), garry_count(chunk->line_index) * sizeof(fth_chunk_linestart), decode / 1e3);
+    fth_destroy(&vm);
+    free(script);
+    return 0;
+}
+
+// Usage: fth-bench [--suite] [--json PATH] [--baseline PATH] [--tolerance PCT]
+// --suite skips the engine comparisons and checks and only runs the suite
+int main(int argc, const char *argv[]) {
+    const char *json = NULL, *baseline = NULL;
+    double tolerance = 10;
+    bool suite_only = false;
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--suite"))
+            suite_only = true;
+        else if (!strcmp(argv[i], "--json") && i + 1 < argc)
+            json = argv[++i];
+        else if (!strcmp(argv[i], "--baseline") && i + 1 < argc)
+            baseline = argv[++i];
+        else if (!strcmp(argv[i], "--tolerance") && i + 1 < argc)
+            tolerance = atof(argv[++i]);
+        else {
+            fprintf(stderr, "usage: %s [--suite] [--json PATH] [--baseline PATH] [--tolerance PCT]\n", argv[0]);
+            return 2;
+        }
+    }
+    // RETURN prints the final value, keep that out of the report
+    fflush(stdout);
+    report = fdopen(dup(fileno(stdout)), "w");
+    freopen("/dev/null", "w", stdout);
+
+    int result = suite_only ? 0 : bench_tables();
+    if (!result) {
+        bench_suite();
+        if (json && !suite_write(json)) {
+            fprintf(report, "can't write %s\n", json);
+            result = 1;
+        }
+        if (baseline) {
+            int regressions = suite_compare(baseline, tolerance);
+            if (regressions < 0) {
+                fprintf(report, "can't read baseline %s\n", baseline);
+                result = 1;
+            } else if (regressions) {
+                fprintf(report, "%d result%s regressed by more than %.0f%%\n", regressions, regressions == 1 ? "" : "s", tolerance);
+                result = 1;
+            }
+        }
+    }
+    fclose(report);
+    return result;
+}
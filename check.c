@@ -0,0 +1,700 @@
+#include "src/fth.c"
+#include <unistd.h>
+
+// Correctness checks, apart from the benchmarks so they run on their own.
+// Every program in the corpus goes through each differential in turn, then
+// the checks that build their own inputs run once each. Exits 1 on any
+// mismatch
+
+static FILE *report = NULL;
+
+// Differential corpus: every program is run through each differential
+// below, two ways that must leave identical results, errors and stacks
+static const char *differential_corpus[] = {
+    "1 2 + 3 * 4 - 2 /",
+    "1.5 2 * 3 / 0.25 -",
+    "2.5 1.5 - 0.5 / 3.0 * dup dup + 2.0 - 1 +",
+    "7 dup * dup + 3 swap - over over / *",
+    "1 >r 2 >r 3 r> r> + +",
+    "1 2 3 4 5 drop drop swap",
+    "10 3 / 10 3.0 / 0 1 - 2 *",
+    "0 1 - 2 /",
+    "9223372036854775808 0 1 - /",
+    "\"str\" 1 swap drop",
+    "1 2 $ 3 4",
+    "1 +",
+    "1 0 /",
+    "r>",
+    "\"a\" 1 +",
+    "drop",
+    "1 2 swap swap >r r> dup drop over",
+    "1 2 3 4 $2< $~1> $r0~ $1~2~ $r> 9 $1~= 0",
+    "1 2 3 $* 4 5 $*< $1",
+    "1 2 $5>",
+    "$r0~",
+    ": sq dup * ; 3 sq sq",
+    ": inc 1 + ; : inc2 inc inc ; 0 inc2 inc2 inc",
+    ": rot $2< ; 1 2 3 rot rot",
+    ": keep >r 1 + r> ; 5 6 keep keep",
+    ": sq dup * ; : sq sq sq ; 2 sq",
+    ": boom 1 0 / ; 1 boom",
+    "\"tiny\" \"a much longer string literal\" swap over",
+};
+
+static void check_sink(void *user, const char *text, size_t length) {
+    *(size_t*)user += length;
+}
+
+// fth_string_equal trusts interning, which only holds within one VM
+static bool same_chars(fth_value a, fth_value b) {
+    return fth_string_length(a) == fth_string_length(b) && !memcmp(fth_string_chars(&a), fth_string_chars(&b), fth_string_length(a));
+}
+
+static bool values_match(fth_value a, fth_value b) {
+    if (fth_type(a) != fth_type(b))
+        return false;
+    switch (fth_type(a)) {
+        case FTH_VALUE_NIL:
+            return true;
+        case FTH_VALUE_BOOLEAN:
+            return fth_as_boolean(a) == fth_as_boolean(b);
+        case FTH_VALUE_INTEGER:
+            return fth_as_integer(a) == fth_as_integer(b);
+        case FTH_VALUE_NUMBER: {
+            fth_float x = fth_as_number(a), y = fth_as_number(b);
+            return !memcmp(&x, &y, sizeof(fth_float));
+        }
+        case FTH_VALUE_OBJECT:
+            return fth_as_obj(a) == fth_as_obj(b) || (fth_is_string(a) && fth_is_string(b) && same_chars(a, b));
+        case FTH_VALUE_SMALL_STRING:
+            return fth_string_equal(a, b);
+        case FTH_VALUE_FRAME:
+            return as_frame(a) == as_frame(b);
+    }
+    return false;
+}
+
+static bool stacks_match(fth_stack *a, fth_stack *b) {
+    if (a->top - a->base != b->top - b->base)
+        return false;
+    for (int i = 0; i < a->top - a->base; i++)
+        if (!values_match(a->base[i], b->base[i]))
+            return false;
+    return true;
+}
+
+static bool chunks_match(fth_chunk *a, fth_chunk *b) {
+    if (garry_count(a->data) != garry_count(b->data) || garry_count(a->constants) != garry_count(b->constants))
+        return false;
+    if (memcmp(a->data, b->data, garry_count(a->data)))
+        return false;
+    for (int i = 0; i < garry_count(a->data); i++)
+        if (get_line(a, i) != get_line(b, i))
+            return false;
+    for (int i = 0; i < garry_count(a->constants); i++)
+        if (!values_match(a->constants[i], b->constants[i]))
+            return false;
+    return true;
+}
+
+typedef struct {
+    const char *source;
+    size_t at;
+} check_trickle;
+
+static size_t trickle_read(void *source, unsigned char *buffer, size_t size, bool *failed) {
+    check_trickle *trickle = source;
+    if (!trickle->source[trickle->at])
+        return 0;
+    *buffer = trickle->source[trickle->at++];
+    return 1;
+}
+
+// Compiled from a stream fed one byte per read, which has to produce the
+// same chunk as compiling it in place
+static bool stream_matches(const char *source) {
+    fth_vm a, b;
+    fth_init(&a);
+    fth_init(&b);
+    fth_chunk x, y;
+    chunk_init(&x);
+    chunk_init(&y);
+    fth_parser parser;
+    parser_init(&parser, &a, (const unsigned char*)source);
+    fth_result_t p = fth_compile(&parser, &x);
+    char *error = parser.error;
+    fth_stream stream;
+    check_trickle trickle = { source, 0 };
+    parser_init_stream(&parser, &b, &stream, trickle_read, &trickle);
+    fth_result_t q = fth_compile(&parser, &y);
+    bool match = p == q &&
+                 (!error) == (!parser.error) &&
+                 (!error || !strcmp(error, parser.error)) &&
+                 chunks_match(&x, &y) &&
+                 garry_count(a.words) == garry_count(b.words);
+    for (int i = 0; match && i < garry_count(a.words); i++)
+        match = same_chars(fth_obj(a.words[i].name), fth_obj(b.words[i].name)) && chunks_match(a.words[i].chunk, b.words[i].chunk);
+    free(error);
+    free(parser.error);
+    free(stream.buffer);
+    chunk_free(&x);
+    chunk_free(&y);
+    fth_destroy(&a);
+    fth_destroy(&b);
+    return match;
+}
+
+static char image_path[] = "/tmp/fth-check-XXXXXX";
+
+// Compiled, saved as an image and loaded into a VM that already has words of
+// its own, so CALLs are rebased, and both runs have to agree
+static bool image_matches(const char *source) {
+    fth_vm a, b;
+    fth_init(&a);
+    fth_init(&b);
+    fth_exec(&b, (const unsigned char*)": unrelated 1 ; : other unrelated ; 0");
+    stack_reset(&b);
+    bool match = false;
+    fth_chunk *chunk = fth_compile_chunk(&a, (const unsigned char*)source), *loaded;
+    if (!chunk || !fth_save_chunk(&a, chunk, image_path) || !(loaded = fth_load_chunk(&b, image_path)))
+        goto BAIL;
+    fth_result_t x = fth_run_chunk(&a, chunk);
+    fth_result_t y = fth_run_chunk(&b, loaded);
+    match = x == y &&
+            (!a.error) == (!b.error) &&
+            (!a.error || !strcmp(a.error, b.error)) &&
+            stacks_match(&a.stack, &b.stack);
+BAIL:
+    free(a.error);
+    free(b.error);
+    fth_destroy(&a);
+    fth_destroy(&b);
+    return match;
+}
+
+// A program has to give the same result as fth_exec, in a VM with words of
+// its own, which the run must leave alone
+static bool program_matches(const char *source) {
+    fth_vm a, b;
+    fth_init(&a);
+    fth_init(&b);
+    fth_exec(&b, (const unsigned char*)": unrelated 1 ; : other unrelated ; 0");
+    stack_reset(&b);
+    char *error = NULL;
+    fth_program *program = fth_compile_program((const unsigned char*)source, &error);
+    fth_result_t x = fth_exec(&a, (const unsigned char*)source);
+    fth_result_t y = program ? fth_run_program(&b, program) : FTH_COMPILE_ERROR;
+    if (!program)
+        b.error = error;
+    bool match = x == y &&
+                 (!a.error) == (!b.error) &&
+                 (!a.error || !strcmp(a.error, b.error)) &&
+                 stacks_match(&a.stack, &b.stack) &&
+                 garry_count(b.words) == 2;
+    free(a.error);
+    free(b.error);
+    fth_free_program(program);
+    fth_destroy(&a);
+    fth_destroy(&b);
+    return match;
+}
+
+// Run twice through a compile cache, so the second run is a hit, a program
+// has to leave the same stack as running it twice uncached
+static bool cache_matches(const char *source) {
+    fth_vm a, b;
+    fth_init(&a);
+    fth_init_ex(&b, &(fth_config) { .compile_cache = 4 });
+    bool match = true;
+    for (int i = 0; match && i < 2; i++) {
+        fth_result_t x = fth_exec(&a, (const unsigned char*)source);
+        fth_result_t y = fth_exec(&b, (const unsigned char*)source);
+        match = x == y &&
+                (!a.error) == (!b.error) &&
+                (!a.error || !strcmp(a.error, b.error)) &&
+                stacks_match(&a.stack, &b.stack);
+        free(a.error);
+        free(b.error);
+        a.error = b.error = NULL;
+    }
+    // Errors aren't cached, everything else should have hit the second time
+    match = match && b.cache.hits + b.cache.misses == 2 && b.cache.hits == (a.stack.top > a.stack.base || !a.error);
+    fth_destroy(&a);
+    fth_destroy(&b);
+    return match;
+}
+
+// A cached call to a word has to see it redefined
+static bool cache_redefines(void) {
+    fth_vm vm;
+    fth_value value;
+    fth_init_ex(&vm, &(fth_config) { .compile_cache = 4 });
+    fth_exec(&vm, (const unsigned char*)": f 1 ; 0");
+    fth_exec(&vm, (const unsigned char*)"f 0");
+    fth_exec(&vm, (const unsigned char*)": f 2 ; 0");
+    fth_exec(&vm, (const unsigned char*)"f 0");
+    bool match = fth_stack_pop(&vm, &value) == FTH_OK && fth_is_integer(value) && fth_as_integer(value) == 2;
+    fth_destroy(&vm);
+    return match;
+}
+
+typedef struct {
+    size_t events[4];
+    size_t bytes;
+} check_trace;
+
+static void trace_count(fth_vm *vm, const fth_trace_event *event, void *user) {
+    check_trace *trace = user;
+    trace->events[__builtin_ctz(event->type)]++;
+    // Every placed instruction has to disassemble
+    if (event->chunk)
+        disassemble_instruction(&(fth_writer) { check_sink, &trace->bytes }, event->chunk, event->offset);
+}
+
+// Tracing everything must not change what a program does, and unless
+// FTH_NO_TRACE compiled the hooks out, the hook has to see it compiled and
+// run
+static bool trace_matches(const char *source) {
+    fth_vm a, b;
+    check_trace trace = {0};
+    fth_init(&a);
+    fth_init(&b);
+    b.trace = (fth_trace) { FTH_TRACE_ALL, trace_count, &trace };
+    fth_result_t x = fth_exec(&a, (const unsigned char*)source);
+    fth_result_t y = fth_exec(&b, (const unsigned char*)source);
+    bool match = x == y &&
+                 (!a.error) == (!b.error) &&
+                 (!a.error || !strcmp(a.error, b.error)) &&
+                 stacks_match(&a.stack, &b.stack) &&
+                 (!FTH_TRACE || (trace.events[0] && (y == FTH_COMPILE_ERROR || (trace.events[1] && trace.events[2] && trace.bytes))));
+    free(a.error);
+    free(b.error);
+    fth_destroy(&a);
+    fth_destroy(&b);
+    return match;
+}
+
+// Every emit is traced with the line the compiler meant, the line table has
+// to give it back
+static void trace_lines(fth_vm *vm, const fth_trace_event *event, void *user) {
+    if (event->type == FTH_TRACE_EMIT && get_line(event->chunk, event->offset) != event->line)
+        (*(int*)user)++;
+}
+
+// Stripping lines must not change what a program does, and leaves every
+// instruction on line 0
+static bool lines_match(const char *source) {
+    fth_vm a, b;
+    int wrong = 0;
+    fth_init(&a);
+    fth_init_ex(&b, &(fth_config) { .strip_lines = true });
+    a.trace = (fth_trace) { FTH_TRACE_EMIT, trace_lines, &wrong };
+    fth_result_t x = fth_exec(&a, (const unsigned char*)source);
+    fth_result_t y = fth_exec(&b, (const unsigned char*)source);
+    bool match = x == y &&
+                 (!a.error) == (!b.error) &&
+                 (!a.error || !strcmp(a.error, b.error)) &&
+                 stacks_match(&a.stack, &b.stack) &&
+                 !wrong;
+    for (int i = 0; match && i < garry_count(b.words); i++)
+        match = !b.words[i].chunk->lines && !get_line(b.words[i].chunk, 0);
+    free(a.error);
+    free(b.error);
+    fth_destroy(&a);
+    fth_destroy(&b);
+    return match;
+}
+
+#if FTH_PROFILE && FTH_TRACE
+// The profiler has to count exactly the instructions the trace hook sees,
+// and calls to each word by name
+static bool profile_matches(const char *source) {
+    fth_vm vm;
+    fth_init(&vm);
+    check_trace trace = {0};
+    vm.trace = (fth_trace) { FTH_TRACE_OP, trace_count, &trace };
+    bool started = fth_profile_start(&vm);
+    fth_exec(&vm, (const unsigned char*)source);
+    fth_profile *profile = fth_profile_stop(&vm);
+    fth_profile_entry entries[64];
+    int count = fth_profile_entries(profile, FTH_PROFILE_OPS, entries, 64);
+    uint64_t ops = 0, calls = 0, pairs = 0;
+    for (int i = 0; i < count; i++) {
+        ops += entries[i].count;
+        if (!strcmp(entries[i].name, "CALL"))
+            calls = entries[i].count;
+    }
+    count = fth_profile_entries(profile, FTH_PROFILE_PAIRS, entries, 64);
+    for (int i = 0; i < count; i++)
+        pairs += entries[i].count;
+    count = fth_profile_entries(profile, FTH_PROFILE_WORDS, entries, 64);
+    for (int i = 0; i < count; i++)
+        calls -= entries[i].count * (entries[i].name != NULL);
+    bool match = started && ops == trace.events[2] && calls == 0 && pairs == (ops ? ops - 1 : 0);
+    fth_profile_free(profile);
+    free(vm.error);
+    fth_destroy(&vm);
+    return match;
+}
+#endif
+
+#if FTH_JIT
+static fth_result_t fth_run_jit(fth_vm *vm) {
+    if (!vm->chunk->jit && !jit_compile(vm->chunk)) {
+        vm->error = strdup("jit_compile failed");
+        return FTH_RUNTIME_ERROR;
+    }
+    return ((fth_jit_fn)vm->chunk->jit)(vm);
+}
+
+// Runs the chunk through the interpreter and as native code, with words
+// called through the interpreter or, for a threshold of 0, compiled on their
+// first call
+
+static bool differential(fth_chunk *chunk, fth_word *words, int word_threshold) {
+    fth_config config = { .jit_threshold = -1 };
+    fth_vm interp, jit;
+    fth_init_ex(&interp, &config);
+    fth_init_ex(&jit, &config);
+    jit.jit_threshold = word_threshold;
+    interp.words = jit.words = words;
+    interp.chunk = jit.chunk = chunk;
+    interp.sp = jit.sp = chunk->data;
+    fth_result_t a = fth_run(&interp);
+    fth_result_t b = fth_run_jit(&jit);
+    bool match = a == b &&
+                 (!interp.error) == (!jit.error) &&
+                 (!interp.error || !strcmp(interp.error, jit.error)) &&
+                 stacks_match(&interp.stack, &jit.stack) &&
+                 // frames left by an error differ, and fth_exec unwinds them anyway
+                 (a != FTH_OK || stacks_match(&interp.return_stack, &jit.return_stack));
+    free(interp.error);
+    free(jit.error);
+    interp.words = jit.words = NULL;
+    fth_destroy(&interp);
+    fth_destroy(&jit);
+    return match;
+}
+
+// Before and after the peephole pass, and with both word thresholds
+static bool jit_matches(const char *source) {
+    bool match = true;
+    for (int optimize = 0; match && optimize < 2; optimize++) {
+        fth_chunk chunk;
+        chunk_init(&chunk);
+        fth_vm compiler;
+        fth_init(&compiler);
+        fth_parser parser;
+        parser_init(&parser, &compiler, (const unsigned char*)source);
+        match = fth_compile(&parser, &chunk) == FTH_OK;
+        free(parser.error);
+        if (match && optimize)
+            chunk_optimize(&chunk);
+        match = match && differential(&chunk, compiler.words, -1) && differential(&chunk, compiler.words, 0);
+        fth_destroy(&compiler);
+        chunk_free(&chunk);
+    }
+    return match;
+}
+#endif
+
+#define CONSTANT_LITERALS 4096
+#define CONSTANT_DISTINCT 1000
+#define CONSTANT_WORDS 512
+
+// Sums literals in a fresh VM, `dup` leaves the sum for the caller once
+// RETURN has printed it
+static bool constants_sum(const fth_config *config, const char *source, fth_int expect, fth_chunk **compiled, fth_vm *vm) {
+    fth_init_ex(vm, config);
+    fth_chunk *chunk = fth_compile_chunk(vm, (const unsigned char*)source);
+    fth_value value;
+    bool match = chunk && fth_run_chunk(vm, chunk) == FTH_OK &&
+                 fth_stack_pop(vm, &value) == FTH_OK && fth_is_integer(value) && fth_as_integer(value) == expect;
+#if FTH_JIT
+    match = match && differential(chunk, vm->words, -1) && differential(chunk, vm->words, 0);
+#endif
+    *compiled = chunk;
+    return match;
+}
+
+static int count_op(fth_chunk *chunk, uint8_t op) {
+    int count = 0;
+    for (int offset = 0; offset < garry_count(chunk->data); offset += op_length(chunk->data[offset]))
+        count += chunk->data[offset] == op;
+    return count;
+}
+
+// Repeated literals reuse pool entries and stay on the 1-byte operand,
+// distinct ones past 256 go through CONSTANT_LONG, and a shared table holds
+// each literal once however many words use it
+static bool constants_match(void) {
+    char *source = malloc(CONSTANT_WORDS * 64 + CONSTANT_LITERALS * 48);
+    fth_int sum = 0;
+    char *cursor = source + sprintf(source, "0");
+    for (int i = 0; i < CONSTANT_LITERALS; i++) {
+        cursor += sprintf(cursor, " %d + \"a long literal used %d times\" drop 2.5 drop", i % 16, CONSTANT_LITERALS);
+        sum += i % 16;
+    }
+    sprintf(cursor, " dup");
+    fth_vm vm;
+    fth_chunk *chunk;
+    bool repeated = constants_sum(NULL, source, sum, &chunk, &vm);
+    int entries = chunk ? garry_count(chunk->constants) : -1;
+    repeated = repeated && entries == 18 && !count_op(chunk, FTH_OP_CONSTANT_LONG);
+    fth_destroy(&vm);
+
+    cursor = source + sprintf(source, "0");
+    for (int i = sum = 0; i < CONSTANT_DISTINCT; i++, sum += i)
+        cursor += sprintf(cursor, " %d +", i + 1);
+    sprintf(cursor, " dup");
+    bool distinct = constants_sum(NULL, source, sum, &chunk, &vm);
+    int longs = chunk ? count_op(chunk, FTH_OP_CONSTANT_LONG) : -1;
+    distinct = distinct && longs == CONSTANT_DISTINCT + 1 - 256;
+    fth_destroy(&vm);
+
+    // Every word adds its own index mod 8, the pool only ever sees 0-7 and
+    // the program's 0
+    cursor = source;
+    for (int i = sum = 0; i < CONSTANT_WORDS; i++, sum += i % 8)
+        cursor += sprintf(cursor, ": w%d %d + ; ", i, i % 8);
+    cursor += sprintf(cursor, "0");
+    for (int i = 0; i < CONSTANT_WORDS; i++)
+        cursor += sprintf(cursor, " w%d", i);
+    sprintf(cursor, " dup");
+    bool shared = constants_sum(&(fth_config) { .shared_constants = 64 }, source, sum, &chunk, &vm);
+    int pool = vm.constants ? garry_count(vm.constants->values) : -1;
+    fth_collect(&vm);
+    shared = shared && pool == 8 && chunk->shared_constants && fth_run_chunk(&vm, chunk) == FTH_OK;
+    fth_destroy(&vm);
+    // A full table fails the compile rather than spill into a pool of its own
+    fth_init_ex(&vm, &(fth_config) { .shared_constants = 4 });
+    shared = shared && fth_exec(&vm, (const unsigned char*)"1 2 3 4 5") == FTH_COMPILE_ERROR && !strcmp(vm.error, "too many constants");
+    free(vm.error);
+    fth_destroy(&vm);
+    free(source);
+    fprintf(report, "constants: %d literals in %d entries, %d distinct with %d CONSTANT_LONG, %d words sharing %d entries\n", CONSTANT_LITERALS * 3, entries, CONSTANT_DISTINCT, longs, CONSTANT_WORDS, pool);
+    return repeated && distinct && shared;
+}
+
+// A word quickens for what it first ran on and deoptimizes for good when
+// that changes, with every result the same as the generic ops would give. A
+// program's sealed chunks are never rewritten
+static bool quicken_matches(void) {
+    static const struct {
+        const char *source;
+        double expect;
+        uint8_t mul, add;
+    } runs[] = {
+        {"3 f dup", 10, FTH_OP_INT_MUL, FTH_OP_INT_ADD_CONSTANT},
+        {"2.5 f dup", 7.25, FTH_OP_MIXED_MUL, FTH_OP_MIXED_ADD_CONSTANT},
+        {"4 f dup", 17, FTH_OP_MIXED_MUL, FTH_OP_MIXED_ADD_CONSTANT},
+        {"\"x\" f", -1, FTH_OP_MIXED_MUL, FTH_OP_MIXED_ADD_CONSTANT}
+    };
+    fth_vm vm;
+    fth_init_ex(&vm, &(fth_config) { .jit_threshold = -1 });
+    bool match = fth_exec(&vm, (const unsigned char*)": f dup * 1 + ; 0") == FTH_OK;
+    for (int i = 0; match && i < sizeof(runs) / sizeof(runs[0]); i++) {
+        fth_result_t result = fth_exec(&vm, (const unsigned char*)runs[i].source);
+        fth_value value;
+        fth_float number;
+        if (runs[i].expect < 0)
+            match = result == FTH_RUNTIME_ERROR;
+        else
+            match = result == FTH_OK && fth_stack_pop(&vm, &value) == FTH_OK && as_float(value, &number) && number == runs[i].expect;
+#if FTH_QUICKEN
+        fth_chunk *word = vm.words[0].chunk;
+        match = match && count_op(word, runs[i].mul) == 1 && count_op(word, runs[i].add) == 1;
+#endif
+        free(vm.error);
+        vm.error = NULL;
+    }
+    fth_destroy(&vm);
+    fth_program *program = fth_compile_program((const unsigned char*)": f dup * 1 + ; 3 f 2.5 f", NULL);
+    fth_chunk *word = program->vm.words[0].chunk;
+    uint8_t *code = malloc(garry_count(word->data));
+    memcpy(code, word->data, garry_count(word->data));
+    fth_init_ex(&vm, &(fth_config) { .jit_threshold = -1 });
+    match = match && fth_run_program(&vm, program) == FTH_OK && !memcmp(code, word->data, garry_count(word->data));
+    fth_destroy(&vm);
+    fth_free_program(program);
+    free(code);
+    return match;
+}
+
+// A site fed integers and floats in turn settles on its MIXED_ op after the
+// first change of type, rather than being rewritten on every run
+static bool quicken_settles(void) {
+    fth_vm vm;
+    fth_init_ex(&vm, &(fth_config) { .jit_threshold = -1 });
+    bool match = fth_exec(&vm, (const unsigned char*)": g + ; 0") == FTH_OK;
+    for (int i = 0; match && i < 16; i++) {
+        char source[32];
+        snprintf(source, sizeof(source), i & 1 ? "%d.5 1.0 g dup" : "%d 1 g dup", i);
+        fth_value value;
+        fth_float number;
+        match = fth_exec(&vm, (const unsigned char*)source) == FTH_OK && fth_stack_pop(&vm, &value) == FTH_OK && as_float(value, &number) && number == i + 1 + (i & 1) * .5;
+#if FTH_QUICKEN
+        uint8_t expect = !i ? FTH_OP_INT_ADD : FTH_OP_MIXED_ADD;
+        match = match && count_op(vm.words[0].chunk, expect) == 1;
+#endif
+        stack_reset(&vm);
+    }
+    fth_destroy(&vm);
+    return match;
+}
+
+typedef struct {
+    const char *name;
+    bool (*matches)(const char *source);
+} check_differential;
+
+static const check_differential differentials[] = {
+#if FTH_JIT
+    {"jit", jit_matches},
+#endif
+    {"stream", stream_matches},
+    {"image", image_matches},
+    {"program", program_matches},
+    {"cache", cache_matches},
+    {"trace", trace_matches},
+    {"lines", lines_match},
+#if FTH_PROFILE && FTH_TRACE
+    {"profile", profile_matches},
+#endif
+};
+
+// Each stack holds exactly the depth it was configured with, through the
+// API and from a running program
+static bool stacks_fit(void) {
+    fth_vm vm;
+    fth_init_ex(&vm, &(fth_config) { .stack_depth = 4, .return_stack_depth = 2 });
+    bool fits = true;
+    for (int i = 0; i < 4; i++)
+        fits = fits && fth_stack_push(&vm, fth_integer(i)) == FTH_OK;
+    fits = fits && fth_stack_push(&vm, fth_integer(4)) == FTH_RUNTIME_ERROR;
+    stack_reset(&vm);
+    // dup leaves the fourth value for RETURN to take
+    fits = fits && fth_exec(&vm, (const unsigned char*)"1 2 3 dup") == FTH_OK && vm.stack.top - vm.stack.base == 3;
+    stack_reset(&vm);
+    fits = fits && fth_exec(&vm, (const unsigned char*)"1 2 3 4 5") == FTH_RUNTIME_ERROR;
+    free(vm.error);
+    vm.error = NULL;
+    stack_reset(&vm);
+    fits = fits && fth_exec(&vm, (const unsigned char*)"1 >r 2 >r r> r> + dup") == FTH_OK;
+    stack_reset(&vm);
+    fits = fits && fth_exec(&vm, (const unsigned char*)"1 >r 2 >r 3 >r 0") == FTH_RUNTIME_ERROR;
+    free(vm.error);
+    fth_destroy(&vm);
+    fth_init(&vm);
+    stack_reset(&vm);
+    for (int i = 0; i < FTH_STACK_DEPTH; i++)
+        fits = fits && fth_stack_push(&vm, fth_integer(i)) == FTH_OK;
+    fits = fits && fth_stack_push(&vm, fth_nil()) == FTH_RUNTIME_ERROR;
+    fth_destroy(&vm);
+    return fits;
+}
+
+// Records what the VM has out, so every free can be checked against the
+// size it was allocated with, and fails every allocation after `budget`
+typedef struct {
+    void *ptrs[256];
+    size_t sizes[256];
+    int count, budget, wrong;
+} check_allocator;
+
+static void* check_alloc(void *user, size_t size) {
+    check_allocator *allocator = user;
+    if (!allocator->budget || allocator->count == 256)
+        return NULL;
+    allocator->budget--;
+    void *ptr = malloc(size);
+    allocator->ptrs[allocator->count] = ptr;
+    allocator->sizes[allocator->count++] = size;
+    return ptr;
+}
+
+static void check_free(void *user, void *ptr, size_t size) {
+    check_allocator *allocator = user;
+    for (int i = 0; i < allocator->count; i++)
+        if (allocator->ptrs[i] == ptr) {
+            allocator->wrong += allocator->sizes[i] != size;
+            allocator->ptrs[i] = allocator->ptrs[--allocator->count];
+            allocator->sizes[i] = allocator->sizes[allocator->count];
+            free(ptr);
+            return;
+        }
+    allocator->wrong++;
+}
+
+// Frees match their allocations, and running out anywhere, from the stacks
+// to a string too long for the arena's classes, is an error rather than a
+// crash
+static bool allocations_balance(void) {
+    char source[2048];
+    int length = 0;
+    for (int i = 0; i < 3; i++) {
+        length += sprintf(source + length, "\"%d", i);
+        memset(source + length, 'x', 600);
+        length += 600;
+        length += sprintf(source + length, "\" drop ");
+    }
+    strcpy(source + length, "1 dup");
+    bool balanced = true, completed = false;
+    for (int budget = 0; budget < 16 && balanced; budget++) {
+        check_allocator allocator = { .budget = budget };
+        fth_vm vm;
+        if (fth_init_ex(&vm, &(fth_config) { .allocator = { check_alloc, check_free, &allocator } })) {
+            fth_result_t result = fth_exec(&vm, (const unsigned char*)source);
+            completed = result == FTH_OK;
+            balanced = result == FTH_OK || (result == FTH_COMPILE_ERROR && !strcmp(vm.error, "out of memory"));
+            free(vm.error);
+            vm.error = NULL;
+            fth_destroy(&vm);
+        }
+        balanced = balanced && !allocator.count && !allocator.wrong;
+    }
+    return balanced && completed;
+}
+
+typedef struct {
+    const char *name;
+    bool (*passes)(void);
+} check_case;
+
+static const check_case checks[] = {
+    {"stack depth", stacks_fit},
+    {"allocations", allocations_balance},
+    {"cache redefinition", cache_redefines},
+    {"constants", constants_match},
+    {"quicken", quicken_matches},
+    {"quicken settling", quicken_settles},
+};
+
+int main(int argc, const char *argv[]) {
+    // RETURN prints the final value, keep that out of the report
+    fflush(stdout);
+    report = fdopen(dup(fileno(stdout)), "w");
+    freopen("/dev/null", "w", stdout);
+    close(mkstemp(image_path));
+
+    int failures = 0, programs = sizeof(differential_corpus) / sizeof(differential_corpus[0]);
+    for (int d = 0; d < sizeof(differentials) / sizeof(differentials[0]); d++) {
+        int matched = 0;
+        for (int i = 0; i < programs; i++)
+            if (differentials[d].matches(differential_corpus[i]))
+                matched++;
+            else
+                fprintf(report, "%s mismatch: %s\n", differentials[d].name, differential_corpus[i]);
+        fprintf(report, "%s differential: %d/%d programs match\n", differentials[d].name, matched, programs);
+        failures += matched != programs;
+    }
+    for (int c = 0; c < sizeof(checks) / sizeof(checks[0]); c++) {
+        bool passed = checks[c].passes();
+        fprintf(report, "%s: %s\n", checks[c].name, passed ? "ok" : "FAILED");
+        failures += !passed;
+    }
+
+    unlink(image_path);
+    fclose(report);
+    return failures != 0;
+}
@@ -0,0 +1,136 @@
+// Objects come from a per-VM arena instead of malloc. Sizes are rounded up
+// to a power-of-two class between 16 and 512 bytes and bump allocated from
+// large blocks; freed objects go on a free list for their class and are
+// reused before the bump pointer moves. Anything bigger gets its own
+// allocation on a list. Nothing is returned to the allocator until the VM is
+// reset or destroyed, when every block and large allocation goes at once.
+//
+// Blocks, large objects and the stacks all come from vm->allocator, which
+// defaults to malloc/free and can be replaced through fth_config.
+
+#define ARENA_MIN_CLASS 4 // 16 bytes
+#define ARENA_MAX_CLASS 9 // 512 bytes
+#define ARENA_CLASSES (ARENA_MAX_CLASS - ARENA_MIN_CLASS + 1)
+#ifndef FTH_ARENA_BLOCK_SIZE
+#define FTH_ARENA_BLOCK_SIZE (64 * 1024)
+#endif
+
+typedef struct arena_free {
+    struct arena_free *next;
+} arena_free;
+
+typedef struct arena_block {
+    struct arena_block *next;
+    size_t size;
+} arena_block;
+
+typedef struct arena_large {
+    struct arena_large *next, *prev;
+    size_t size;
+    size_t _align;
+} arena_large;
+
+struct fth_arena {
+    uint8_t *cursor, *limit;
+    arena_free *free_lists[ARENA_CLASSES];
+    arena_block *blocks;
+    arena_large *large;
+};
+
+static void* default_alloc(void *user, size_t size) {
+    (void)user;
+    return malloc(size);
+}
+
+static void default_free(void *user, void *ptr, size_t size) {
+    (void)user;
+    (void)size;
+    free(ptr);
+}
+
+static void* vm_alloc(fth_vm *vm, size_t size) {
+    return vm->allocator.alloc(vm->allocator.user, size);
+}
+
+static void vm_free(fth_vm *vm, void *ptr, size_t size) {
+    vm->allocator.free(vm->allocator.user, ptr, size);
+}
+
+static int arena_class(size_t size) {
+    int class = ARENA_MIN_CLASS;
+    while (((size_t)1 << class) < size)
+        class++;
+    return class;
+}
+
+static void* arena_alloc(fth_vm *vm, size_t size) {
+    fth_arena *arena = vm->arena;
+    int class = arena_class(size);
+    if (class > ARENA_MAX_CLASS) {
+        arena_large *large = vm_alloc(vm, sizeof(arena_large) + size);
+        if (!large)
+            return NULL;
+        large->size = size;
+        large->prev = NULL;
+        large->next = arena->large;
+        if (arena->large)
+            arena->large->prev = large;
+        arena->large = large;
+        return large + 1;
+    }
+    arena_free **list = &arena->free_lists[class - ARENA_MIN_CLASS];
+    if (*list) {
+        void *result = *list;
+        *list = (*list)->next;
+        return result;
+    }
+    size_t rounded = (size_t)1 << class;
+    if ((size_t)(arena->limit - arena->cursor) < rounded) {
+        // The tail of the old block is abandoned until the next release
+        arena_block *block = vm_alloc(vm, FTH_ARENA_BLOCK_SIZE);
+        if (!block)
+            return NULL;
+        block->size = FTH_ARENA_BLOCK_SIZE;
+        block->next = arena->blocks;
+        arena->blocks = block;
+        arena->cursor = (uint8_t*)block + ((sizeof(arena_block) + 15) & ~(size_t)15);
+        arena->limit = (uint8_t*)block + FTH_ARENA_BLOCK_SIZE;
+    }
+    void *result = arena->cursor;
+    arena->cursor += rounded;
+    return result;
+}
+
+static void arena_dealloc(fth_vm *vm, void *ptr, size_t size) {
+    fth_arena *arena = vm->arena;
+    int class = arena_class(size);
+    if (class > ARENA_MAX_CLASS) {
+        arena_large *large = (arena_large*)ptr - 1;
+        if (large->prev)
+            large->prev->next = large->next;
+        else
+            arena->large = large->next;
+        if (large->next)
+            large->next->prev = large->prev;
+        vm_free(vm, large, sizeof(arena_large) + large->size);
+        return;
+    }
+    arena_free *node = ptr;
+    node->next = arena->free_lists[class - ARENA_MIN_CLASS];
+    arena->free_lists[class - ARENA_MIN_CLASS] = node;
+}
+
+static void arena_release(fth_vm *vm) {
+    fth_arena *arena = vm->arena;
+    while (arena->blocks) {
+        arena_block *next = arena->blocks->next;
+        vm_free(vm, arena->blocks, arena->blocks->size);
+        arena->blocks = next;
+    }
+    while (arena->large) {
+        arena_large *next = arena->large->next;
+        vm_free(vm, arena->large, sizeof(arena_large) + arena->large->size);
+        arena->large = next;
+    }
+    memset(arena, 0, sizeof(fth_arena));
+}
@@ -0,0 +1,141 @@
+// Chunks compiled by fth_exec, kept by the 128-bit murmur of their source so
+// a source seen before runs without being lexed or compiled again. Entries
+// are chained off a power of two bucket array and threaded on a list from
+// most to least recently used; once the cache is full the least recent one
+// makes way.
+//
+// A chunk has its CALLs resolved against the dictionary it was compiled
+// with, which only goes stale when a name is defined again. Every such
+// definition bumps cache.generation, and an entry from an older generation
+// is dropped instead of run.
+
+typedef struct fth_cache_entry {
+    uint64_t key[2];
+    size_t length;
+    uint64_t generation;
+    fth_chunk chunk;
+    // Next in the bucket
+    struct fth_cache_entry *chain;
+    struct fth_cache_entry *newer, *older;
+} fth_cache_entry;
+
+struct fth_cache_table {
+    fth_cache_entry **buckets;
+    int mask;
+    int count;
+    fth_cache_entry *newest, *oldest;
+};
+
+static void cache_key(const unsigned char *source, size_t length, uint64_t key[2]) {
+    unsigned char out[16];
+    MM86128(source, (int)length, 0, out);
+    memcpy(key, out, sizeof(out));
+}
+
+static fth_cache_entry** cache_bucket(fth_cache_table *table, const uint64_t key[2]) {
+    return &table->buckets[key[0] & table->mask];
+}
+
+static void cache_unlink(fth_cache_table *table, fth_cache_entry *entry) {
+    *(entry->newer ? &entry->newer->older : &table->newest) = entry->older;
+    *(entry->older ? &entry->older->newer : &table->oldest) = entry->newer;
+    entry->newer = entry->older = NULL;
+}
+
+static void cache_push(fth_cache_table *table, fth_cache_entry *entry) {
+    entry->newer = NULL;
+    entry->older = table->newest;
+    *(table->newest ? &table->newest->newer : &table->oldest) = entry;
+    table->newest = entry;
+}
+
+// Takes the entry out of both lists and frees its chunk, the entry is the
+// caller's to free or reuse
+static void cache_remove(fth_cache_table *table, fth_cache_entry *entry) {
+    fth_cache_entry **link = cache_bucket(table, entry->key);
+    while (*link != entry)
+        link = &(*link)->chain;
+    *link = entry->chain;
+    cache_unlink(table, entry);
+    chunk_free(&entry->chunk);
+    table->count--;
+}
+
+static fth_chunk* cache_find(fth_vm *vm, const uint64_t key[2], size_t length) {
+    fth_cache_table *table = vm->cache.table;
+    if (table)
+        for (fth_cache_entry *entry = *cache_bucket(table, key); entry; entry = entry->chain) {
+            if (entry->key[0] != key[0] || entry->key[1] != key[1] || entry->length != length)
+                continue;
+            if (entry->generation != vm->cache.generation) {
+                cache_remove(table, entry);
+                free(entry);
+                break;
+            }
+            cache_unlink(table, entry);
+            cache_push(table, entry);
+            vm->cache.hits++;
+            return &entry->chunk;
+        }
+    vm->cache.misses++;
+    return NULL;
+}
+
+// The cache takes over the chunk
+static fth_chunk* cache_insert(fth_vm *vm, const uint64_t key[2], size_t length, fth_chunk *chunk) {
+    fth_cache_table *table = vm->cache.table;
+    if (!table) {
+        table = vm->cache.table = calloc(1, sizeof(fth_cache_table));
+        int buckets = 1;
+        while (buckets < vm->cache.capacity)
+            buckets *= 2;
+        table->buckets = calloc(buckets, sizeof(fth_cache_entry*));
+        table->mask = buckets - 1;
+    }
+    fth_cache_entry *entry;
+    if (table->count >= vm->cache.capacity) {
+        entry = table->oldest;
+        cache_remove(table, entry);
+        vm->cache.evictions++;
+    } else
+        entry = malloc(sizeof(fth_cache_entry));
+    entry->key[0] = key[0];
+    entry->key[1] = key[1];
+    entry->length = length;
+    entry->generation = vm->cache.generation;
+    entry->chunk = *chunk;
+    fth_cache_entry **bucket = cache_bucket(table, key);
+    entry->chain = *bucket;
+    *bucket = entry;
+    cache_push(table, entry);
+    table->count++;
+    return &entry->chunk;
+}
+
+static void cache_free(fth_vm *vm) {
+    fth_cache_table *table = vm->cache.table;
+    if (!table)
+        return;
+    for (fth_cache_entry *entry = table->newest, *older; entry; entry = older) {
+        older = entry->older;
+        chunk_free(&entry->chunk);
+        free(entry);
+    }
+    free(table->buckets);
+    free(table);
+    vm->cache.table = NULL;
+}
+
+// Every word is defined through here, so redefinitions reach the cache. Only
+// a name that has been defined before needs looking for, which keeps a big
+// dictionary from costing a scan per definition
+static void define_word(fth_vm *vm, fth_word word) {
+    if (word.name->defined)
+        for (int i = garry_count(vm->words) - 1; i >= 0; i--)
+            if (vm->words[i].name == word.name) {
+                vm->cache.generation++;
+                break;
+            }
+    word.name->defined = true;
+    garry_append(vm->words, word);
+}
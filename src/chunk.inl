@@ -5,122 +5,339 @@
 //  Created by George Watson on 06/01/2025.
 //
 
+// X(NAME, OPERAND_BYTES). INT_*, FLOAT_* and MIXED_* are never compiled,
+// generic arithmetic rewrites itself to them as it runs (see QUICKEN in
+// run.inl)
+#define OPS \
+    X(RETURN, 0) \
+    X(CONSTANT, 1) \
+    X(CONSTANT_LONG, 3) \
+    X(CLEAR, 0) \
+    X(PERIOD, 0) \
+    X(POP, 0) \
+    X(PUSH, 0) \
+    X(DUMP, 0) \
+    X(DUMP_RSTACK, 0) \
+    X(ADD, 0) \
+    X(SUB, 0) \
+    X(MUL, 0) \
+    X(DIV, 0) \
+    X(DUP, 0) \
+    X(DROP, 0) \
+    X(SWAP, 0) \
+    X(OVER, 0) \
+    X(CONSTANT2, 2) \
+    X(ADD_CONSTANT, 1) \
+    X(SUB_CONSTANT, 1) \
+    X(MUL_CONSTANT, 1) \
+    X(DIV_CONSTANT, 1) \
+    X(INT_ADD, 0) \
+    X(INT_SUB, 0) \
+    X(INT_MUL, 0) \
+    X(INT_DIV, 0) \
+    X(FLOAT_ADD, 0) \
+    X(FLOAT_SUB, 0) \
+    X(FLOAT_MUL, 0) \
+    X(FLOAT_DIV, 0) \
+    X(INT_ADD_CONSTANT, 1) \
+    X(INT_SUB_CONSTANT, 1) \
+    X(INT_MUL_CONSTANT, 1) \
+    X(INT_DIV_CONSTANT, 1) \
+    X(FLOAT_ADD_CONSTANT, 1) \
+    X(FLOAT_SUB_CONSTANT, 1) \
+    X(FLOAT_MUL_CONSTANT, 1) \
+    X(FLOAT_DIV_CONSTANT, 1) \
+    X(MIXED_ADD, 0) \
+    X(MIXED_SUB, 0) \
+    X(MIXED_MUL, 0) \
+    X(MIXED_DIV, 0) \
+    X(MIXED_ADD_CONSTANT, 1) \
+    X(MIXED_SUB_CONSTANT, 1) \
+    X(MIXED_MUL_CONSTANT, 1) \
+    X(MIXED_DIV_CONSTANT, 1) \
+    X(RANGE_DROP, 5) \
+    X(RANGE_MOVE, 5) \
+    X(RANGE_ROLL, 5) \
+    X(RANGE_COPY, 5) \
+    X(RANGE_SET, 5) \
+    X(RANGE_PRINT, 5) \
+    X(CALL, 2) \
+    X(RET, 0)
+
 typedef enum {
-    FTH_OP_RETURN,
-    FTH_OP_CONSTANT,
-    FTH_OP_CONSTANT_LONG,
-    FTH_OP_CLEAR,
-    FTH_OP_PERIOD,
-    FTH_OP_POP,
-    FTH_OP_PUSH,
-    FTH_OP_DUMP,
-    FTH_OP_DUMP_RSTACK
+#define X(N, _) FTH_OP_##N,
+    OPS
+#undef X
+    FTH_OP_COUNT
 } fth_vm_op;
 
+static const uint8_t op_operands[FTH_OP_COUNT] = {
+#define X(N, LEN) [FTH_OP_##N] = LEN,
+    OPS
+#undef X
+};
+
+static inline int op_length(uint8_t op) {
+    return op < FTH_OP_COUNT ? 1 + op_operands[op] : 1;
+}
+
+// RANGE_* operands: flags, then the first and last cell of the slice as
+// 16-bit little-endian counts from the top of the stack
+#define FTH_RANGE_RSTACK 0x01
+#define FTH_RANGE_BOTTOM 0xffff
+#define FTH_RANGE_FROM(OPERANDS) ((OPERANDS)[1] | (OPERANDS)[2] << 8)
+#define FTH_RANGE_TO(OPERANDS) ((OPERANDS)[3] | (OPERANDS)[4] << 8)
+
 typedef struct {
     int offset, line;
 } fth_chunk_linestart;
 
+// Constants by value, for reusing a pool entry instead of adding the same
+// literal again: an open addressed table of pool indices, -1 when empty.
+// `seen` is how much of the pool has been indexed
+typedef struct {
+    int *slots;
+    int capacity, count, seen;
+} fth_constant_index;
+
+// CONSTANT_LONG's index is 24 bits
+#define FTH_CONSTANTS_MAX (1 << 24)
+
 struct fth_chunk {
     uint8_t *data;
     fth_value *constants;
-    fth_chunk_linestart *lines;
+    fth_constant_index constant_index;
+    // Set when constants is the VM's shared table rather than the chunk's
+    // own, see constants.inl
+    bool shared_constants;
+    // A varint pair for every change of line: the bytes since the previous
+    // change and the zigzagged difference in line. Line 0 is unknown, and a
+    // stripped chunk has no table at all
+    uint8_t *lines;
+    // Where chunk_write left the table
+    int line_offset, line;
+    // The table decoded for lookups, built on the first one, and how many
+    // bytes of it that covers
+    fth_chunk_linestart *line_index;
+    int line_decoded;
+    // Set when data and lines are borrowed from a loaded image, see image.inl
+    fth_object *image;
+    // Set on a program's chunks, which are shared between threads, so
+    // quickening leaves their code alone
+    bool sealed;
+    int runs;
+#if FTH_JIT
+    void *jit;
+    size_t jit_size;
+    bool jit_failed;
+#endif
 };
 
 static void chunk_init(fth_chunk *chunk) {
-    chunk->data = NULL;
-    chunk->constants = NULL;
+    memset(chunk, 0, sizeof(fth_chunk));
+}
+
+// Drops the line table, lookups report line 0 until more is written
+static void chunk_strip_lines(fth_chunk *chunk) {
+    if (!chunk->image)
+        garry_free(chunk->lines);
     chunk->lines = NULL;
+    garry_free(chunk->line_index);
+    chunk->line_index = NULL;
+    chunk->line_offset = chunk->line = chunk->line_decoded = 0;
 }
 
 static void chunk_free(fth_chunk *chunk) {
-    garry_free(chunk->data);
-    garry_free(chunk->constants);
-    garry_free(chunk->lines);
+#if FTH_JIT
+    if (chunk->jit)
+        munmap(chunk->jit, chunk->jit_size);
+#endif
+    if (!chunk->image)
+        garry_free(chunk->data);
+    chunk_strip_lines(chunk);
+    if (!chunk->shared_constants)
+        garry_free(chunk->constants);
+    free(chunk->constant_index.slots);
     memset(chunk, 0, sizeof(fth_chunk));
 }
 
+static void lines_put(uint8_t **lines, uint32_t value) {
+    while (value >= 0x80) {
+        garry_append(*lines, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    garry_append(*lines, (uint8_t)value);
+}
+
+// Returns false for a varint that runs off the end or past 32 bits
+static bool lines_get(const uint8_t **p, const uint8_t *end, uint32_t *value) {
+    *value = 0;
+    for (int shift = 0; *p < end && shift < 32; shift += 7) {
+        uint8_t byte = *(*p)++;
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            return true;
+    }
+    return false;
+}
+
 static void chunk_write(fth_chunk *chunk, uint8_t byte, int line) {
     garry_append(chunk->data, byte);
-    if (chunk->lines && garry_count(chunk->lines) > 0) {
-        fth_chunk_linestart *linestart = garry_last(chunk->lines);
-        if (linestart && linestart->line == line)
-            return;
+    if (line == chunk->line)
+        return;
+    int offset = garry_count(chunk->data) - 1;
+    uint32_t delta = (uint32_t)line - (uint32_t)chunk->line;
+    lines_put(&chunk->lines, offset - chunk->line_offset);
+    lines_put(&chunk->lines, delta << 1 ^ -(delta >> 31));
+    chunk->line_offset = offset;
+    chunk->line = line;
+}
+
+// Decodes whatever was written since the last lookup. Images are checked to
+// decode cleanly when they load (see image_check_lines)
+static void chunk_index_lines(fth_chunk *chunk) {
+    int count = garry_count(chunk->line_index);
+    fth_chunk_linestart last = count ? chunk->line_index[count - 1] : (fth_chunk_linestart) {0, 0};
+    const uint8_t *p = chunk->lines + chunk->line_decoded;
+    const uint8_t *end = chunk->lines + garry_count(chunk->lines);
+    uint32_t offset, line;
+    while (lines_get(&p, end, &offset) && lines_get(&p, end, &line)) {
+        last.offset += offset;
+        last.line = (int)((uint32_t)last.line + (line >> 1 ^ -(line & 1)));
+        garry_append(chunk->line_index, last);
+        chunk->line_decoded = (int)(p - chunk->lines);
     }
-    fth_chunk_linestart result = {
-        .offset = garry_count(chunk->data) - 1,
-        .line = line
-    };
-    garry_append(chunk->lines, result);
 }
 
 static int get_line(fth_chunk *chunk, int instruction) {
+    if (chunk->line_decoded < garry_count(chunk->lines))
+        chunk_index_lines(chunk);
     int start = 0;
-    int end = garry_count(chunk->lines) - 1;
-    for (;;) {
+    int end = garry_count(chunk->line_index) - 1;
+    int result = 0;
+    while (start <= end) {
         int mid = (start + end) / 2;
-        fth_chunk_linestart *line = &chunk->lines[mid];
-        if (instruction < line->offset)
+        if (instruction < chunk->line_index[mid].offset)
             end = mid - 1;
-        else if (mid == garry_count(chunk->lines) - 1 || instruction < chunk->lines[mid + 1].offset)
-            return line->line;
-        else
+        else {
+            result = chunk->line_index[mid].line;
             start = mid + 1;
+        }
     }
+    return result;
 }
 
-static int constant_instruction(const char *name, fth_chunk *chunk, int offset) {
+static const char *op_names[FTH_OP_COUNT] = {
+#define X(N, _) [FTH_OP_##N] = #N,
+    OPS
+#undef X
+};
+
+static const char* op_name(uint8_t op) {
+    return op < FTH_OP_COUNT ? op_names[op] : "UNKNOWN";
+}
+
+static int constant_instruction(fth_writer *out, const char *name, fth_chunk *chunk, int offset) {
     uint8_t c = chunk->data[offset + 1];
-    printf("%-16s %4d '", name, c);
-    fth_print_value(chunk->constants[c]);
-    printf("'\n");
+    write_format(out, "%-16s %4d '", name, c);
+    write_value(out, chunk->constants[c]);
+    write_format(out, "'\n");
     return offset + 2;
 }
 
-static int long_constant_instruction(const char *name, fth_chunk *chunk, int offset) {
+static int long_constant_instruction(fth_writer *out, const char *name, fth_chunk *chunk, int offset) {
     uint32_t c = chunk->data[offset + 1] | (chunk->data[offset + 2] << 8) | (chunk->data[offset + 3] << 16);
-    printf("%-16s %4d '", name, c);
-    fth_print_value(chunk->constants[c]);
-    printf("'\n");
+    write_format(out, "%-16s %4d '", name, c);
+    write_value(out, chunk->constants[c]);
+    write_format(out, "'\n");
     return offset + 4;
 }
 
-static int simple_instruction(const char* name, int offset) {
-    printf("%s\n", name);
+static int constant2_instruction(fth_writer *out, const char *name, fth_chunk *chunk, int offset) {
+    uint8_t a = chunk->data[offset + 1], b = chunk->data[offset + 2];
+    write_format(out, "%-16s %4d '", name, a);
+    write_value(out, chunk->constants[a]);
+    write_format(out, "' %4d '", b);
+    write_value(out, chunk->constants[b]);
+    write_format(out, "'\n");
+    return offset + 3;
+}
+
+static int range_instruction(fth_writer *out, const char *name, fth_chunk *chunk, int offset) {
+    const uint8_t *operands = &chunk->data[offset + 1];
+    int from = FTH_RANGE_FROM(operands), to = FTH_RANGE_TO(operands);
+    write_format(out, "%-16s %s%d~", name, operands[0] & FTH_RANGE_RSTACK ? "r" : "", from);
+    if (to == FTH_RANGE_BOTTOM)
+        write_format(out, "*\n");
+    else
+        write_format(out, "%d\n", to);
+    return offset + 6;
+}
+
+static int call_instruction(fth_writer *out, const char *name, fth_chunk *chunk, int offset) {
+    write_format(out, "%-16s %4d\n", name, chunk->data[offset + 1] | chunk->data[offset + 2] << 8);
+    return offset + 3;
+}
+
+static int simple_instruction(fth_writer *out, const char* name, int offset) {
+    write_format(out, "%s\n", name);
     return offset + 1;
 }
 
-static int disassemble_instruction(fth_chunk *chunk, int offset) {
-    printf("%04d ", offset);
+static int disassemble_instruction(fth_writer *out, fth_chunk *chunk, int offset) {
+    write_format(out, "%04d ", offset);
     int line = get_line(chunk, offset);
     if (offset > 0 && line == get_line(chunk, offset - 1))
-        printf("   | ");
+        write_format(out, "   | ");
     else
-        printf("%4d ", line);
+        write_format(out, "%4d ", line);
     uint8_t instruction = chunk->data[offset];
+    char name[32];
+    snprintf(name, sizeof(name), "OP_%s", op_name(instruction));
     switch (instruction) {
-        case FTH_OP_RETURN:
-            return simple_instruction("OP_RETURN", offset);
         case FTH_OP_CONSTANT:
-            return constant_instruction("OP_CONSTANT", chunk, offset);
+        case FTH_OP_ADD_CONSTANT:
+        case FTH_OP_SUB_CONSTANT:
+        case FTH_OP_MUL_CONSTANT:
+        case FTH_OP_DIV_CONSTANT:
+        case FTH_OP_INT_ADD_CONSTANT:
+        case FTH_OP_INT_SUB_CONSTANT:
+        case FTH_OP_INT_MUL_CONSTANT:
+        case FTH_OP_INT_DIV_CONSTANT:
+        case FTH_OP_FLOAT_ADD_CONSTANT:
+        case FTH_OP_FLOAT_SUB_CONSTANT:
+        case FTH_OP_FLOAT_MUL_CONSTANT:
+        case FTH_OP_FLOAT_DIV_CONSTANT:
+        case FTH_OP_MIXED_ADD_CONSTANT:
+        case FTH_OP_MIXED_SUB_CONSTANT:
+        case FTH_OP_MIXED_MUL_CONSTANT:
+        case FTH_OP_MIXED_DIV_CONSTANT:
+            return constant_instruction(out, name, chunk, offset);
         case FTH_OP_CONSTANT_LONG:
-            return long_constant_instruction("OP_CONSTANT_LONG", chunk, offset);
-        case FTH_OP_PERIOD:
-            return simple_instruction("OP_PERIOD", offset);
-        case FTH_OP_DUMP:
-            return simple_instruction("OP_DUMP_STACK", offset);
-        case FTH_OP_DUMP_RSTACK:
-            return simple_instruction("OP_DUMP_RSTACK", offset);
+            return long_constant_instruction(out, name, chunk, offset);
+        case FTH_OP_CONSTANT2:
+            return constant2_instruction(out, name, chunk, offset);
+        case FTH_OP_RANGE_DROP:
+        case FTH_OP_RANGE_MOVE:
+        case FTH_OP_RANGE_ROLL:
+        case FTH_OP_RANGE_COPY:
+        case FTH_OP_RANGE_SET:
+        case FTH_OP_RANGE_PRINT:
+            return range_instruction(out, name, chunk, offset);
+        case FTH_OP_CALL:
+            return call_instruction(out, name, chunk, offset);
         default:
-            printf("Unknown opcode %d\n", instruction);
+            if (instruction < FTH_OP_COUNT)
+                return simple_instruction(out, name, offset);
+            write_format(out, "Unknown opcode %d\n", instruction);
             return offset + 1;
     }
 }
 
-static void chunk_disassemble(fth_chunk *chunk, const char *name) {
-    printf("== %s ==\n", name);
+static void chunk_disassemble(fth_writer *out, fth_chunk *chunk, const char *name) {
+    write_format(out, "== %s ==\n", name);
     for (int offset = 0; offset < garry_count(chunk->data);)
-        offset = disassemble_instruction(chunk, offset);
+        offset = disassemble_instruction(out, chunk, offset);
 }
 
 static int chunk_add_constant(fth_chunk *chunk, fth_value value) {
@@ -128,8 +345,108 @@ static int chunk_add_constant(fth_chunk *chunk, fth_value value) {
     return garry_count(chunk->constants) - 1;
 }
 
-static void chunk_write_constant(fth_chunk *chunk, fth_value value, int line) {
-    int index = chunk_add_constant(chunk, value);
+// A constant's identity is its type and bits, so interned strings match by
+// pointer and 0.0 stays apart from -0.0
+static void constant_bits(fth_value value, uint64_t bits[2]) {
+#ifdef FTH_NAN_BOXING
+    bits[0] = value;
+    bits[1] = 0;
+#else
+    // Small strings are zero padded, so all of the value is defined
+    if (value.type == FTH_VALUE_SMALL_STRING) {
+        memcpy(bits, &value, sizeof(fth_value));
+        return;
+    }
+    bits[0] = value.type;
+    bits[1] = 0;
+    switch (value.type) {
+        case FTH_VALUE_BOOLEAN:
+            bits[1] = value.as.boolean;
+            break;
+        case FTH_VALUE_INTEGER:
+            bits[1] = value.as.integer;
+            break;
+        case FTH_VALUE_NUMBER:
+            memcpy(&bits[1], &value.as.number, sizeof(fth_float));
+            break;
+        case FTH_VALUE_OBJECT:
+            bits[1] = (uint64_t)(uintptr_t)value.as.obj;
+            break;
+    }
+#endif
+}
+
+static int* constant_slot(fth_constant_index *index, const fth_value *pool, const uint64_t bits[2]) {
+    uint64_t hash = (bits[0] * 0x9e3779b97f4a7c15ull) ^ bits[1];
+    hash = (hash ^ (hash >> 33)) * 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    for (int i = (int)(hash & (index->capacity - 1));; i = (i + 1) & (index->capacity - 1)) {
+        int *slot = &index->slots[i];
+        if (*slot < 0)
+            return slot;
+        uint64_t other[2];
+        constant_bits(pool[*slot], other);
+        if (other[0] == bits[0] && other[1] == bits[1])
+            return slot;
+    }
+}
+
+static void constant_index_grow(fth_constant_index *index, const fth_value *pool) {
+    fth_constant_index grown = {
+        .capacity = index->capacity ? index->capacity * 2 : 64,
+        .seen = index->seen
+    };
+    grown.slots = malloc(grown.capacity * sizeof(int));
+    memset(grown.slots, 0xff, grown.capacity * sizeof(int));
+    for (int i = 0; i < index->capacity; i++)
+        if (index->slots[i] >= 0) {
+            uint64_t bits[2];
+            constant_bits(pool[index->slots[i]], bits);
+            *constant_slot(&grown, pool, bits) = index->slots[i];
+            grown.count++;
+        }
+    free(index->slots);
+    *index = grown;
+}
+
+// Indexes whatever was added to the pool since the last call, the first of
+// equal entries is the one that gets reused
+static void constant_index_sync(fth_constant_index *index, const fth_value *pool) {
+    for (; index->seen < garry_count(pool); index->seen++) {
+        if ((index->count + 1) * 4 > index->capacity * 3)
+            constant_index_grow(index, pool);
+        uint64_t bits[2];
+        constant_bits(pool[index->seen], bits);
+        int *slot = constant_slot(index, pool, bits);
+        if (*slot < 0) {
+            *slot = index->seen;
+            index->count++;
+        }
+    }
+}
+
+// The pool index of an equal constant, adding the value when there's none.
+// Returns -1 once the pool holds `limit` entries
+static int constant_intern(fth_constant_index *index, fth_value **pool, fth_value value, int limit) {
+    constant_index_sync(index, *pool);
+    if ((index->count + 1) * 4 > index->capacity * 3)
+        constant_index_grow(index, *pool);
+    uint64_t bits[2];
+    constant_bits(value, bits);
+    int *slot = constant_slot(index, *pool, bits);
+    if (*slot >= 0)
+        return *slot;
+    if (garry_count(*pool) >= limit)
+        return -1;
+    garry_append(*pool, value);
+    *slot = index->seen++;
+    index->count++;
+    return *slot;
+}
+
+// CONSTANT reaches the first 256 entries, CONSTANT_LONG the rest with a
+// 24-bit little-endian index
+static void chunk_write_constant(fth_chunk *chunk, int index, int line) {
     if (index < 256) {
         chunk_write(chunk, FTH_OP_CONSTANT, line);
         chunk_write(chunk, (uint8_t)index, line);
@@ -0,0 +1,38 @@
+// The VM-wide constant table asked for by fth_config.shared_constants. Every
+// chunk the VM compiles indexes this one pool instead of its own, so a
+// literal repeated across many words is stored once and the pool stays within
+// reach of the 1-byte CONSTANT operand for longer. The pool is allocated at
+// its full capacity up front and never moves, since native code holds the
+// addresses of its entries, and it only empties when the VM is reset.
+
+struct fth_constant_table {
+    fth_value *values;
+    fth_constant_index index;
+};
+
+// The pool index the chunk should use for the value, or -1 once the pool is
+// full. A chunk that already has constants of its own keeps to them
+static int vm_constant(fth_vm *vm, fth_chunk *chunk, fth_value value) {
+    if (!vm->shared_constants || (chunk->constants && !chunk->shared_constants))
+        return constant_intern(&chunk->constant_index, &chunk->constants, value, FTH_CONSTANTS_MAX);
+    fth_constant_table *table = vm->constants;
+    if (!table) {
+        table = vm->constants = calloc(1, sizeof(fth_constant_table));
+        // A slot to spare, appends only grow a garry when it's nearly full
+        (void)garry_reserve(table->values, vm->shared_constants + 1);
+        __garry_n(table->values) = 0;
+    }
+    chunk->constants = table->values;
+    chunk->shared_constants = true;
+    return constant_intern(&table->index, &table->values, value, vm->shared_constants);
+}
+
+static void constants_free(fth_vm *vm) {
+    fth_constant_table *table = vm->constants;
+    if (!table)
+        return;
+    garry_free(table->values);
+    free(table->index.slots);
+    free(table);
+    vm->constants = NULL;
+}
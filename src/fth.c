@@ -1,3 +1,15 @@
+// A strict -std=c11 hides POSIX (clock_gettime, strdup, fileno, sysconf),
+// ask for it back, along with the BSD extras mmap's MAP_ANONYMOUS needs
+#ifndef _WIN32
+#ifndef _POSIX_C_SOURCE
+#define _POSIX_C_SOURCE 200809L
+#endif
+#if defined(__APPLE__) && !defined(_DARWIN_C_SOURCE)
+#define _DARWIN_C_SOURCE
+#elif !defined(_DEFAULT_SOURCE)
+#define _DEFAULT_SOURCE
+#endif
+#endif
 #include "fth.h"
 #include <stdlib.h>
 #include <stdio.h>
@@ -5,15 +17,242 @@
 #include <stdarg.h>
 #include <assert.h>
 #include <limits.h>
+#include <time.h>
+#include <errno.h>
+#ifdef _WIN32
+#include <io.h>
+#define read _read
+typedef int ssize_t;
+#else
+#include <unistd.h>
+#endif
+
+// Threaded dispatch relies on the labels-as-values extension, define
+// FTH_NO_COMPUTED_GOTO to force the portable switch loop
+#if !defined(FTH_NO_COMPUTED_GOTO) && (defined(__GNUC__) || defined(__clang__))
+#define FTH_COMPUTED_GOTO 1
+#else
+#define FTH_COMPUTED_GOTO 0
+#endif
+
+// The baseline JIT emits x86-64 System V code into mmap'd pages, define
+// FTH_NO_JIT to leave it out entirely
+#if !defined(FTH_NO_JIT) && defined(__x86_64__) && (defined(__linux__) || defined(__APPLE__))
+#define FTH_JIT 1
+#include <stddef.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#else
+#define FTH_JIT 0
+#endif
+
+// Keep the top of the data stack in a local across dispatch, define
+// FTH_NO_TOS_CACHE to have every handler work on the stack in memory
+#ifndef FTH_NO_TOS_CACHE
+#define FTH_TOS_CACHE 1
+#else
+#define FTH_TOS_CACHE 0
+#endif
+
+// Generic arithmetic rewrites itself to integer or float variants for the
+// operands it meets, define FTH_NO_QUICKEN to keep every op generic
+#ifndef FTH_NO_QUICKEN
+#define FTH_QUICKEN 1
+#else
+#define FTH_QUICKEN 0
+#endif
+
+// Trace hooks, see fth_trace
+#ifndef FTH_NO_TRACE
+#define FTH_TRACE 1
+#else
+#define FTH_TRACE 0
+#endif
+
+// The profiler reads the TSC where there is one, see profile.inl
+#ifndef FTH_NO_PROFILE
+#define FTH_PROFILE 1
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+#else
+#define FTH_PROFILE 0
+#endif
+
+// Tracing instructions and profiling both go through fth_run_observed
+#define FTH_OBSERVE (FTH_TRACE || FTH_PROFILE)
+
+// fth_exec_file maps regular files and lexes them in place, define
+// FTH_NO_MMAP to always stream them through a buffer instead
+#if !defined(FTH_NO_MMAP) && (defined(__unix__) || defined(__APPLE__))
+#define FTH_MMAP 1
+#include <sys/mman.h>
+#include <sys/stat.h>
+#else
+#define FTH_MMAP 0
+#endif
+
+// fth_pool runs its workers on pthreads, define FTH_NO_THREADS to leave it
+// out, fth_pool_create then returns NULL
+#if !defined(FTH_NO_THREADS) && !defined(_WIN32)
+#define FTH_THREADS 1
+#include <pthread.h>
+#include <stdatomic.h>
+#else
+#define FTH_THREADS 0
+#endif
+
+// The lexer classifies ASCII runs a block at a time with SSE2, or AVX2 when
+// the compiler targets it, define FTH_NO_SIMD for the byte-at-a-time scanner
+#if !defined(FTH_NO_SIMD) && defined(__AVX2__)
+#define FTH_SCAN_WIDTH 32
+#include <immintrin.h>
+#elif !defined(FTH_NO_SIMD) && (defined(__SSE2__) || defined(_M_X64))
+#define FTH_SCAN_WIDTH 16
+#include <emmintrin.h>
+#else
+#define FTH_SCAN_WIDTH 0
+#endif
 
 #include "utils.inl"
+#include "alloc.inl"
+
+#ifdef FTH_NAN_BOXING
+#define FTH_SIGN_BIT    ((uint64_t)0x8000000000000000)
+#define FTH_QNAN        ((uint64_t)0x7ffc000000000000)
+#define FTH_TAG_INTEGER ((uint64_t)0x0001000000000000)
+#define FTH_TAG_FRAME   ((uint64_t)0x0002000000000000)
+#define FTH_TAG_STRING  ((uint64_t)0x0003000000000000)
+#define FTH_TAG_MASK    ((uint64_t)0x0003000000000000)
+#define FTH_PAYLOAD     ((uint64_t)0x0000ffffffffffff)
+#define FTH_NIL_BITS    (FTH_QNAN | 1)
+#define FTH_FALSE_BITS  (FTH_QNAN | 2)
+#define FTH_TRUE_BITS   (FTH_QNAN | 3)
+// Quiet NaNs produced by arithmetic (0x7ff8...) never have bit 50 set, so
+// only NaNs built by hand could collide with a tag; fth_number folds them
+#define FTH_CANONICAL_NAN ((uint64_t)0x7ff8000000000000)
 
+fth_value fth_nil(void) {
+    return FTH_NIL_BITS;
+}
+
+bool fth_is_nil(fth_value v) {
+    return v == FTH_NIL_BITS;
+}
+
+fth_value fth_boolean(bool v) {
+    return v ? FTH_TRUE_BITS : FTH_FALSE_BITS;
+}
+
+bool fth_is_boolean(fth_value v) {
+    return (v | 1) == FTH_TRUE_BITS;
+}
+
+bool fth_as_boolean(fth_value v) {
+    return v == FTH_TRUE_BITS;
+}
+
+fth_value fth_integer(fth_int v) {
+    return FTH_QNAN | FTH_TAG_INTEGER | (v & FTH_PAYLOAD);
+}
+
+bool fth_is_integer(fth_value v) {
+    return (v & (FTH_SIGN_BIT | FTH_QNAN | FTH_TAG_MASK)) == (FTH_QNAN | FTH_TAG_INTEGER);
+}
+
+fth_int fth_as_integer(fth_value v) {
+    return v & FTH_PAYLOAD;
+}
+
+fth_value fth_number(fth_float v) {
+    fth_value result;
+    if (v != v)
+        return FTH_CANONICAL_NAN;
+    memcpy(&result, &v, sizeof(fth_float));
+    return result;
+}
+
+bool fth_is_number(fth_value v) {
+    return (v & FTH_QNAN) != FTH_QNAN;
+}
+
+fth_float fth_as_number(fth_value v) {
+    fth_float result;
+    memcpy(&result, &v, sizeof(fth_float));
+    return result;
+}
+
+fth_value fth_obj(void *v) {
+    return FTH_SIGN_BIT | FTH_QNAN | ((uint64_t)(uintptr_t)v & FTH_PAYLOAD);
+}
+
+bool fth_is_obj(fth_value v) {
+    return (v & (FTH_SIGN_BIT | FTH_QNAN)) == (FTH_SIGN_BIT | FTH_QNAN);
+}
+
+void* fth_as_obj(fth_value v) {
+    return (void*)(uintptr_t)(v & FTH_PAYLOAD);
+}
+
+fth_value_t fth_type(fth_value v) {
+    if (fth_is_number(v))
+        return FTH_VALUE_NUMBER;
+    if (fth_is_obj(v))
+        return FTH_VALUE_OBJECT;
+    if (fth_is_integer(v))
+        return FTH_VALUE_INTEGER;
+    if ((v & (FTH_SIGN_BIT | FTH_QNAN | FTH_TAG_MASK)) == (FTH_QNAN | FTH_TAG_FRAME))
+        return FTH_VALUE_FRAME;
+    if (fth_is_small_string(v))
+        return FTH_VALUE_SMALL_STRING;
+    return fth_is_boolean(v) ? FTH_VALUE_BOOLEAN : FTH_VALUE_NIL;
+}
+
+// The payload bytes are the chars in memory order, which fth_string_chars
+// relies on, so the layout is only valid on little-endian targets
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#error FTH_NAN_BOXING small strings assume a little-endian target
+#endif
+
+fth_value fth_small_string(const unsigned char *chars, int length) {
+    uint64_t payload = 0;
+    memcpy(&payload, chars, length);
+    return FTH_QNAN | FTH_TAG_STRING | payload;
+}
+
+bool fth_is_small_string(fth_value v) {
+    return (v & (FTH_SIGN_BIT | FTH_QNAN | FTH_TAG_MASK)) == (FTH_QNAN | FTH_TAG_STRING);
+}
+
+static int small_string_length(fth_value v) {
+    int length = 0;
+    while (length < FTH_SMALL_STRING_MAX && (v >> (length * 8)) & 0xff)
+        length++;
+    return length;
+}
+
+static fth_value frame_value(fth_chunk *chunk) {
+    return FTH_QNAN | FTH_TAG_FRAME | ((uint64_t)(uintptr_t)chunk & FTH_PAYLOAD);
+}
+
+static fth_chunk* as_frame(fth_value v) {
+    return (fth_chunk*)(uintptr_t)(v & FTH_PAYLOAD);
+}
+#else
 fth_value fth_nil(void) {
     return (fth_value) {
         .type = FTH_VALUE_NIL
     };
 }
 
+bool fth_is_nil(fth_value v) {
+    return v.type == FTH_VALUE_NIL;
+}
+
+fth_value_t fth_type(fth_value v) {
+    return v.type;
+}
+
 #define X(T, N, TYPE) \
 fth_value fth_##N(TYPE v) { \
     return (fth_value) { \
@@ -30,180 +269,521 @@ TYPE fth_as_##N(fth_value v) { \
 TYPES
 #undef X
 
+fth_value fth_small_string(const unsigned char *chars, int length) {
+    fth_value result;
+    memset(&result, 0, sizeof(fth_value));
+    result.type = FTH_VALUE_SMALL_STRING;
+    result.length = (uint8_t)length;
+    memcpy(&result.as, chars, length);
+    return result;
+}
+
+bool fth_is_small_string(fth_value v) {
+    return v.type == FTH_VALUE_SMALL_STRING;
+}
+
+static int small_string_length(fth_value v) {
+    return v.length;
+}
+
+static fth_value frame_value(fth_chunk *chunk) {
+    return (fth_value) {
+        .type = FTH_VALUE_FRAME,
+        .as.obj = chunk
+    };
+}
+
+static fth_chunk* as_frame(fth_value v) {
+    return v.as.obj;
+}
+#endif
+
 bool fth_object_is(fth_value value, fth_object_t type) {
     return fth_is_obj(value) && ((fth_object*)fth_as_obj(value))->type == type;
 }
 
-fth_object* fth_obj_new(fth_object_t type, size_t size) {
-    fth_object *result = malloc(size);
+static void gc_maybe_collect(fth_vm *vm);
+static void intern_remove(fth_vm *vm, fth_string *string);
+
+static void gc_unlink(fth_vm *vm, fth_object *obj) {
+    if (obj->prev)
+        obj->prev->next = obj->next;
+    else
+        vm->objects = obj->next;
+    if (obj->next)
+        obj->next->prev = obj->prev;
+}
+
+fth_object* fth_obj_new(fth_vm *vm, fth_object_t type, size_t size) {
+    gc_maybe_collect(vm);
+    fth_object *result = arena_alloc(vm, size);
+    if (!result)
+        return NULL;
     result->type = type;
+    result->size = (uint32_t)size;
+    result->marked = false;
+    result->prev = NULL;
+    result->next = vm->objects;
+    if (vm->objects)
+        vm->objects->prev = result;
+    vm->objects = result;
+    vm->gc.bytes_allocated += size;
     return result;
 }
 
-void fth_obj_destroy(fth_object *obj) {
+// A source file mapped read-only. Strings lexed out of it point into the
+// mapping rather than copying and keep it alive through their source, so it
+// is unmapped once the collector finds nothing left pointing into it
+typedef struct {
+    fth_object obj;
+    unsigned char *data;
+    size_t size;
+} fth_mapping;
+
+// Anything an object holds outside of the arena
+static void obj_release(fth_vm *vm, fth_object *obj) {
     switch (obj->type) {
-        case FTH_OBJECT_STRING: {
-            fth_string* string = (fth_string*)obj;
-            if (string->owns_chars)
-                free((char*)string->chars);
-            free(string);
+        case FTH_OBJECT_STRING:
+            if (((fth_string*)obj)->interned)
+                intern_remove(vm, (fth_string*)obj);
+            break;
+        case FTH_OBJECT_MAPPING:
+#if FTH_MMAP
+            munmap(((fth_mapping*)obj)->data, ((fth_mapping*)obj)->size);
+#else
+            free(((fth_mapping*)obj)->data);
+#endif
             break;
-        }
     }
 }
 
-fth_string* fth_string_new(const unsigned char *chars, int length, bool owns_chars) {
-    fth_string *result = malloc(sizeof(fth_string) + length + 1);
-    result->obj.type = FTH_OBJECT_STRING;
+void fth_obj_destroy(fth_vm *vm, fth_object *obj) {
+    obj_release(vm, obj);
+    gc_unlink(vm, obj);
+    vm->gc.bytes_allocated -= obj->size;
+    arena_dealloc(vm, obj, obj->size);
+}
+
+fth_string* fth_string_new(fth_vm *vm, const unsigned char *chars, int length, bool owns_chars) {
+    fth_string *result = (fth_string*)fth_obj_new(vm, FTH_OBJECT_STRING, sizeof(fth_string) + (owns_chars ? length + 1 : 0));
+    if (!result)
+        return NULL;
     result->length = length;
-    if (chars && length) {
-        memcpy(result->chars, chars, length * sizeof(unsigned char));
-        result->chars[length] = '\0';
-    }
+    result->owns_chars = owns_chars;
+    result->interned = false;
+    result->defined = false;
+    result->hash = 0;
+    result->source = NULL;
+    if (owns_chars) {
+        if (chars && length)
+            memcpy(result->data, chars, length * sizeof(unsigned char));
+        result->data[length] = '\0';
+        result->chars = result->data;
+    } else
+        result->chars = chars;
     return result;
 }
 
-void fth_print_value(fth_value value) {
-    switch (value.type) {
+bool fth_is_string(fth_value value) {
+    return fth_is_small_string(value) || fth_object_is(value, FTH_OBJECT_STRING);
+}
+
+int fth_string_length(fth_value value) {
+    return fth_is_small_string(value) ? small_string_length(value) : fth_as_string(value)->length;
+}
+
+const unsigned char* fth_string_chars(const fth_value *value) {
+#ifdef FTH_NAN_BOXING
+    return fth_is_small_string(*value) ? (const unsigned char*)value : fth_as_string(*value)->chars;
+#else
+    return fth_is_small_string(*value) ? (const unsigned char*)&value->as : fth_as_string(*value)->chars;
+#endif
+}
+
+bool fth_string_equal(fth_value a, fth_value b) {
+    bool small_a = fth_is_small_string(a), small_b = fth_is_small_string(b);
+    if (!small_a && !small_b) {
+        fth_string *x = fth_as_string(a), *y = fth_as_string(b);
+        if (x == y)
+            return true;
+        if (x->interned && y->interned)
+            return false;
+    }
+    int length = fth_string_length(a);
+    return length == fth_string_length(b) && !memcmp(fth_string_chars(&a), fth_string_chars(&b), length);
+}
+
+void fth_sink_file(void *user, const char *text, size_t length) {
+    fwrite(text, 1, length, user ? (FILE*)user : stdout);
+}
+
+typedef struct {
+    fth_sink sink;
+    void *user;
+} fth_writer;
+
+static void write_format(fth_writer *out, const char *fmt, ...) {
+    char buffer[256];
+    va_list args;
+    va_start(args, fmt);
+    int length = vsnprintf(buffer, sizeof(buffer), fmt, args);
+    va_end(args);
+    if (length < 0)
+        return;
+    if (length < (int)sizeof(buffer)) {
+        out->sink(out->user, buffer, length);
+        return;
+    }
+    va_start(args, fmt);
+    char *text = __format(fmt, NULL, args);
+    va_end(args);
+    if (text)
+        out->sink(out->user, text, length);
+    free(text);
+}
+
+static void write_value(fth_writer *out, fth_value value) {
+    switch (fth_type(value)) {
         case FTH_VALUE_NIL:
-            printf("NIL");
+            write_format(out, "NIL");
             break;
         case FTH_VALUE_BOOLEAN:
-            printf("%s", value.as.boolean ? "TRUE" : "FALSE");
+            write_format(out, "%s", fth_as_boolean(value) ? "TRUE" : "FALSE");
             break;
         case FTH_VALUE_INTEGER:
-            printf("%llu", fth_as_integer(value));
+            write_format(out, "%llu", (unsigned long long)fth_as_integer(value));
             break;
         case FTH_VALUE_NUMBER:
-            printf("%g", fth_as_number(value));
+            write_format(out, "%g", fth_as_number(value));
             break;
         case FTH_VALUE_OBJECT: {
             fth_object *obj = fth_as_obj(value);
             switch (obj->type) {
                 case FTH_OBJECT_STRING:
-                    printf("\"%.*s\"", fth_string_length(value), fth_as_cstring(value));
+                    write_format(out, "\"%.*s\"", fth_string_length(value), fth_string_chars(&value));
                     break;
                 default:
                     abort();
             }
             break;
         }
+        case FTH_VALUE_SMALL_STRING:
+            write_format(out, "\"%.*s\"", fth_string_length(value), fth_string_chars(&value));
+            break;
+        case FTH_VALUE_FRAME:
+            write_format(out, "<frame>");
+            break;
         default:
             abort();
     }
 }
 
-static void __stack_push(fth_value **stack, fth_value value) {
-    garry_append(*stack, value);
+void fth_print_value(fth_value value) {
+    write_value(&(fth_writer) { fth_sink_file, stdout }, value);
 }
 
-static fth_result_t __stack_pop(fth_value **stack, fth_value *value) {
-    if (!garry_count(*stack)) {
+static fth_result_t __stack_push(fth_stack *stack, fth_value value) {
+    if (stack->top == stack->end)
+        return FTH_RUNTIME_ERROR;
+    *stack->top++ = value;
+    return FTH_OK;
+}
+
+static fth_result_t __stack_pop(fth_stack *stack, fth_value *value) {
+    if (stack->top == stack->base) {
         if (value)
             *value = fth_nil();
         return FTH_RUNTIME_ERROR;
-    } else {
-        if (value)
-            *value = *(fth_value*)garry_last(*stack);
-        garry_pop(*stack);
-        return FTH_OK;
     }
+    --stack->top;
+    if (value)
+        *value = *stack->top;
+    return FTH_OK;
 }
 
-static fth_result_t __stack_at(fth_value **stack, int idx, fth_value *value) {
+static fth_result_t __stack_at(fth_stack *stack, int idx, fth_value *value) {
+    if (idx < 0 || idx >= stack->top - stack->base) {
+        if (value)
+            *value = fth_nil();
+        return FTH_RUNTIME_ERROR;
+    }
+    if (value)
+        *value = stack->base[idx];
     return FTH_OK;
 }
 
-static fth_result_t __stack_peek(fth_value **stack, int distance, fth_value *value) {
-    return FTH_OK;
+static fth_result_t __stack_peek(fth_stack *stack, int distance, fth_value *value) {
+    return __stack_at(stack, (int)(stack->top - stack->base) - 1 - distance, value);
 }
 
 #include "chunk.inl"
+#include "trace.inl"
+#include "intern.inl"
+#include "cache.inl"
+#include "constants.inl"
+#include "gc.inl"
+#include "profile.inl"
+#include "optimize.inl"
+#include "scan.inl"
 #include "lexer.inl"
+#include "image.inl"
+
+static inline bool as_float(fth_value value, fth_float *out) {
+    if (fth_is_number(value))
+        *out = fth_as_number(value);
+    else if (fth_is_integer(value))
+        *out = (fth_float)fth_as_integer(value);
+    else
+        return false;
+    return true;
+}
 
-static void dump_stack(fth_value *stack) {
-    for (int i = 0; i < garry_count(stack); i++) {
-        fth_print_value(stack[i]);
+static void dump_stack(fth_stack *stack) {
+    for (fth_value *cell = stack->base; cell < stack->top; cell++) {
+        fth_print_value(*cell);
         printf(" ");
     }
     printf("\n");
 }
 
+// Stack expressions ($...) work on a slice of cells counted from the top of
+// a stack, and every one of them runs as a single block copy
+static const char* stack_range(fth_stack *stack, const uint8_t *operands, fth_value **first, int *count) {
+    int depth = (int)(stack->top - stack->base);
+    int from = FTH_RANGE_FROM(operands), to = FTH_RANGE_TO(operands);
+    if (to == FTH_RANGE_BOTTOM)
+        to = depth - 1;
+    if (from > depth || to >= depth)
+        return "stack expression out of range";
+    *first = stack->top - 1 - to;
+    *count = to < from ? 0 : to - from + 1;
+    return NULL;
+}
+
+static void stack_remove(fth_stack *stack, fth_value *first, int count) {
+    memmove(first, first + count, (stack->top - first - count) * sizeof(fth_value));
+    stack->top -= count;
+}
+
+static const char* range_op(fth_vm *vm, uint8_t op, const uint8_t *operands) {
+    bool rstack = operands[0] & FTH_RANGE_RSTACK;
+    fth_stack *source = rstack ? &vm->return_stack : &vm->stack;
+    fth_stack *other = rstack ? &vm->stack : &vm->return_stack;
+    fth_value *first, value;
+    int count;
+    if (op == FTH_OP_RANGE_SET && __stack_pop(&vm->stack, &value) != FTH_OK)
+        return "data stack underflow";
+    const char *error = stack_range(source, operands, &first, &count);
+    if (error)
+        return error;
+    switch (op) {
+        case FTH_OP_RANGE_DROP:
+            stack_remove(source, first, count);
+            break;
+        case FTH_OP_RANGE_MOVE:
+            if (other->end - other->top < count)
+                return rstack ? "data stack overflow" : "return stack overflow";
+            memcpy(other->top, first, count * sizeof(fth_value));
+            other->top += count;
+            stack_remove(source, first, count);
+            break;
+        case FTH_OP_RANGE_ROLL:
+            // Park the slice above the top, then close the gap it left
+            if (source->end - source->top < count)
+                return rstack ? "return stack overflow" : "data stack overflow";
+            memcpy(source->top, first, count * sizeof(fth_value));
+            memmove(first, first + count, (source->top - first) * sizeof(fth_value));
+            break;
+        case FTH_OP_RANGE_COPY:
+            if (vm->stack.end - vm->stack.top < count)
+                return "data stack overflow";
+            memcpy(vm->stack.top, first, count * sizeof(fth_value));
+            vm->stack.top += count;
+            break;
+        case FTH_OP_RANGE_SET:
+            for (int i = 0; i < count; i++)
+                first[i] = value;
+            break;
+        case FTH_OP_RANGE_PRINT:
+            for (int i = 0; i < count; i++) {
+                fth_print_value(first[i]);
+                printf(" ");
+            }
+            printf("\n");
+            break;
+    }
+    return NULL;
+}
+
+#if FTH_JIT
+static fth_result_t fth_interpret(fth_vm *vm);
+#include "jit.inl"
+#endif
+
+#if !FTH_COMPUTED_GOTO
+#define FTH_RUN_NAME fth_run_switch
+#define FTH_RUN_THREADED 0
+#define FTH_RUN_TOS_CACHE FTH_TOS_CACHE
+#include "run.inl"
+#endif
+
+#if FTH_OBSERVE
+static void observe_op(fth_vm *vm, const uint8_t *ip) {
+#if FTH_PROFILE
+    if (vm->profile)
+        profile_op(vm->profile, ip);
+#endif
+#if FTH_TRACE
+    if (TRACING(vm, FTH_TRACE_OP))
+        trace_op(vm, ip);
+#endif
+}
+
+#define FTH_RUN_NAME fth_run_observed
+#define FTH_RUN_THREADED FTH_COMPUTED_GOTO
+#define FTH_RUN_TOS_CACHE 0
+#define FTH_RUN_OBSERVE 1
+#include "run.inl"
+#endif
+
+#if FTH_COMPUTED_GOTO
+#define FTH_RUN_NAME fth_run_threaded
+#define FTH_RUN_THREADED 1
+#define FTH_RUN_TOS_CACHE FTH_TOS_CACHE
+#include "run.inl"
+#endif
+
+static fth_result_t fth_interpret(fth_vm *vm) {
+#if FTH_COMPUTED_GOTO
+    return fth_run_threaded(vm);
+#else
+    return fth_run_switch(vm);
+#endif
+}
+
 static fth_result_t fth_run(fth_vm *vm) {
-    for (;;) {
-        uint8_t instruction;
-        fth_value value;
-        fth_result_t result;
-        switch (instruction = *vm->sp++) {
-            case FTH_OP_RETURN:
-                if ((result = fth_stack_pop(vm, &value)) != FTH_OK) {
-                    vm->error = strdup("stack underflow");
-                    return result;
-                }
-                fth_print_value(value);
-                printf("\n");
-                return FTH_OK;
-            case FTH_OP_CONSTANT:
-            case FTH_OP_CONSTANT_LONG:
-                __stack_push(&vm->stack, vm->chunk->constants[*vm->sp++]);
-                break;
-            case FTH_OP_PERIOD:
-                if (!garry_count(vm->stack)) {
-                    vm->error = strdup("data stack underflow");
-                    return FTH_RUNTIME_ERROR;
-                }
-                fth_print_value(*(fth_value*)garry_last(vm->stack));
-                printf("\n");
-                break;
-            case FTH_OP_PUSH:
-                if ((result = fth_stack_pop(vm, &value)) != FTH_OK) {
-                    vm->error = strdup("return stack underflow");
-                    return result;
-                }
-                __stack_push(&vm->return_stack, value);
-                break;
-            case FTH_OP_POP:
-                if ((result = __stack_pop(&vm->return_stack, &value)) != FTH_OK) {
-                    vm->error = strdup("data stack underflow");
-                    return result;
-                }
-                fth_stack_push(vm, value);
-                break;
-            case FTH_OP_DUMP:
-                dump_stack(vm->stack);
-                break;
-            case FTH_OP_DUMP_RSTACK:
-                dump_stack(vm->return_stack);
-                break;
-            default:
-                abort();
-        }
+#if FTH_OBSERVE
+    if (TRACING(vm, FTH_TRACE_OP) || PROFILING(vm)) {
+        fth_result_t result = fth_run_observed(vm);
+#if FTH_PROFILE
+        if (vm->profile)
+            profile_close(vm->profile);
+#endif
+        return result;
     }
-    return FTH_OK;
+#endif
+#if FTH_JIT
+    if (vm->sp == vm->chunk->data && jit_ready(vm, vm->chunk))
+        return ((fth_jit_fn)vm->chunk->jit)(vm);
+#endif
+    return fth_interpret(vm);
 }
 
 static void stack_reset(fth_vm *vm) {
-    garry_free(vm->stack);
-    vm->stack = NULL;
-    garry_free(vm->return_stack);
-    vm->return_stack = NULL;
+    vm->stack.top = vm->stack.base;
+    vm->return_stack.top = vm->return_stack.base;
 }
 
-void fth_init(fth_vm *vm) {
+bool fth_init(fth_vm *vm) {
+    return fth_init_ex(vm, NULL);
+}
+
+bool fth_init_ex(fth_vm *vm, const fth_config *config) {
     memset(vm, 0, sizeof(fth_vm));
+    if (config && config->allocator.alloc && config->allocator.free)
+        vm->allocator = config->allocator;
+    else
+        vm->allocator = (fth_allocator) {
+            .alloc = default_alloc,
+            .free = default_free
+        };
+    vm->gc.min_heap = config && config->gc_min_heap ? config->gc_min_heap : FTH_GC_MIN_HEAP;
+    vm->gc.growth = config && config->gc_growth > 100 ? config->gc_growth : FTH_GC_GROWTH;
+    vm->gc.next_collection = vm->gc.min_heap;
+    vm->cache.capacity = config && config->compile_cache > 0 ? config->compile_cache : 0;
+    vm->strip_lines = config && config->strip_lines;
+    vm->shared_constants = config && config->shared_constants > 0 ? config->shared_constants : 0;
+    if (vm->shared_constants > FTH_CONSTANTS_MAX)
+        vm->shared_constants = FTH_CONSTANTS_MAX;
+    if (!(vm->arena = vm_alloc(vm, sizeof(fth_arena))))
+        return false;
+    memset(vm->arena, 0, sizeof(fth_arena));
+    int depth = config && config->stack_depth > 0 ? config->stack_depth : FTH_STACK_DEPTH;
+    int rdepth = config && config->return_stack_depth > 0 ? config->return_stack_depth : FTH_RETURN_STACK_DEPTH;
+    vm->jit_threshold = config && config->jit_threshold ? config->jit_threshold : FTH_JIT_THRESHOLD;
+    // Both stacks share one allocation, made once here and never resized. The
+    // extra cell below the data stack is scratch space for the cached top of
+    // stack to spill into when the stack is empty (see run.inl)
+    fth_value *cells = vm_alloc(vm, (1 + depth + rdepth) * sizeof(fth_value));
+    if (!cells) {
+        vm_free(vm, vm->arena, sizeof(fth_arena));
+        vm->arena = NULL;
+        return false;
+    }
+    vm->stack.base = cells + 1;
+    vm->stack.end = vm->stack.base + depth;
+    vm->return_stack.base = vm->stack.end;
+    vm->return_stack.end = vm->return_stack.base + rdepth;
     stack_reset(vm);
+    return true;
 }
 
-void fth_destroy(fth_vm *vm) {
-    for (int i = 0; i < garry_count(vm->objects); i++)
-        if (vm->objects[i].type == FTH_VALUE_OBJECT)
-            fth_obj_destroy(&vm->objects[i]);
-    garry_free(vm->objects);
+static void vm_clear(fth_vm *vm) {
+    for (int i = 0; i < garry_count(vm->words); i++) {
+        chunk_free(vm->words[i].chunk);
+        free(vm->words[i].chunk);
+    }
+    garry_free(vm->words);
+    for (int i = 0; i < garry_count(vm->chunks); i++) {
+        chunk_free(vm->chunks[i]);
+        free(vm->chunks[i]);
+    }
+    garry_free(vm->chunks);
+    cache_free(vm);
+    constants_free(vm);
+    // The arena goes in one piece, only mappings need letting go of first
+    for (fth_object *obj = vm->objects; obj; obj = obj->next)
+        if (obj->type == FTH_OBJECT_MAPPING)
+            obj_release(vm, obj);
+    intern_free(vm);
+    arena_release(vm);
+    vm->objects = NULL;
+    vm->gc.bytes_allocated = 0;
+    vm->gc.next_collection = vm->gc.min_heap;
+}
+
+void fth_reset(fth_vm *vm) {
+    vm_clear(vm);
+    // Calls are counted by dictionary index, which is starting over
+    if (vm->profile)
+        garry_free(vm->profile->calls);
+    vm->chunk = NULL;
     stack_reset(vm);
 }
 
-void fth_stack_push(fth_vm *vm, fth_value value) {
-    __stack_push(&vm->stack, value);
+void fth_collect(fth_vm *vm) {
+    if (!vm->gc.paused)
+        gc_collect(vm);
+}
+
+void fth_destroy(fth_vm *vm) {
+    // Nothing to undo after a failed fth_init_ex
+    if (!vm->arena)
+        return;
+    vm_clear(vm);
+    profile_free(vm->profile);
+    vm->profile = NULL;
+    vm_free(vm, vm->arena, sizeof(fth_arena));
+    vm->arena = NULL;
+    // The same size fth_init_ex asked for
+    size_t cells = 1 + (vm->stack.end - vm->stack.base) + (vm->return_stack.end - vm->return_stack.base);
+    vm_free(vm, vm->stack.base - 1, cells * sizeof(fth_value));
+    memset(&vm->stack, 0, sizeof(fth_stack));
+    memset(&vm->return_stack, 0, sizeof(fth_stack));
+}
+
+fth_result_t fth_stack_push(fth_vm *vm, fth_value value) {
+    return __stack_push(&vm->stack, value);
 }
 
 fth_result_t fth_stack_pop(fth_vm *vm, fth_value *value) {
@@ -218,64 +798,500 @@ fth_result_t fth_stack_peek(fth_vm *vm, int distance, fth_value *value) {
     return __stack_peek(&vm->stack, distance, value);
 }
 
-fth_result_t fth_exec(fth_vm *vm, const unsigned char *source) {
+fth_string* fth_intern(fth_vm *vm, const unsigned char *chars, int length) {
+    return intern_string(vm, chars, length);
+}
+
+static fth_result_t run_chunk(fth_vm *vm, fth_chunk *chunk) {
+    vm->chunk = chunk;
+    vm->sp = chunk->data;
+    fth_result_t result = fth_run(vm);
+    if (result == FTH_RUNTIME_ERROR && TRACING(vm, FTH_TRACE_ERROR))
+        trace_error(vm, -1);
+    // Frames left behind by an error would point into this chunk
+    if (result == FTH_RUNTIME_ERROR)
+        vm->return_stack.top = vm->return_stack.base;
+    vm->chunk = NULL;
+    return result;
+}
+
+static fth_result_t exec_parser(fth_vm *vm, fth_parser *parser) {
     fth_result_t result = FTH_OK;
     fth_chunk chunk;
     chunk_init(&chunk);
-    fth_parser parser;
-    parser_init(&parser, source);
-    if (fth_compile(&parser, &chunk) != FTH_OK) {
+    if (fth_compile(parser, &chunk) != FTH_OK) {
+        vm->error = parser->error;
         result = FTH_COMPILE_ERROR;
         goto BAIL;
     }
-    chunk_disassemble(&chunk, "test");
-    vm->chunk = &chunk;
-    vm->sp = vm->chunk->data;
-    result = fth_run(vm);
+    chunk_optimize(&chunk);
+    result = run_chunk(vm, &chunk);
 BAIL:
     chunk_free(&chunk);
+    gc_maybe_collect(vm);
     return result;
 }
 
-static unsigned char* readfile(const char *path, size_t *size) {
-    unsigned char *result = NULL;
-    size_t _size = 0;
-    FILE *file = fopen(path, "r");
-    if (!file)
-        goto BAIL; // _size = 0 failed to open file
-    fseek(file, 0, SEEK_END);
-    _size = ftell(file);
-    rewind(file);
-    if (!(result = malloc(sizeof(unsigned char) * _size + 1)))
-        goto BAIL; // _size > 0 failed to alloc memory
-    if (fread(result, sizeof(unsigned char), _size, file) != _size) {
-        free(result);
-        _size = -1;
-        goto BAIL; // _size = -1 failed to read file
+// A hit goes straight to run_chunk, a miss compiles and keeps the chunk
+static fth_result_t exec_cached(fth_vm *vm, const unsigned char *source) {
+    size_t length = strlen((const char*)source);
+    uint64_t key[2];
+    cache_key(source, length, key);
+    fth_chunk *chunk = cache_find(vm, key, length);
+    if (!chunk) {
+        fth_parser parser;
+        fth_chunk compiled;
+        chunk_init(&compiled);
+        parser_init(&parser, vm, source);
+        if (fth_compile(&parser, &compiled) != FTH_OK) {
+            vm->error = parser.error;
+            chunk_free(&compiled);
+            gc_maybe_collect(vm);
+            return FTH_COMPILE_ERROR;
+        }
+        chunk_optimize(&compiled);
+        chunk = cache_insert(vm, key, length, &compiled);
     }
-    result[_size] = '\0';
-BAIL:
-    if (size)
-        *size = _size;
+    fth_result_t result = run_chunk(vm, chunk);
+    gc_maybe_collect(vm);
     return result;
 }
 
+fth_result_t fth_exec(fth_vm *vm, const unsigned char *source) {
+    if (vm->cache.capacity)
+        return exec_cached(vm, source);
+    fth_parser parser;
+    parser_init(&parser, vm, source);
+    return exec_parser(vm, &parser);
+}
+
+static size_t stream_read_file(void *source, unsigned char *buffer, size_t size, bool *failed) {
+    size_t result = fread(buffer, 1, size, (FILE*)source);
+    if (!result && ferror((FILE*)source))
+        *failed = true;
+    return result;
+}
+
+static size_t stream_read_fd(void *source, unsigned char *buffer, size_t size, bool *failed) {
+    for (;;) {
+        ssize_t result = read((int)(intptr_t)source, buffer, size);
+        if (result >= 0)
+            return (size_t)result;
+        if (errno != EINTR) {
+            *failed = true;
+            return 0;
+        }
+    }
+}
+
+static fth_result_t exec_stream(fth_vm *vm, fth_stream_reader reader, void *source) {
+    fth_stream stream;
+    fth_parser parser;
+    if (!parser_init_stream(&parser, vm, &stream, reader, source)) {
+        vm->error = format("failed to alloc memory '%zub'\n", NULL, (size_t)FTH_STREAM_BUFFER);
+        return FTH_COMPILE_ERROR;
+    }
+    fth_result_t result = exec_parser(vm, &parser);
+    free(stream.buffer);
+    return result;
+}
+
+fth_result_t fth_exec_stream(fth_vm *vm, FILE *stream) {
+    return exec_stream(vm, stream_read_file, stream);
+}
+
+fth_result_t fth_exec_fd(fth_vm *vm, int fd) {
+    return exec_stream(vm, stream_read_fd, (void*)(intptr_t)fd);
+}
+
+#if FTH_MMAP
+// The lexer needs a NUL after the source. The rest of the last page of a
+// mapping reads as zeros, unless the file fills it exactly, then an extra
+// zero page is mapped after it. Truncating the file while it is mapped
+// still faults, same as any other mapped file
+static fth_mapping* mapping_open(fth_vm *vm, int fd) {
+    struct stat info;
+    if (fstat(fd, &info) || !S_ISREG(info.st_mode) || info.st_size <= 0)
+        return NULL;
+    size_t size = (size_t)info.st_size, page = (size_t)sysconf(_SC_PAGESIZE), length = size;
+    unsigned char *data;
+    if (size % page) {
+        if ((data = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+            return NULL;
+    } else {
+        length = size + page;
+        if ((data = mmap(NULL, length, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED)
+            return NULL;
+        if (mmap(data, size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0) == MAP_FAILED) {
+            munmap(data, length);
+            return NULL;
+        }
+    }
+    fth_mapping *result = (fth_mapping*)fth_obj_new(vm, FTH_OBJECT_MAPPING, sizeof(fth_mapping));
+    if (!result) {
+        munmap(data, length);
+        return NULL;
+    }
+    result->data = data;
+    result->size = length;
+    return result;
+}
+#endif
+
+// Regular files are mapped and lexed in place, anything else (or a file
+// that won't map) is streamed
 fth_result_t fth_exec_file(fth_vm *vm, const char *path) {
-    size_t size;
-    unsigned char *source = readfile(path, &size);
-    if (!source)
-        switch (size) {
-            case 0:
-                vm->error = format("failed to open '%s'\n", NULL, path);
-                return FTH_COMPILE_ERROR;
-            case -1:
-                vm->error = format("failed to read '%s'\n", NULL, path);
-                return FTH_COMPILE_ERROR;
-            default:
-                vm->error = format("failed to alloc memory '%zub'\n", NULL, size);
-                return FTH_COMPILE_ERROR;
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        vm->error = format("failed to open '%s'\n", NULL, path);
+        return FTH_COMPILE_ERROR;
+    }
+    fth_result_t result;
+#if FTH_MMAP
+    fth_mapping *mapping = mapping_open(vm, fileno(file));
+    if (mapping) {
+        fclose(file);
+        fth_parser parser;
+        parser_init(&parser, vm, mapping->data);
+        parser.source = &mapping->obj;
+        return exec_parser(vm, &parser);
+    }
+#endif
+    result = fth_exec_stream(vm, file);
+    fclose(file);
+    return result;
+}
+
+fth_chunk* fth_compile_chunk(fth_vm *vm, const unsigned char *source) {
+    fth_parser parser;
+    parser_init(&parser, vm, source);
+    fth_chunk *result = malloc(sizeof(fth_chunk));
+    chunk_init(result);
+    if (fth_compile(&parser, result) != FTH_OK) {
+        vm->error = parser.error;
+        chunk_free(result);
+        free(result);
+        return NULL;
+    }
+    chunk_optimize(result);
+    garry_append(vm->chunks, result);
+    return result;
+}
+
+fth_result_t fth_run_chunk(fth_vm *vm, fth_chunk *chunk) {
+    fth_result_t result = run_chunk(vm, chunk);
+    gc_maybe_collect(vm);
+    return result;
+}
+
+void fth_free_chunk(fth_vm *vm, fth_chunk *chunk) {
+    for (int i = 0; i < garry_count(vm->chunks); i++)
+        if (vm->chunks[i] == chunk) {
+            vm->chunks[i] = vm->chunks[garry_count(vm->chunks) - 1];
+            garry_pop(vm->chunks);
+            break;
         }
-    fth_result_t result = fth_exec(vm, source);
-    free(source);
+    chunk_free(chunk);
+    free(chunk);
+}
+
+void fth_strip_chunk(fth_chunk *chunk) {
+    chunk_strip_lines(chunk);
+}
+
+void fth_disassemble(fth_chunk *chunk, const char *name, fth_sink sink, void *user) {
+    chunk_disassemble(&(fth_writer) { sink, user }, chunk, name);
+}
+
+bool fth_profile_start(fth_vm *vm) {
+#if FTH_PROFILE
+    profile_free(vm->profile);
+    if (!(vm->profile = calloc(1, sizeof(fth_profile))))
+        return false;
+    vm->profile->previous = FTH_OP_COUNT;
+    vm->profile->start_ns = gc_now_ns();
+    vm->profile->start_ticks = profile_ticks();
+    return true;
+#else
+    (void)vm;
+    return false;
+#endif
+}
+
+fth_profile* fth_profile_stop(fth_vm *vm) {
+    fth_profile *result = vm->profile;
+    if (!result)
+        return NULL;
+#if FTH_PROFILE
+    uint64_t ns = gc_now_ns() - result->start_ns, ticks = profile_ticks() - result->start_ticks;
+    result->ns_per_tick = ticks ? (double)ns / ticks : 1;
+#endif
+    int calls = garry_count(result->calls);
+    result->names = calloc(calls ? calls : 1, sizeof(char*));
+    for (int i = 0; result->names && i < calls && i < garry_count(vm->words); i++)
+        result->names[i] = format("%.*s", NULL, vm->words[i].name->length, vm->words[i].name->chars);
+    vm->profile = NULL;
+    return result;
+}
+
+int fth_profile_entries(const fth_profile *profile, fth_profile_kind kind, fth_profile_entry *out, int max) {
+    if (!profile)
+        return 0;
+    int count;
+    fth_profile_entry *entries = profile_entries(profile, kind, &count);
+    if (count && max > 0)
+        memcpy(out, entries, (count < max ? count : max) * sizeof(fth_profile_entry));
+    garry_free(entries);
+    return count;
+}
+
+void fth_profile_write(const fth_profile *profile, fth_profile_format format, fth_sink sink, void *user) {
+    if (profile)
+        profile_write(profile, format, &(fth_writer) { sink, user });
+}
+
+void fth_profile_free(fth_profile *profile) {
+    profile_free(profile);
+}
+
+bool fth_save_chunk(fth_vm *vm, fth_chunk *chunk, const char *path) {
+    return image_save(vm, chunk, path);
+}
+
+// The whole file, private and writable so image_load can rebase it
+static fth_mapping* mapping_load(fth_vm *vm, const char *path) {
+    FILE *file = fopen(path, "rb");
+    if (!file) {
+        vm->error = format("failed to open '%s'", NULL, path);
+        return NULL;
+    }
+    unsigned char *data = NULL;
+    size_t size = 0;
+#if FTH_MMAP
+    struct stat info;
+    if (!fstat(fileno(file), &info) && S_ISREG(info.st_mode) && info.st_size > 0) {
+        size = (size_t)info.st_size;
+        if ((data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fileno(file), 0)) == MAP_FAILED)
+            data = NULL;
+    }
+#else
+    if (!fseek(file, 0, SEEK_END) && (long)(size = ftell(file)) > 0 && !fseek(file, 0, SEEK_SET) &&
+        (data = malloc(size)) && fread(data, 1, size, file) != size) {
+        free(data);
+        data = NULL;
+    }
+#endif
+    fclose(file);
+    if (!data) {
+        vm->error = format("failed to read '%s'", NULL, path);
+        return NULL;
+    }
+    fth_mapping *result = (fth_mapping*)fth_obj_new(vm, FTH_OBJECT_MAPPING, sizeof(fth_mapping));
+    if (!result) {
+#if FTH_MMAP
+        munmap(data, size);
+#else
+        free(data);
+#endif
+        vm->error = strdup("out of memory");
+        return NULL;
+    }
+    result->data = data;
+    result->size = size;
     return result;
 }
+
+fth_chunk* fth_load_chunk(fth_vm *vm, const char *path) {
+    fth_mapping *mapping = mapping_load(vm, path);
+    return mapping ? image_load(vm, mapping) : NULL;
+}
+
+struct fth_program {
+    // Compiles the program and then holds its words and constants, it never
+    // runs or collects
+    fth_vm vm;
+    fth_chunk *chunk;
+};
+
+// Leaves nothing for a run to write to. Objects stay marked, so collectors
+// of the VMs running the program treat them as visited, strings stop
+// counting as interned, so they compare by content against anyone else's,
+// and every chunk is sealed against quickening, has its lines decoded and is
+// either native code or has given up on becoming it, so no run ever counts
+// towards compiling it. Native code only when the JIT is opted into
+static void program_seal_chunk(fth_vm *vm, fth_chunk *chunk) {
+    chunk->sealed = true;
+    chunk_index_lines(chunk);
+#if FTH_JIT
+    if (vm->jit_threshold >= 0)
+        jit_compile(chunk);
+    else
+        chunk->jit_failed = true;
+#else
+    (void)vm;
+#endif
+}
+
+static void program_seal(fth_program *program) {
+    for (fth_object *obj = program->vm.objects; obj; obj = obj->next) {
+        obj->marked = true;
+        if (obj->type == FTH_OBJECT_STRING)
+            ((fth_string*)obj)->interned = false;
+    }
+    intern_free(&program->vm);
+    program_seal_chunk(&program->vm, program->chunk);
+    for (int i = 0; i < garry_count(program->vm.words); i++)
+        program_seal_chunk(&program->vm, program->vm.words[i].chunk);
+}
+
+fth_program* fth_compile_program(const unsigned char *source, char **error) {
+    fth_program *result = malloc(sizeof(fth_program));
+    if (!result || !fth_init_ex(&result->vm, &(fth_config) {
+        .stack_depth = 1,
+        .return_stack_depth = 1
+    })) {
+        free(result);
+        if (error)
+            *error = strdup("out of memory");
+        return NULL;
+    }
+    result->vm.gc.paused++;
+    if (!(result->chunk = fth_compile_chunk(&result->vm, source))) {
+        if (error)
+            *error = result->vm.error;
+        else
+            free(result->vm.error);
+        result->vm.error = NULL;
+        fth_free_program(result);
+        return NULL;
+    }
+    program_seal(result);
+    return result;
+}
+
+// CALLs index vm->words, so the program's own words stand in for the VM's
+// for the length of the run. Nothing is compiled meanwhile, and the
+// collector waits, as it would only find the program's words
+fth_result_t fth_run_program(fth_vm *vm, const fth_program *program) {
+    fth_word *words = vm->words;
+    vm->words = program->vm.words;
+    vm->gc.paused++;
+    fth_result_t result = run_chunk(vm, program->chunk);
+    vm->gc.paused--;
+    vm->words = words;
+    gc_maybe_collect(vm);
+    return result;
+}
+
+void fth_free_program(fth_program *program) {
+    if (!program)
+        return;
+    fth_destroy(&program->vm);
+    free(program);
+}
+
+#include "pool.inl"
+
+fth_pool* fth_pool_create(int threads, int capacity, const fth_config *config) {
+#if FTH_THREADS
+    fth_pool *pool = calloc(1, sizeof(fth_pool));
+    if (!pool)
+        return NULL;
+    int slots = 1;
+    while (slots < capacity)
+        slots *= 2;
+    if (!(pool->slots = malloc(slots * sizeof(fth_pool_slot)))) {
+        free(pool);
+        return NULL;
+    }
+    for (int i = 0; i < slots; i++)
+        atomic_init(&pool->slots[i].sequence, i);
+    pool->mask = slots - 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->work, NULL);
+    pthread_cond_init(&pool->idle, NULL);
+    pool->count = threads > 0 ? threads : pool_cores();
+    if (!(pool->workers = calloc(pool->count, sizeof(fth_pool_worker)))) {
+        pool->count = 0;
+        fth_pool_destroy(pool);
+        return NULL;
+    }
+    for (int i = 0; i < pool->count; i++) {
+        fth_pool_worker *worker = &pool->workers[i];
+        worker->pool = pool;
+        if (!fth_init_ex(&worker->vm, config)) {
+            pool->count = i;
+            fth_pool_destroy(pool);
+            return NULL;
+        }
+        if (pthread_create(&worker->thread, NULL, pool_worker, worker)) {
+            fth_destroy(&worker->vm);
+            pool->count = i;
+            fth_pool_destroy(pool);
+            return NULL;
+        }
+    }
+    return pool;
+#else
+    return NULL;
+#endif
+}
+
+bool fth_pool_submit(fth_pool *pool, const unsigned char *source, fth_pool_done done, void *user) {
+#if FTH_THREADS
+    fth_pool_job job = {
+        .source = (unsigned char*)strdup((const char*)source),
+        .done = done,
+        .user = user
+    };
+    if (!job.source)
+        return false;
+    if (pool_submit(pool, &job))
+        return true;
+    free(job.source);
+#endif
+    return false;
+}
+
+bool fth_pool_submit_program(fth_pool *pool, const fth_program *program, fth_pool_done done, void *user) {
+#if FTH_THREADS
+    fth_pool_job job = {
+        .program = program,
+        .done = done,
+        .user = user
+    };
+    return pool_submit(pool, &job);
+#else
+    return false;
+#endif
+}
+
+void fth_pool_wait(fth_pool *pool) {
+#if FTH_THREADS
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&pool->pending))
+        pthread_cond_wait(&pool->idle, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+#endif
+}
+
+void fth_pool_destroy(fth_pool *pool) {
+#if FTH_THREADS
+    if (!pool)
+        return;
+    pthread_mutex_lock(&pool->lock);
+    atomic_store(&pool->stopping, 1);
+    pthread_cond_broadcast(&pool->work);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->count; i++) {
+        pthread_join(pool->workers[i].thread, NULL);
+        fth_destroy(&pool->workers[i].vm);
+    }
+    pthread_cond_destroy(&pool->idle);
+    pthread_cond_destroy(&pool->work);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->workers);
+    free(pool->slots);
+    free(pool);
+#endif
+}
@@ -4,6 +4,7 @@
 extern "C" {
 #endif
 #include <stdint.h>
+#include <stdio.h>
 #include <wchar.h>
 #if defined(_MSC_VER) && _MSC_VER < 1800
 #include <windef.h>
@@ -21,6 +22,14 @@ typedef enum bool { false = 0, true = !false } bool;
 typedef uint64_t fth_int;
 typedef double fth_float;
 typedef struct fth_chunk fth_chunk;
+typedef struct fth_intern_table fth_intern_table;
+typedef struct fth_arena fth_arena;
+typedef struct fth_cache_table fth_cache_table;
+typedef struct fth_constant_table fth_constant_table;
+typedef struct fth_vm fth_vm;
+typedef struct fth_program fth_program;
+typedef struct fth_pool fth_pool;
+typedef struct fth_profile fth_profile;
 
 #define TYPES \
     X(BOOLEAN, boolean, bool) \
@@ -33,58 +42,270 @@ typedef enum {
 #define X(T, _, __) FTH_VALUE_##T,
     TYPES
 #undef X
+    // A string short enough to be stored in the value itself
+    FTH_VALUE_SMALL_STRING,
+    // The caller half of a call frame on the return stack
+    FTH_VALUE_FRAME
 } fth_value_t;
 
+#ifdef FTH_NAN_BOXING
+// Doubles are stored as themselves; every other type lives in the payload of
+// a quiet NaN. Integers keep their low 48 bits and objects their 48-bit
+// address, so a value is a single 8 byte word
+typedef uint64_t fth_value;
+// Small strings are zero padded in the payload, so they can't hold a NUL
+#define FTH_SMALL_STRING_MAX 6
+#else
+// Small strings fill the payload, zero padded
+#define FTH_SMALL_STRING_MAX 8
 typedef struct {
-    fth_value_t type;
+    uint8_t type; // fth_value_t
+    uint8_t length; // FTH_VALUE_SMALL_STRING
     union {
 #define X(_, N, TYPE) TYPE N;
         TYPES
 #undef X
     } as;
 } fth_value;
+#endif
 
 typedef enum {
-    FTH_OBJECT_STRING
+    FTH_OBJECT_STRING,
+    // A source file mapped into memory, see fth_exec_file
+    FTH_OBJECT_MAPPING
 } fth_object_t;
 
 typedef struct fth_object {
-    fth_object_t type;
+    uint8_t type; // fth_object_t
+    bool marked;
+    // Bytes allocated for the object, so it can go back to the right pool
+    uint32_t size;
+    // Every live object is on vm->objects for the collector to sweep
+    struct fth_object *next, *prev;
 } fth_object;
 
-typedef struct {
+typedef struct fth_string {
     fth_object obj;
     int length;
+    // Owned chars are copied into data, otherwise chars points at memory the
+    // string doesn't own, which `source` (if any) keeps alive
     bool owns_chars;
-    unsigned char chars[];
+    // Set for strings owned by a VM's intern table, which compare by pointer
+    bool interned;
+    // Set once a word has been defined with this name, it may have been reset since
+    bool defined;
+    uint64_t hash;
+    const unsigned char *chars;
+    fth_object *source;
+    unsigned char data[];
 } fth_string;
 
 bool fth_object_is(fth_value value, fth_object_t type);
-fth_object* fth_obj_new(fth_object_t type, size_t size);
-void fth_obj_destroy(fth_object *obj);
-fth_string* fth_string_new(const unsigned char *str, int length, bool owns_chars);
-#define fth_is_string(VAL) (fth_object_is((VAL), FTH_OBJECT_STRING))
+fth_object* fth_obj_new(fth_vm *vm, fth_object_t type, size_t size);
+void fth_obj_destroy(fth_vm *vm, fth_object *obj);
+fth_string* fth_string_new(fth_vm *vm, const unsigned char *str, int length, bool owns_chars);
 #define fth_as_string(VAL) ((fth_string*)fth_as_obj((VAL)))
-#define fth_as_cstring(VAL) ((fth_as_string((VAL)))->chars)
-#define fth_string_length(VAL) ((fth_as_string((VAL)))->length)
+// Strings are either a heap fth_string or, up to FTH_SMALL_STRING_MAX bytes,
+// stored inline in the value. These work on both; inline chars live in the
+// value, so take its address and are not NUL terminated at full length
+fth_value fth_small_string(const unsigned char *chars, int length);
+bool fth_is_small_string(fth_value value);
+bool fth_is_string(fth_value value);
+int fth_string_length(fth_value value);
+const unsigned char* fth_string_chars(const fth_value *value);
+#define fth_as_cstring(VAL) (fth_string_chars(&(VAL)))
+// Strings from the same VM, interned ones are compared by identity
+bool fth_string_equal(fth_value a, fth_value b);
 void fth_print_value(fth_value value);
 
+// Somewhere for text to go, fth_sink_file writes to a FILE* (NULL for stdout)
+typedef void (*fth_sink)(void *user, const char *text, size_t length);
+void fth_sink_file(void *user, const char *text, size_t length);
+
+fth_value_t fth_type(fth_value value);
 fth_value fth_nil(void);
+bool fth_is_nil(fth_value value);
 #define X(T, N, TYPE) \
-fth_value fth_##N(TYPE v);
+fth_value fth_##N(TYPE v); \
+bool fth_is_##N(fth_value v); \
+TYPE fth_as_##N(fth_value v);
 TYPES
 #undef X
 
+#ifndef FTH_STACK_DEPTH
+#define FTH_STACK_DEPTH 1024
+#endif
+#ifndef FTH_RETURN_STACK_DEPTH
+#define FTH_RETURN_STACK_DEPTH 1024
+#endif
+// The JIT is opt-in, as it doesn't yet beat the threaded interpreter with the
+// top of stack cached; set a threshold here or in fth_config to turn it on
+#ifndef FTH_JIT_THRESHOLD
+#define FTH_JIT_THRESHOLD -1
+#endif
+#ifndef FTH_GC_MIN_HEAP
+#define FTH_GC_MIN_HEAP (1024 * 1024)
+#endif
+#ifndef FTH_GC_GROWTH
+#define FTH_GC_GROWTH 200
+#endif
+// Streamed sources are lexed out of a buffer this size, it only grows to fit
+// a single token longer than that
+#ifndef FTH_STREAM_BUFFER
+#define FTH_STREAM_BUFFER (64 * 1024)
+#endif
+
+typedef struct {
+    fth_value *base, *top, *end;
+} fth_stack;
+
+// Backing memory for the object arena and the stacks. `free` is given the
+// size that was asked of `alloc`
+typedef struct {
+    void* (*alloc)(void *user, size_t size);
+    void (*free)(void *user, void *ptr, size_t size);
+    void *user;
+} fth_allocator;
+
+typedef struct {
+    int stack_depth;
+    int return_stack_depth;
+    // Leave alloc/free NULL for malloc/free
+    fth_allocator allocator;
+    // Runs of a chunk before it is compiled to native code, < 0 disables and
+    // 0 takes FTH_JIT_THRESHOLD
+    int jit_threshold;
+    // Object bytes allocated before the first collection, and the percentage
+    // of the live heap a collection allows before the next one
+    size_t gc_min_heap;
+    int gc_growth;
+    // Chunks fth_exec keeps compiled, by source, 0 for none
+    int compile_cache;
+    // Compile without line tables, errors and traces then report line 0
+    bool strip_lines;
+    // Constants every chunk the VM compiles shares, deduplicated across all
+    // of them, up to this many. 0 gives each chunk a pool of its own. The
+    // table only empties on fth_reset
+    int shared_constants;
+} fth_config;
+
+typedef struct {
+    size_t min_heap;
+    int growth;
+    // > 0 while collection is unsafe, e.g. during compilation
+    int paused;
+    size_t bytes_allocated;
+    size_t next_collection;
+    // Statistics
+    size_t collections;
+    size_t bytes_freed;
+    size_t objects_freed;
+    uint64_t last_pause_ns;
+    uint64_t max_pause_ns;
+    uint64_t total_pause_ns;
+} fth_gc;
+
+typedef struct {
+    int capacity;
+    fth_cache_table *table;
+    // Bumped whenever a word is defined again, see cache.inl
+    uint64_t generation;
+    // Statistics
+    size_t hits;
+    size_t misses;
+    size_t evictions;
+} fth_cache;
+
 typedef struct {
+    fth_string *name;
+    fth_chunk *chunk;
+} fth_word;
+
+// Tracing is compiled in unless FTH_NO_TRACE is defined, and then costs
+// nothing until a VM sets a hook and flags: compilation tests the flags once
+// per token and instructions are only traced by a separate interpreter loop,
+// which runs (instead of native code) while FTH_TRACE_OP is set
+typedef enum {
+    // Every token the lexer hands to the compiler
+    FTH_TRACE_TOKEN = 1 << 0,
+    // Every instruction as it is compiled, before the peephole pass
+    FTH_TRACE_EMIT = 1 << 1,
+    // Every instruction the interpreter is about to run
+    FTH_TRACE_OP = 1 << 2,
+    // Compile and runtime errors, as they are stored in vm->error
+    FTH_TRACE_ERROR = 1 << 3,
+    FTH_TRACE_ALL = 0xf
+} fth_trace_t;
+
+typedef struct {
+    fth_trace_t type;
+    // Token kind, op name or error message
+    const char *name;
+    // The token's text
+    const unsigned char *text;
+    int length;
+    // 0 when the chunk's lines were stripped
+    int line;
+    // EMIT, OP and runtime errors: the instruction, chunk is NULL for errors
+    // that can't be placed. See fth_disassemble
+    fth_chunk *chunk;
+    int offset;
+} fth_trace_event;
+
+typedef struct {
+    // fth_trace_t bits
+    int flags;
+    void (*hook)(fth_vm *vm, const fth_trace_event *event, void *user);
+    void *user;
+} fth_trace;
+
+typedef enum {
+    // Instructions by opcode, with the nanoseconds spent in them
+    FTH_PROFILE_OPS,
+    // Instructions by the one that ran before them
+    FTH_PROFILE_PAIRS,
+    // Calls to each word
+    FTH_PROFILE_WORDS
+} fth_profile_kind;
+
+typedef enum {
+    FTH_PROFILE_CSV,
+    FTH_PROFILE_JSON
+} fth_profile_format;
+
+typedef struct {
+    // Op name (the first of a pair) or word name
+    const char *name;
+    // The second op of a pair
+    const char *next;
+    uint64_t count;
+    uint64_t ns;
+} fth_profile_entry;
+
+struct fth_vm {
     fth_chunk *chunk;
     uint8_t *sp;
-    fth_value *stack;
-    fth_value *return_stack;
+    fth_stack stack;
+    fth_stack return_stack;
+    int jit_threshold;
+    bool strip_lines;
+    int shared_constants;
+    fth_constant_table *constants;
+    fth_word *words;
+    // Chunks handed out to the embedder, kept here as GC roots
+    fth_chunk **chunks;
+    fth_intern_table *strings;
+    fth_allocator allocator;
+    fth_arena *arena;
+    fth_gc gc;
+    fth_cache cache;
+    fth_trace trace;
+    fth_profile *profile;
     fth_value current;
     fth_value previous;
     fth_object *objects;
     char *error;
-} fth_vm;
+};
 
 typedef enum {
     FTH_OK,
@@ -92,17 +313,90 @@ typedef enum {
     FTH_RUNTIME_ERROR
 } fth_result_t;
 
-void fth_init(fth_vm *vm);
+// False when the allocator fails, with nothing left to destroy
+bool fth_init(fth_vm *vm);
+bool fth_init_ex(fth_vm *vm, const fth_config *config);
 void fth_destroy(fth_vm *vm);
+// Drops every word, string and object and empties both stacks, releasing
+// the object arena in one go; the VM stays usable
+void fth_reset(fth_vm *vm);
+// Runs a full collection now, outside of compilation
+void fth_collect(fth_vm *vm);
 
-void fth_stack_push(fth_vm *vm, fth_value value);
+fth_result_t fth_stack_push(fth_vm *vm, fth_value value);
 fth_result_t fth_stack_pop(fth_vm *vm, fth_value *value);
 fth_result_t fth_stack_at(fth_vm *vm, int idx, fth_value *value);
 fth_result_t fth_stack_peek(fth_vm *vm, int distance, fth_value *value);
 
+// NULL when the allocator fails
+fth_string* fth_intern(fth_vm *vm, const unsigned char *chars, int length);
+
 fth_result_t fth_exec(fth_vm *vm, const unsigned char *source);
+// Read as they compile, so pipes and stdin work and memory use doesn't
+// depend on the size of the source
+fth_result_t fth_exec_stream(fth_vm *vm, FILE *stream);
+fth_result_t fth_exec_fd(fth_vm *vm, int fd);
 fth_result_t fth_exec_file(fth_vm *vm, const char *path);
 
+// A compiled chunk can be run any number of times. It belongs to the VM that
+// compiled or loaded it, which holds its constants and words, and is freed
+// with fth_free_chunk or when that VM is reset or destroyed. Failures return
+// NULL/false with vm->error set
+fth_chunk* fth_compile_chunk(fth_vm *vm, const unsigned char *source);
+fth_result_t fth_run_chunk(fth_vm *vm, fth_chunk *chunk);
+void fth_free_chunk(fth_vm *vm, fth_chunk *chunk);
+// Bytecode images hold a chunk and every word of its VM. Loading maps the
+// image and runs the code out of the mapping, the words are added to the
+// loading VM's dictionary
+bool fth_save_chunk(fth_vm *vm, fth_chunk *chunk, const char *path);
+fth_chunk* fth_load_chunk(fth_vm *vm, const char *path);
+// Frees the chunk's line table, errors and traces in it then report line 0
+void fth_strip_chunk(fth_chunk *chunk);
+// Writes a listing of the chunk's instructions to the sink
+void fth_disassemble(fth_chunk *chunk, const char *name, fth_sink sink, void *user);
+
+// Profiles every run of the VM until stopped, through the same separate
+// interpreter loop as FTH_TRACE_OP, so nothing runs as native code meanwhile.
+// Start is false, leaving profiling off, when the profile can't be
+// allocated. Compiled out by FTH_NO_PROFILE, when start does nothing and
+// stop returns NULL, which the rest take as an empty profile.
+// fth_profile_entries copies up to `max` entries of a kind to `out`, most
+// frequent first, and returns how many there are
+bool fth_profile_start(fth_vm *vm);
+fth_profile* fth_profile_stop(fth_vm *vm);
+int fth_profile_entries(const fth_profile *profile, fth_profile_kind kind, fth_profile_entry *out, int max);
+void fth_profile_write(const fth_profile *profile, fth_profile_format format, fth_sink sink, void *user);
+void fth_profile_free(fth_profile *profile);
+
+// A program is compiled once, on its own, and can then be run against any
+// number of VMs, from any number of threads, without being written to. Its
+// words are its own and don't see or join the dictionary of the VM running
+// it, and its chunks are compiled to native code up front. Strings it pushes
+// belong to the program, which has to outlive them. Failures return NULL
+// with *error set, for the caller to free
+fth_program* fth_compile_program(const unsigned char *source, char **error);
+fth_result_t fth_run_program(fth_vm *vm, const fth_program *program);
+void fth_free_program(fth_program *program);
+
+// A pool compiles and runs scripts on worker threads, one VM each, made
+// from `config` (NULL for the defaults), so scripts use every core at once.
+// threads <= 0 starts one per core, and create returns NULL when the pool
+// can't be allocated. Submitting copies the source onto a queue of
+// `capacity` rounded up to a power of two, without taking a lock, and fails
+// when the queue is full or the copy can't be allocated. A script runs on
+// whichever worker gets to it first, with empty stacks but the words and
+// strings of whatever ran on that VM before. `done` is called there with
+// the result, vm->error is freed once it returns. Wait blocks until every
+// script submitted so far has finished, destroy finishes them first. A
+// program can be submitted instead of source, and has to outlive the run.
+// Built with FTH_NO_THREADS create returns NULL
+typedef void (*fth_pool_done)(void *user, fth_vm *vm, fth_result_t result);
+fth_pool* fth_pool_create(int threads, int capacity, const fth_config *config);
+bool fth_pool_submit(fth_pool *pool, const unsigned char *source, fth_pool_done done, void *user);
+bool fth_pool_submit_program(fth_pool *pool, const fth_program *program, fth_pool_done done, void *user);
+void fth_pool_wait(fth_pool *pool);
+void fth_pool_destroy(fth_pool *pool);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,116 @@
+// Stop-the-world mark-sweep over vm->objects. Roots are both stacks, the
+// constant pools of the running chunk, of every word, of every chunk handed
+// out by fth_compile_chunk/fth_load_chunk and of every chunk in the compile
+// cache, the shared constant table, and the word names; the intern table is
+// weak. Marking goes through an explicit gray stack, so objects that hold
+// references only need a case in gc_blacken, and the mark/sweep split leaves
+// room for an incremental or generational scheme.
+//
+// The interpreter never allocates, so collections only happen when an
+// object is allocated outside of compilation (gc.paused), and at the end of
+// fth_exec. The stacks in memory are always current at those points.
+
+typedef struct {
+    fth_object **gray;
+} gc_state;
+
+static uint64_t gc_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void gc_mark_object(gc_state *state, fth_object *obj) {
+    if (!obj || obj->marked)
+        return;
+    obj->marked = true;
+    garry_append(state->gray, obj);
+}
+
+static void gc_mark_value(gc_state *state, fth_value value) {
+    if (fth_is_obj(value))
+        gc_mark_object(state, fth_as_obj(value));
+}
+
+static void gc_mark_stack(gc_state *state, fth_stack *stack) {
+    for (fth_value *cell = stack->base; cell < stack->top; cell++)
+        gc_mark_value(state, *cell);
+}
+
+// A shared constant table is marked once, by gc_collect
+static void gc_mark_chunk(gc_state *state, fth_chunk *chunk) {
+    gc_mark_object(state, chunk->image);
+    if (!chunk->shared_constants)
+        for (int i = 0; i < garry_count(chunk->constants); i++)
+            gc_mark_value(state, chunk->constants[i]);
+}
+
+static void gc_blacken(gc_state *state, fth_object *obj) {
+    switch (obj->type) {
+        case FTH_OBJECT_STRING:
+            gc_mark_object(state, ((fth_string*)obj)->source);
+            break;
+        case FTH_OBJECT_MAPPING:
+            break;
+    }
+}
+
+static void gc_sweep(fth_vm *vm) {
+    fth_object *obj = vm->objects, *next;
+    for (; obj; obj = next) {
+        next = obj->next;
+        if (obj->marked) {
+            obj->marked = false;
+            continue;
+        }
+        gc_unlink(vm, obj);
+        obj_release(vm, obj);
+        vm->gc.bytes_allocated -= obj->size;
+        vm->gc.bytes_freed += obj->size;
+        vm->gc.objects_freed++;
+        arena_dealloc(vm, obj, obj->size);
+    }
+}
+
+static void gc_collect(fth_vm *vm) {
+    uint64_t start = gc_now_ns();
+    gc_state state = {0};
+    gc_mark_stack(&state, &vm->stack);
+    gc_mark_stack(&state, &vm->return_stack);
+    gc_mark_value(&state, vm->current);
+    gc_mark_value(&state, vm->previous);
+    if (vm->chunk)
+        gc_mark_chunk(&state, vm->chunk);
+    if (vm->constants)
+        for (int i = 0; i < garry_count(vm->constants->values); i++)
+            gc_mark_value(&state, vm->constants->values[i]);
+    for (int i = 0; i < garry_count(vm->chunks); i++)
+        gc_mark_chunk(&state, vm->chunks[i]);
+    if (vm->cache.table)
+        for (fth_cache_entry *entry = vm->cache.table->newest; entry; entry = entry->older)
+            gc_mark_chunk(&state, &entry->chunk);
+    for (int i = 0; i < garry_count(vm->words); i++) {
+        gc_mark_object(&state, &vm->words[i].name->obj);
+        gc_mark_chunk(&state, vm->words[i].chunk);
+    }
+    while (garry_count(state.gray)) {
+        fth_object *obj = state.gray[garry_count(state.gray) - 1];
+        garry_pop(state.gray);
+        gc_blacken(&state, obj);
+    }
+    garry_free(state.gray);
+    gc_sweep(vm);
+    size_t next = vm->gc.bytes_allocated * vm->gc.growth / 100;
+    vm->gc.next_collection = next > vm->gc.min_heap ? next : vm->gc.min_heap;
+    uint64_t pause = gc_now_ns() - start;
+    vm->gc.collections++;
+    vm->gc.last_pause_ns = pause;
+    vm->gc.total_pause_ns += pause;
+    if (pause > vm->gc.max_pause_ns)
+        vm->gc.max_pause_ns = pause;
+}
+
+static void gc_maybe_collect(fth_vm *vm) {
+    if (!vm->gc.paused && vm->gc.bytes_allocated >= vm->gc.next_collection)
+        gc_collect(vm);
+}
@@ -0,0 +1,374 @@
+// Bytecode images: a compiled chunk together with every word of the VM it
+// was compiled in, so CALL indices stay meaningful. All integers are native
+// endian (byte_order says which), every section is 8-byte aligned and
+// addressed by its offset from the start of the file:
+//
+//   image_header
+//   image_chunk[word_count + 1]   words in dictionary order, then the chunk
+//   per chunk: code, lines, constants, string payloads
+//
+// Code and lines are laid out as garry arrays (capacity and count ints ahead
+// of the elements), so a loaded chunk uses them straight out of the mapping.
+// The mapping is private and writable: when the loading VM already has words,
+// CALL operands are rebased in place, which only copies the pages touched.
+// Constants have to be rebuilt as values either way; long strings point into
+// the mapping like a mapped source file (see fth_exec_file), which keeps it
+// alive. Bump FTH_IMAGE_VERSION whenever OPS or this layout changes.
+
+#define FTH_IMAGE_MAGIC "fthi"
+#define FTH_IMAGE_VERSION 4
+#define FTH_IMAGE_BYTE_ORDER 0x01020304u
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t byte_order;
+    uint32_t op_count;
+    uint32_t word_count;
+    uint32_t _reserved;
+    uint64_t size;
+} image_header;
+
+typedef struct {
+    uint64_t code, lines, constants;
+    uint32_t code_length, line_count, constant_count;
+    // Word name, both 0 for the chunk itself
+    uint32_t name_length;
+    uint64_t name;
+} image_chunk;
+
+typedef enum {
+    IMAGE_NIL,
+    IMAGE_BOOLEAN,
+    IMAGE_INTEGER,
+    IMAGE_NUMBER,
+    IMAGE_STRING
+} image_constant_t;
+
+typedef struct {
+    uint32_t type;
+    // String payload length
+    uint32_t length;
+    union {
+        uint64_t integer;
+        double number;
+        uint64_t boolean;
+        uint64_t offset;
+    } as;
+} image_constant;
+
+static size_t image_align(uint8_t **out) {
+    while (garry_count(*out) % 8)
+        garry_append(*out, 0);
+    return garry_count(*out);
+}
+
+static size_t image_put(uint8_t **out, const void *data, size_t size) {
+    size_t offset = image_align(out);
+    if (size)
+        memcpy(garry_reserve(*out, (int)size), data, size);
+    return offset;
+}
+
+// A garry-shaped block: capacity and count, then the elements
+static size_t image_put_array(uint8_t **out, const void *data, int count, size_t size) {
+    int header[2] = { count, count };
+    size_t offset = image_put(out, header, sizeof(header));
+    image_put(out, data, count * size);
+    return offset;
+}
+
+static bool image_encode_constant(fth_value value, image_constant *out) {
+    memset(out, 0, sizeof(image_constant));
+    switch (fth_type(value)) {
+        case FTH_VALUE_NIL:
+            out->type = IMAGE_NIL;
+            return true;
+        case FTH_VALUE_BOOLEAN:
+            out->type = IMAGE_BOOLEAN;
+            out->as.boolean = fth_as_boolean(value);
+            return true;
+        case FTH_VALUE_INTEGER:
+            out->type = IMAGE_INTEGER;
+            out->as.integer = fth_as_integer(value);
+            return true;
+        case FTH_VALUE_NUMBER:
+            out->type = IMAGE_NUMBER;
+            out->as.number = fth_as_number(value);
+            return true;
+        case FTH_VALUE_SMALL_STRING:
+        case FTH_VALUE_OBJECT:
+            if (!fth_is_string(value))
+                return false;
+            out->type = IMAGE_STRING;
+            out->length = fth_string_length(value);
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void image_put_chunk(uint8_t **out, size_t entry, fth_chunk *chunk, fth_string *name) {
+    image_chunk header = {
+        .code_length = garry_count(chunk->data),
+        .line_count = garry_count(chunk->lines),
+        .constant_count = garry_count(chunk->constants),
+        .name_length = name ? name->length : 0
+    };
+    header.code = image_put_array(out, chunk->data, garry_count(chunk->data), 1);
+    header.lines = image_put_array(out, chunk->lines, garry_count(chunk->lines), 1);
+    header.constants = image_align(out);
+    (void)garry_reserve(*out, (int)(header.constant_count * sizeof(image_constant)));
+    for (uint32_t i = 0; i < header.constant_count; i++) {
+        image_constant constant;
+        image_encode_constant(chunk->constants[i], &constant);
+        if (constant.type == IMAGE_STRING)
+            constant.as.offset = image_put(out, fth_string_chars(&chunk->constants[i]), constant.length);
+        memcpy(*out + header.constants + i * sizeof(image_constant), &constant, sizeof(image_constant));
+    }
+    if (name)
+        header.name = image_put(out, name->chars, name->length);
+    memcpy(*out + entry, &header, sizeof(image_chunk));
+}
+
+static bool image_chunk_savable(fth_chunk *chunk) {
+    image_constant constant;
+    for (int i = 0; i < garry_count(chunk->constants); i++)
+        if (!image_encode_constant(chunk->constants[i], &constant))
+            return false;
+    return true;
+}
+
+static bool image_save(fth_vm *vm, fth_chunk *chunk, const char *path) {
+    int words = garry_count(vm->words);
+    for (int i = 0; i < words; i++)
+        if (!image_chunk_savable(vm->words[i].chunk)) {
+            vm->error = format("can't save the constants of '%.*s'", NULL, vm->words[i].name->length, vm->words[i].name->chars);
+            return false;
+        }
+    if (!image_chunk_savable(chunk)) {
+        vm->error = strdup("can't save a constant in the chunk");
+        return false;
+    }
+    uint8_t *out = NULL;
+    image_header header = {
+        .magic = FTH_IMAGE_MAGIC,
+        .version = FTH_IMAGE_VERSION,
+        .byte_order = FTH_IMAGE_BYTE_ORDER,
+        .op_count = FTH_OP_COUNT,
+        .word_count = words
+    };
+    image_put(&out, &header, sizeof(image_header));
+    size_t table = image_align(&out);
+    (void)garry_reserve(out, (int)((words + 1) * sizeof(image_chunk)));
+    for (int i = 0; i < words; i++)
+        image_put_chunk(&out, table + i * sizeof(image_chunk), vm->words[i].chunk, vm->words[i].name);
+    image_put_chunk(&out, table + words * sizeof(image_chunk), chunk, NULL);
+    header.size = image_align(&out);
+    memcpy(out, &header, sizeof(image_header));
+    FILE *file = fopen(path, "wb");
+    size_t size = garry_count(out);
+    bool result = file && fwrite(out, 1, size, file) == size;
+    if (file && fclose(file))
+        result = false;
+    if (!result)
+        vm->error = format("failed to write '%s'", NULL, path);
+    garry_free(out);
+    return result;
+}
+
+static bool image_range(uint64_t size, uint64_t offset, uint64_t length) {
+    return offset <= size && length <= size - offset;
+}
+
+static bool image_array(const uint8_t *base, uint64_t size, uint64_t offset, uint32_t count, size_t element) {
+    if (offset % 8 || !image_range(size, offset, 2 * sizeof(int) + (uint64_t)count * element))
+        return false;
+    const int *header = (const int*)(base + offset);
+    return header[0] == (int)count && header[1] == (int)count;
+}
+
+// The line table has to decode into whole pairs with every offset inside the
+// code, lines themselves can be anything
+static bool image_check_lines(const uint8_t *lines, uint32_t count, uint32_t code_length) {
+    const uint8_t *p = lines, *end = lines + count;
+    uint32_t offset = 0, delta, line;
+    while (p < end) {
+        if (!lines_get(&p, end, &delta) || !lines_get(&p, end, &line) || delta >= code_length - offset)
+            return false;
+        offset += delta;
+    }
+    return true;
+}
+
+// Everything a chunk refers to has to be inside the image, and its code has
+// to decode into whole instructions with operands in range, since the VM
+// trusts bytecode completely
+static bool image_check_chunk(const uint8_t *base, uint64_t size, const image_chunk *entry, uint32_t words) {
+    if (!entry->code_length || entry->code_length > INT_MAX || entry->line_count > INT_MAX ||
+        !image_array(base, size, entry->code, entry->code_length, 1) ||
+        !image_array(base, size, entry->lines, entry->line_count, 1) ||
+        !image_check_lines(base + entry->lines + 2 * sizeof(int), entry->line_count, entry->code_length) ||
+        entry->constants % 8 || !image_range(size, entry->constants, (uint64_t)entry->constant_count * sizeof(image_constant)) ||
+        !image_range(size, entry->name, entry->name_length))
+        return false;
+    const image_constant *constants = (const image_constant*)(base + entry->constants);
+    for (uint32_t i = 0; i < entry->constant_count; i++)
+        if (constants[i].type > IMAGE_STRING ||
+            (constants[i].type == IMAGE_STRING && (constants[i].length > INT_MAX || !image_range(size, constants[i].as.offset, constants[i].length))))
+            return false;
+    const uint8_t *code = base + entry->code + 2 * sizeof(int);
+    for (uint32_t offset = 0; offset < entry->code_length;) {
+        uint8_t op = code[offset];
+        if (op >= FTH_OP_COUNT || entry->code_length - offset < (uint32_t)op_length(op))
+            return false;
+        const uint8_t *operands = code + offset + 1;
+        switch (op) {
+            case FTH_OP_CONSTANT:
+            case FTH_OP_ADD_CONSTANT:
+            case FTH_OP_SUB_CONSTANT:
+            case FTH_OP_MUL_CONSTANT:
+            case FTH_OP_DIV_CONSTANT:
+            case FTH_OP_INT_ADD_CONSTANT:
+            case FTH_OP_INT_SUB_CONSTANT:
+            case FTH_OP_INT_MUL_CONSTANT:
+            case FTH_OP_INT_DIV_CONSTANT:
+            case FTH_OP_FLOAT_ADD_CONSTANT:
+            case FTH_OP_FLOAT_SUB_CONSTANT:
+            case FTH_OP_FLOAT_MUL_CONSTANT:
+            case FTH_OP_FLOAT_DIV_CONSTANT:
+            case FTH_OP_MIXED_ADD_CONSTANT:
+            case FTH_OP_MIXED_SUB_CONSTANT:
+            case FTH_OP_MIXED_MUL_CONSTANT:
+            case FTH_OP_MIXED_DIV_CONSTANT:
+                if (operands[0] >= entry->constant_count)
+                    return false;
+                break;
+            case FTH_OP_CONSTANT2:
+                if (operands[0] >= entry->constant_count || operands[1] >= entry->constant_count)
+                    return false;
+                break;
+            case FTH_OP_CONSTANT_LONG:
+                if ((uint32_t)(operands[0] | operands[1] << 8 | operands[2] << 16) >= entry->constant_count)
+                    return false;
+                break;
+            case FTH_OP_CALL:
+                if ((uint32_t)(operands[0] | operands[1] << 8) >= words)
+                    return false;
+                break;
+        }
+        offset += op_length(op);
+    }
+    // Every path has to end in RETURN or RET rather than run off the end
+    uint8_t last = code[entry->code_length - 1];
+    return last == FTH_OP_RETURN || last == FTH_OP_RET;
+}
+
+static void image_rebase(uint8_t *code, uint32_t length, int base) {
+    for (uint32_t offset = 0; offset < length; offset += op_length(code[offset]))
+        if (code[offset] == FTH_OP_CALL) {
+            int index = (code[offset + 1] | code[offset + 2] << 8) + base;
+            code[offset + 1] = index & 0xff;
+            code[offset + 2] = index >> 8;
+        }
+}
+
+// False when a string can't be allocated
+static bool image_decode_constant(fth_vm *vm, fth_mapping *mapping, const image_constant *constant, fth_value *out) {
+    switch (constant->type) {
+        case IMAGE_BOOLEAN:
+            *out = fth_boolean(constant->as.boolean != 0);
+            return true;
+        case IMAGE_INTEGER:
+            *out = fth_integer(constant->as.integer);
+            return true;
+        case IMAGE_NUMBER:
+            *out = fth_number(constant->as.number);
+            return true;
+        case IMAGE_STRING: {
+            const unsigned char *chars = mapping->data + constant->as.offset;
+            int length = (int)constant->length;
+            if (length <= FTH_SMALL_STRING_MAX && !memchr(chars, '\0', length)) {
+                *out = fth_small_string(chars, length);
+                return true;
+            }
+            fth_string *string = intern_string_from(vm, chars, length, &mapping->obj);
+            *out = string ? fth_obj(string) : fth_nil();
+            return string != NULL;
+        }
+        default:
+            *out = fth_nil();
+            return true;
+    }
+}
+
+static bool image_load_chunk(fth_vm *vm, fth_mapping *mapping, const image_chunk *entry, fth_chunk *chunk) {
+    chunk_init(chunk);
+    chunk->image = &mapping->obj;
+    chunk->data = mapping->data + entry->code + 2 * sizeof(int);
+    chunk->lines = mapping->data + entry->lines + 2 * sizeof(int);
+    const image_constant *constants = (const image_constant*)(mapping->data + entry->constants);
+    for (uint32_t i = 0; i < entry->constant_count; i++) {
+        fth_value value;
+        if (!image_decode_constant(vm, mapping, &constants[i], &value))
+            return false;
+        chunk_add_constant(chunk, value);
+    }
+    return true;
+}
+
+static fth_chunk* image_load(fth_vm *vm, fth_mapping *mapping) {
+    const uint8_t *base = mapping->data;
+    const image_header *header = (const image_header*)base;
+    uint64_t size = mapping->size;
+    if (size < sizeof(image_header) || memcmp(header->magic, FTH_IMAGE_MAGIC, 4)) {
+        vm->error = strdup("not an fth image");
+        return NULL;
+    }
+    if (header->byte_order != FTH_IMAGE_BYTE_ORDER || header->version != FTH_IMAGE_VERSION || header->op_count != FTH_OP_COUNT) {
+        vm->error = format("incompatible fth image (version %u)", NULL, header->version);
+        return NULL;
+    }
+    uint32_t words = header->word_count;
+    int base_word = garry_count(vm->words);
+    const image_chunk *entries = (const image_chunk*)(base + sizeof(image_header));
+    if (header->size > size || !image_range(size, sizeof(image_header), ((uint64_t)words + 1) * sizeof(image_chunk))) {
+        vm->error = strdup("truncated fth image");
+        return NULL;
+    }
+    for (uint32_t i = 0; i <= words; i++)
+        if (!image_check_chunk(base, size, &entries[i], words) || (i < words && !entries[i].name_length)) {
+            vm->error = strdup("corrupt fth image");
+            return NULL;
+        }
+    if (base_word + words > 0x10000) {
+        vm->error = strdup("too many words");
+        return NULL;
+    }
+    for (uint32_t i = 0; i <= words; i++)
+        if (base_word)
+            image_rebase(mapping->data + entries[i].code + 2 * sizeof(int), entries[i].code_length, base_word);
+    // Nothing made here is reachable until it is in place. Words loaded
+    // before an allocation fails stay defined, they are complete
+    vm->gc.paused++;
+    fth_chunk *result = NULL;
+    for (uint32_t i = 0; i <= words; i++) {
+        fth_chunk *chunk = malloc(sizeof(fth_chunk));
+        if (chunk)
+            chunk_init(chunk);
+        fth_string *name = i < words ? intern_string_from(vm, base + entries[i].name, entries[i].name_length, &mapping->obj) : NULL;
+        if (!chunk || (i < words && !name) || !image_load_chunk(vm, mapping, &entries[i], chunk)) {
+            if (chunk)
+                chunk_free(chunk);
+            free(chunk);
+            vm->error = strdup("out of memory");
+            break;
+        }
+        if (i < words)
+            define_word(vm, (fth_word) { .name = name, .chunk = chunk });
+        else
+            garry_append(vm->chunks, result = chunk);
+    }
+    vm->gc.paused--;
+    return result;
+}
@@ -0,0 +1,114 @@
+// Every string the compiler makes (literals and word names) goes through the
+// VM's intern table, so equal strings are one object and compare by pointer.
+// The table is an open-addressed set of strings keyed by their murmur hash,
+// cached in fth_string.hash. It doesn't keep its strings alive: the collector
+// calls intern_remove for each one it frees, which leaves a tombstone.
+
+#define INTERN_TOMBSTONE ((fth_string*)(uintptr_t)1)
+#define INTERN_MIN_CAPACITY 64
+
+struct fth_intern_table {
+    fth_string **slots;
+    int capacity;
+    int count;
+    // live strings plus tombstones
+    int used;
+};
+
+static uint64_t intern_hash(const unsigned char *chars, int length) {
+    return murmur(chars, length, 0);
+}
+
+static fth_string** intern_slot(fth_intern_table *table, uint64_t hash, const unsigned char *chars, int length) {
+    fth_string **tombstone = NULL;
+    for (int i = (int)(hash & (table->capacity - 1));; i = (i + 1) & (table->capacity - 1)) {
+        fth_string **slot = &table->slots[i];
+        if (!*slot)
+            return tombstone ? tombstone : slot;
+        if (*slot == INTERN_TOMBSTONE) {
+            if (!tombstone)
+                tombstone = slot;
+        } else if ((*slot)->hash == hash && (*slot)->length == length && !memcmp((*slot)->chars, chars, length))
+            return slot;
+    }
+}
+
+static void intern_grow(fth_intern_table *table) {
+    fth_string **slots = table->slots;
+    int capacity = table->capacity;
+    // Rehashing drops the tombstones, so only grow if the live strings need it
+    table->capacity = INTERN_MIN_CAPACITY;
+    while (table->capacity < (table->count + 1) * 2)
+        table->capacity *= 2;
+    table->slots = calloc(table->capacity, sizeof(fth_string*));
+    table->used = table->count;
+    for (int i = 0; i < capacity; i++)
+        if (slots[i] && slots[i] != INTERN_TOMBSTONE) {
+            int j = (int)(slots[i]->hash & (table->capacity - 1));
+            while (table->slots[j])
+                j = (j + 1) & (table->capacity - 1);
+            table->slots[j] = slots[i];
+        }
+    free(slots);
+}
+
+static fth_string* intern_find(fth_vm *vm, const unsigned char *chars, int length) {
+    if (!vm->strings)
+        return NULL;
+    fth_string **slot = intern_slot(vm->strings, intern_hash(chars, length), chars, length);
+    return *slot && *slot != INTERN_TOMBSTONE ? *slot : NULL;
+}
+
+// A new string either copies chars or, given the object they live in,
+// points at them and keeps that alive instead
+static fth_string* intern_string_from(fth_vm *vm, const unsigned char *chars, int length, fth_object *source) {
+    fth_intern_table *table = vm->strings;
+    if (!table) {
+        table = vm->strings = calloc(1, sizeof(fth_intern_table));
+        intern_grow(table);
+    }
+    uint64_t hash = intern_hash(chars, length);
+    fth_string **slot = intern_slot(table, hash, chars, length);
+    if (*slot && *slot != INTERN_TOMBSTONE)
+        return *slot;
+    // Allocating may collect, which can only add tombstones, so the slot
+    // is looked up again once the string exists
+    fth_string *result = fth_string_new(vm, chars, length, !source);
+    if (!result)
+        return NULL;
+    result->source = source;
+    result->interned = true;
+    result->hash = hash;
+    if ((table->used + 1) * 10 > table->capacity * 7)
+        intern_grow(table);
+    slot = intern_slot(table, hash, chars, length);
+    if (!*slot)
+        table->used++;
+    *slot = result;
+    table->count++;
+    return result;
+}
+
+static fth_string* intern_string(fth_vm *vm, const unsigned char *chars, int length) {
+    return intern_string_from(vm, chars, length, NULL);
+}
+
+static void intern_remove(fth_vm *vm, fth_string *string) {
+    fth_intern_table *table = vm->strings;
+    for (int i = (int)(string->hash & (table->capacity - 1)); table->slots[i]; i = (i + 1) & (table->capacity - 1))
+        if (table->slots[i] == string) {
+            table->slots[i] = INTERN_TOMBSTONE;
+            table->count--;
+            return;
+        }
+}
+
+// The strings themselves live in the arena and go when it is released
+static void intern_free(fth_vm *vm) {
+    fth_intern_table *table = vm->strings;
+    if (!table)
+        return;
+    free(table->slots);
+    free(table);
+    vm->strings = NULL;
+}
@@ -0,0 +1,793 @@
+// Baseline template JIT for x86-64. Stack shuffles, constant pushes, the
+// return stack moves and integer arithmetic are inlined as short native
+// templates, with their slow paths out of line; everything else becomes a
+// call to its jit_op_* helper with the address of its bytecode patched in:
+//
+//     mov [rbx + top], r12    ; sync the cached stack top
+//     mov rdi, rbx            ; vm, kept in rbx for the whole chunk
+//     mov rsi, <ip>           ; the instruction, helpers read operands from it
+//     call <helper>
+//     mov r12, [rbx + top]
+//     test eax, eax
+//     jnz exit
+//
+// which removes dispatch and decoding. Helpers work on the stack in memory
+// and mirror the handlers in run.inl; a chunk holding an op without a helper
+// is left to the interpreter.
+
+typedef fth_result_t(*fth_jit_fn)(fth_vm*);
+typedef fth_result_t(*fth_jit_helper)(fth_vm*, const uint8_t*);
+
+static bool jit_compile(fth_chunk *chunk);
+
+// Counts a run of the chunk and compiles it once it is hot
+static bool jit_ready(fth_vm *vm, fth_chunk *chunk) {
+    if (!chunk->jit && !chunk->jit_failed && vm->jit_threshold >= 0 && ++chunk->runs > vm->jit_threshold)
+        jit_compile(chunk);
+    return chunk->jit != NULL;
+}
+
+#define JIT_THROW(MSG) \
+    do { \
+        vm->sp = (uint8_t*)ip + op_length(*ip); \
+        vm->error = strdup(MSG); \
+        return FTH_RUNTIME_ERROR; \
+    } while (0)
+#define JIT_NEED(N) \
+    if (vm->stack.top - vm->stack.base < (N)) \
+        JIT_THROW("data stack underflow")
+#define JIT_ROOM(N) \
+    if (vm->stack.end - vm->stack.top < (N)) \
+        JIT_THROW("data stack overflow")
+#define JIT_TOS vm->stack.top[-1]
+#define JIT_NOS vm->stack.top[-2]
+
+static fth_result_t jit_arith(fth_vm *vm, const uint8_t *ip, char op, fth_value a, fth_value b, fth_value *out) {
+    if (fth_is_integer(a) && fth_is_integer(b)) {
+        fth_int x = fth_as_integer(a), y = fth_as_integer(b);
+        switch (op) {
+            case '+':
+                *out = fth_integer(x + y);
+                break;
+            case '-':
+                *out = fth_integer(x - y);
+                break;
+            case '*':
+                *out = fth_integer(x * y);
+                break;
+            case '/':
+                if (!y)
+                    JIT_THROW("division by zero");
+                *out = fth_integer(x / y);
+                break;
+        }
+    } else {
+        fth_float x, y;
+        if (!as_float(a, &x) || !as_float(b, &y))
+            JIT_THROW("arithmetic on non-numeric value");
+        switch (op) {
+            case '+':
+                *out = fth_number(x + y);
+                break;
+            case '-':
+                *out = fth_number(x - y);
+                break;
+            case '*':
+                *out = fth_number(x * y);
+                break;
+            case '/':
+                *out = fth_number(x / y);
+                break;
+        }
+    }
+    return FTH_OK;
+}
+
+static fth_result_t jit_binary(fth_vm *vm, const uint8_t *ip, char op) {
+    JIT_NEED(2);
+    fth_value value;
+    if (jit_arith(vm, ip, op, JIT_NOS, JIT_TOS, &value) != FTH_OK)
+        return FTH_RUNTIME_ERROR;
+    JIT_NOS = value;
+    vm->stack.top--;
+    return FTH_OK;
+}
+
+static fth_result_t jit_binary_constant(fth_vm *vm, const uint8_t *ip, char op) {
+    JIT_NEED(1);
+    return jit_arith(vm, ip, op, JIT_TOS, vm->chunk->constants[ip[1]], &JIT_TOS);
+}
+
+static fth_result_t jit_op_RETURN(fth_vm *vm, const uint8_t *ip) {
+    JIT_NEED(1);
+    vm->sp = (uint8_t*)ip + 1;
+    fth_print_value(*--vm->stack.top);
+    printf("\n");
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_CONSTANT(fth_vm *vm, const uint8_t *ip) {
+    JIT_ROOM(1);
+    *vm->stack.top++ = vm->chunk->constants[ip[1]];
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_CONSTANT_LONG(fth_vm *vm, const uint8_t *ip) {
+    JIT_ROOM(1);
+    *vm->stack.top++ = vm->chunk->constants[ip[1] | ip[2] << 8 | ip[3] << 16];
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_CLEAR(fth_vm *vm, const uint8_t *ip) {
+    (void)ip;
+    vm->stack.top = vm->stack.base;
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_PERIOD(fth_vm *vm, const uint8_t *ip) {
+    JIT_NEED(1);
+    fth_print_value(JIT_TOS);
+    printf("\n");
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_POP(fth_vm *vm, const uint8_t *ip) {
+    if (vm->return_stack.top == vm->return_stack.base)
+        JIT_THROW("return stack underflow");
+    JIT_ROOM(1);
+    *vm->stack.top++ = *--vm->return_stack.top;
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_PUSH(fth_vm *vm, const uint8_t *ip) {
+    JIT_NEED(1);
+    if (vm->return_stack.top == vm->return_stack.end)
+        JIT_THROW("return stack overflow");
+    *vm->return_stack.top++ = *--vm->stack.top;
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_DUMP(fth_vm *vm, const uint8_t *ip) {
+    (void)ip;
+    dump_stack(&vm->stack);
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_DUMP_RSTACK(fth_vm *vm, const uint8_t *ip) {
+    (void)ip;
+    dump_stack(&vm->return_stack);
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_ADD(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary(vm, ip, '+');
+}
+
+static fth_result_t jit_op_SUB(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary(vm, ip, '-');
+}
+
+static fth_result_t jit_op_MUL(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary(vm, ip, '*');
+}
+
+static fth_result_t jit_op_DIV(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary(vm, ip, '/');
+}
+
+static fth_result_t jit_op_DUP(fth_vm *vm, const uint8_t *ip) {
+    JIT_NEED(1);
+    JIT_ROOM(1);
+    vm->stack.top[0] = JIT_TOS;
+    vm->stack.top++;
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_DROP(fth_vm *vm, const uint8_t *ip) {
+    JIT_NEED(1);
+    vm->stack.top--;
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_SWAP(fth_vm *vm, const uint8_t *ip) {
+    JIT_NEED(2);
+    fth_value value = JIT_NOS;
+    JIT_NOS = JIT_TOS;
+    JIT_TOS = value;
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_OVER(fth_vm *vm, const uint8_t *ip) {
+    JIT_NEED(2);
+    JIT_ROOM(1);
+    vm->stack.top[0] = JIT_NOS;
+    vm->stack.top++;
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_CONSTANT2(fth_vm *vm, const uint8_t *ip) {
+    JIT_ROOM(2);
+    *vm->stack.top++ = vm->chunk->constants[ip[1]];
+    *vm->stack.top++ = vm->chunk->constants[ip[2]];
+    return FTH_OK;
+}
+
+static fth_result_t jit_op_ADD_CONSTANT(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary_constant(vm, ip, '+');
+}
+
+static fth_result_t jit_op_SUB_CONSTANT(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary_constant(vm, ip, '-');
+}
+
+static fth_result_t jit_op_MUL_CONSTANT(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary_constant(vm, ip, '*');
+}
+
+static fth_result_t jit_op_DIV_CONSTANT(fth_vm *vm, const uint8_t *ip) {
+    return jit_binary_constant(vm, ip, '/');
+}
+
+// Native code stays generic, quickened ops run the same helpers
+#define jit_op_INT_ADD jit_op_ADD
+#define jit_op_INT_SUB jit_op_SUB
+#define jit_op_INT_MUL jit_op_MUL
+#define jit_op_INT_DIV jit_op_DIV
+#define jit_op_FLOAT_ADD jit_op_ADD
+#define jit_op_FLOAT_SUB jit_op_SUB
+#define jit_op_FLOAT_MUL jit_op_MUL
+#define jit_op_FLOAT_DIV jit_op_DIV
+#define jit_op_INT_ADD_CONSTANT jit_op_ADD_CONSTANT
+#define jit_op_INT_SUB_CONSTANT jit_op_SUB_CONSTANT
+#define jit_op_INT_MUL_CONSTANT jit_op_MUL_CONSTANT
+#define jit_op_INT_DIV_CONSTANT jit_op_DIV_CONSTANT
+#define jit_op_FLOAT_ADD_CONSTANT jit_op_ADD_CONSTANT
+#define jit_op_FLOAT_SUB_CONSTANT jit_op_SUB_CONSTANT
+#define jit_op_FLOAT_MUL_CONSTANT jit_op_MUL_CONSTANT
+#define jit_op_FLOAT_DIV_CONSTANT jit_op_DIV_CONSTANT
+#define jit_op_MIXED_ADD jit_op_ADD
+#define jit_op_MIXED_SUB jit_op_SUB
+#define jit_op_MIXED_MUL jit_op_MUL
+#define jit_op_MIXED_DIV jit_op_DIV
+#define jit_op_MIXED_ADD_CONSTANT jit_op_ADD_CONSTANT
+#define jit_op_MIXED_SUB_CONSTANT jit_op_SUB_CONSTANT
+#define jit_op_MIXED_MUL_CONSTANT jit_op_MUL_CONSTANT
+#define jit_op_MIXED_DIV_CONSTANT jit_op_DIV_CONSTANT
+
+static fth_result_t jit_range(fth_vm *vm, const uint8_t *ip) {
+    const char *error = range_op(vm, *ip, ip + 1);
+    if (error)
+        JIT_THROW(error);
+    return FTH_OK;
+}
+
+#define jit_op_RANGE_DROP jit_range
+#define jit_op_RANGE_MOVE jit_range
+#define jit_op_RANGE_ROLL jit_range
+#define jit_op_RANGE_COPY jit_range
+#define jit_op_RANGE_SET jit_range
+#define jit_op_RANGE_PRINT jit_range
+
+// Native words keep their return address on the C stack, so RET just leaves
+// the function; an interpreted callee gets a frame with no caller, which makes
+// its RET return out of the nested interpreter instead
+static fth_result_t jit_op_CALL(fth_vm *vm, const uint8_t *ip) {
+    fth_chunk *caller = vm->chunk, *callee = vm->words[ip[1] | ip[2] << 8].chunk;
+    fth_result_t result;
+    if (!jit_ready(vm, callee)) {
+        if (vm->return_stack.end - vm->return_stack.top < 2)
+            JIT_THROW("return stack overflow");
+        *vm->return_stack.top++ = fth_integer(0);
+        *vm->return_stack.top++ = frame_value(NULL);
+        vm->chunk = callee;
+        vm->sp = callee->data;
+        result = fth_interpret(vm);
+    } else {
+        vm->chunk = callee;
+        result = ((fth_jit_fn)callee->jit)(vm);
+    }
+    vm->chunk = caller;
+    return result;
+}
+
+static fth_result_t jit_op_RET(fth_vm *vm, const uint8_t *ip) {
+    (void)vm;
+    (void)ip;
+    return FTH_OK;
+}
+
+
+static const fth_jit_helper jit_helpers[FTH_OP_COUNT] = {
+#define X(N, _) [FTH_OP_##N] = jit_op_##N,
+    OPS
+#undef X
+};
+
+#undef JIT_THROW
+#undef JIT_NEED
+#undef JIT_ROOM
+#undef JIT_TOS
+#undef JIT_NOS
+
+// An inlined template's way out when one of its guards fails: the rel32s
+// to patch, the op whose helper runs instead, and where to carry on after
+typedef struct jit_slow {
+    int guards[6];
+    int count;
+    const uint8_t *ip;
+    int resume;
+} jit_slow;
+
+typedef struct {
+    uint8_t *code;
+    uint8_t *base; // final address of code[0], for rel32 calls
+    bool near;     // helpers are within rel32 reach of base
+    int *exits;
+    struct jit_slow *slow;
+} jit_state;
+
+static void jit_emit(jit_state *jit, int count, ...) {
+    va_list args;
+    va_start(args, count);
+    for (int i = 0; i < count; i++)
+        garry_append(jit->code, (uint8_t)va_arg(args, int));
+    va_end(args);
+}
+
+static void jit_emit32(jit_state *jit, uint32_t value) {
+    for (int i = 0; i < 4; i++)
+        garry_append(jit->code, (uint8_t)(value >> (i * 8)));
+}
+
+static void jit_emit64(jit_state *jit, uint64_t value) {
+    for (int i = 0; i < 8; i++)
+        garry_append(jit->code, (uint8_t)(value >> (i * 8)));
+}
+
+static int jit_label(jit_state *jit) {
+    return garry_count(jit->code);
+}
+
+// Emits a rel32 placeholder and returns its position for jit_patch
+static int jit_forward(jit_state *jit) {
+    int at = garry_count(jit->code);
+    jit_emit32(jit, 0);
+    return at;
+}
+
+static void jit_patch(jit_state *jit, int at, int target) {
+    int32_t rel = target - (at + 4);
+    memcpy(&jit->code[at], &rel, sizeof(int32_t));
+}
+
+static void jit_exit_if(jit_state *jit, bool always) {
+    if (always)
+        jit_emit(jit, 1, 0xe9); // jmp exit
+    else
+        jit_emit(jit, 4, 0x85, 0xc0, 0x0f, 0x85); // test eax, eax; jnz exit
+    garry_append(jit->exits, jit_forward(jit));
+}
+
+// Register plan for generated code:
+//   rbx  fth_vm*            r13  vm->stack.end
+//   r12  vm->stack.top      r14  vm->stack.base
+// r12 is written back around every helper call so helpers see the real stack
+#define JIT_DISP(FIELD) ((uint32_t)offsetof(fth_vm, FIELD))
+#define JIT_VALUE ((int)sizeof(fth_value))
+
+static void jit_call_helper(jit_state *jit, fth_jit_helper helper, const uint8_t *ip) {
+    jit_emit(jit, 3, 0x4c, 0x89, 0xa3); // mov [rbx + top], r12
+    jit_emit32(jit, JIT_DISP(stack.top));
+    jit_emit(jit, 3, 0x48, 0x89, 0xdf); // mov rdi, rbx
+    jit_emit(jit, 2, 0x48, 0xbe); // mov rsi, imm64
+    jit_emit64(jit, (uint64_t)(uintptr_t)ip);
+    if (jit->near) {
+        jit_emit(jit, 1, 0xe8); // call rel32
+        int at = jit_forward(jit);
+        int32_t rel = (int32_t)((intptr_t)helper - (intptr_t)(jit->base + at + 4));
+        memcpy(&jit->code[at], &rel, sizeof(int32_t));
+    } else {
+        jit_emit(jit, 2, 0x48, 0xb8); // mov rax, imm64
+        jit_emit64(jit, (uint64_t)(uintptr_t)helper);
+        jit_emit(jit, 2, 0xff, 0xd0); // call rax
+    }
+    jit_emit(jit, 3, 0x4c, 0x8b, 0xa3); // mov r12, [rbx + top]
+    jit_emit32(jit, JIT_DISP(stack.top));
+}
+
+// Guards for the inlined templates, each returns a rel32 to the slow path
+static int jit_need(jit_state *jit, int n) {
+    jit_emit(jit, 4, 0x49, 0x8d, 0x46, n * JIT_VALUE); // lea rax, [r14 + n]
+    jit_emit(jit, 5, 0x49, 0x39, 0xc4, 0x0f, 0x82); // cmp r12, rax; jb slow
+    return jit_forward(jit);
+}
+
+static int jit_room(jit_state *jit, int n) {
+    jit_emit(jit, 5, 0x49, 0x8d, 0x44, 0x24, n * JIT_VALUE); // lea rax, [r12 + n]
+    jit_emit(jit, 5, 0x4c, 0x39, 0xe8, 0x0f, 0x87); // cmp rax, r13; ja slow
+    return jit_forward(jit);
+}
+
+// Value moves between [r12 + disp] and a scratch pair (rax:rdx or rcx:rsi).
+// A 16 byte value goes as two words, as arithmetic writes just its payload
+// and a wider load over that store would stall instead of forwarding
+static const uint8_t jit_scratch[2][2] = {{0, 2}, {1, 6}};
+
+static void jit_move(jit_state *jit, uint8_t opcode, int scratch, int8_t disp) {
+    for (int i = 0; i < JIT_VALUE / 8; i++) // mov reg, [r12 + disp] or back
+        jit_emit(jit, 5, 0x49, opcode, 0x44 | jit_scratch[scratch][i] << 3, 0x24, (uint8_t)(disp + i * 8));
+}
+
+static void jit_load(jit_state *jit, int scratch, int8_t disp) {
+    jit_move(jit, 0x8b, scratch, disp);
+}
+
+static void jit_store(jit_state *jit, int scratch, int8_t disp) {
+    jit_move(jit, 0x89, scratch, disp);
+}
+
+// r15 holds the chunk's constants for the whole chunk
+static void jit_load_constant(jit_state *jit, int index) {
+    for (int i = 0; i < JIT_VALUE / 8; i++) {
+        jit_emit(jit, 3, 0x49, 0x8b, 0x87 | jit_scratch[0][i] << 3); // mov reg, [r15 + index]
+        jit_emit32(jit, (uint32_t)(index * JIT_VALUE + i * 8));
+    }
+}
+
+// The same pair to or from [rcx], the return stack's top
+static void jit_move_rcx(jit_state *jit, uint8_t opcode) {
+    for (int i = 0; i < JIT_VALUE / 8; i++) // mov reg, [rcx + i] or back
+        jit_emit(jit, 4, 0x48, opcode, 0x41 | jit_scratch[0][i] << 3, i * 8);
+}
+
+static void jit_bump(jit_state *jit, int n) {
+    if (n > 0)
+        jit_emit(jit, 4, 0x49, 0x83, 0xc4, n * JIT_VALUE); // add r12, n
+    else
+        jit_emit(jit, 4, 0x49, 0x83, 0xec, -n * JIT_VALUE); // sub r12, n
+}
+
+#ifndef FTH_NAN_BOXING
+#define JIT_AS ((int)offsetof(fth_value, as))
+
+// Tagged numbers are a type byte and a plain int64 or double, so arithmetic
+// on them only has to check the types and work on the payloads in place.
+// Quickened ops inline the one type they were specialized for, generic ops
+// both, and mixed operands go to the helper
+enum {
+    JIT_INTEGERS = 1,
+    JIT_FLOATS = 2
+};
+
+static char jit_arith_op(uint8_t op) {
+    switch (op) {
+#define X(N, OP) \
+        case FTH_OP_##N: case FTH_OP_INT_##N: case FTH_OP_FLOAT_##N: case FTH_OP_MIXED_##N: \
+        case FTH_OP_##N##_CONSTANT: case FTH_OP_INT_##N##_CONSTANT: case FTH_OP_FLOAT_##N##_CONSTANT: \
+        case FTH_OP_MIXED_##N##_CONSTANT: \
+            return OP;
+        X(ADD, '+')
+        X(SUB, '-')
+        X(MUL, '*')
+        X(DIV, '/')
+#undef X
+        default:
+            return 0;
+    }
+}
+
+static int jit_type_guard(jit_state *jit, int8_t disp, fth_value_t type) {
+    jit_emit(jit, 6, 0x41, 0x80, 0x7c, 0x24, (uint8_t)disp, type); // cmp byte [r12 + disp], type
+    jit_emit(jit, 2, 0x0f, 0x85); // jne slow
+    return jit_forward(jit);
+}
+
+static uint8_t jit_float_op(char op) {
+    switch (op) {
+        case '+':
+            return 0x58; // addsd
+        case '-':
+            return 0x5c; // subsd
+        case '*':
+            return 0x59; // mulsd
+        default:
+            return 0x5e; // divsd
+    }
+}
+
+// NOS op= TOS; returns the number of guards written to slow
+static int jit_arith_binary(jit_state *jit, char op, int types, int *slow) {
+    int count = 0, floats = -1, done = -1;
+    uint8_t tos = (uint8_t)(-JIT_VALUE + JIT_AS), nos = (uint8_t)(-2 * JIT_VALUE + JIT_AS);
+    slow[count++] = jit_need(jit, 2);
+    if (types & JIT_INTEGERS) {
+        floats = jit_type_guard(jit, -JIT_VALUE, FTH_VALUE_INTEGER);
+        slow[count++] = jit_type_guard(jit, -2 * JIT_VALUE, FTH_VALUE_INTEGER);
+        switch (op) {
+            case '+':
+                jit_emit(jit, 5, 0x49, 0x8b, 0x44, 0x24, tos); // mov rax, [r12 + tos]
+                jit_emit(jit, 5, 0x49, 0x01, 0x44, 0x24, nos); // add [r12 + nos], rax
+                break;
+            case '-':
+                jit_emit(jit, 5, 0x49, 0x8b, 0x44, 0x24, tos); // mov rax, [r12 + tos]
+                jit_emit(jit, 5, 0x49, 0x29, 0x44, 0x24, nos); // sub [r12 + nos], rax
+                break;
+            case '*':
+                jit_emit(jit, 5, 0x49, 0x8b, 0x44, 0x24, tos); // mov rax, [r12 + tos]
+                jit_emit(jit, 5, 0x49, 0x8b, 0x4c, 0x24, nos); // mov rcx, [r12 + nos]
+                jit_emit(jit, 4, 0x48, 0x0f, 0xaf, 0xc8); // imul rcx, rax
+                jit_emit(jit, 5, 0x49, 0x89, 0x4c, 0x24, nos); // mov [r12 + nos], rcx
+                break;
+            case '/':
+                jit_emit(jit, 5, 0x49, 0x8b, 0x4c, 0x24, tos); // mov rcx, [r12 + tos]
+                jit_emit(jit, 5, 0x48, 0x85, 0xc9, 0x0f, 0x84); // test rcx, rcx; jz slow
+                slow[count++] = jit_forward(jit);
+                jit_emit(jit, 5, 0x49, 0x8b, 0x44, 0x24, nos); // mov rax, [r12 + nos]
+                jit_emit(jit, 5, 0x31, 0xd2, 0x48, 0xf7, 0xf1); // xor edx, edx; div rcx (fth_int is unsigned)
+                jit_emit(jit, 5, 0x49, 0x89, 0x44, 0x24, nos); // mov [r12 + nos], rax
+                break;
+        }
+        if (types & JIT_FLOATS) {
+            jit_emit(jit, 1, 0xe9); // jmp done
+            done = jit_forward(jit);
+            jit_patch(jit, floats, jit_label(jit));
+        } else
+            slow[count++] = floats;
+    }
+    if (types & JIT_FLOATS) {
+        slow[count++] = jit_type_guard(jit, -JIT_VALUE, FTH_VALUE_NUMBER);
+        slow[count++] = jit_type_guard(jit, -2 * JIT_VALUE, FTH_VALUE_NUMBER);
+        jit_emit(jit, 7, 0xf2, 0x41, 0x0f, 0x10, 0x44, 0x24, nos); // movsd xmm0, [r12 + nos]
+        jit_emit(jit, 7, 0xf2, 0x41, 0x0f, jit_float_op(op), 0x44, 0x24, tos); // op xmm0, [r12 + tos]
+        jit_emit(jit, 7, 0xf2, 0x41, 0x0f, 0x11, 0x44, 0x24, nos); // movsd [r12 + nos], xmm0
+    }
+    if (done >= 0)
+        jit_patch(jit, done, jit_label(jit));
+    jit_bump(jit, -1);
+    return count;
+}
+
+// TOS op= a constant, whose type is known here so only that path is written
+static int jit_arith_constant(jit_state *jit, char op, fth_chunk *chunk, int index, int *slow) {
+    int count = 0;
+    uint8_t tos = (uint8_t)(-JIT_VALUE + JIT_AS);
+    fth_value constant = chunk->constants[index];
+    slow[count++] = jit_need(jit, 1);
+    if (fth_is_integer(constant)) {
+        slow[count++] = jit_type_guard(jit, -JIT_VALUE, FTH_VALUE_INTEGER);
+        jit_emit(jit, 2, 0x48, 0xb9); // mov rcx, imm64
+        jit_emit64(jit, (uint64_t)fth_as_integer(constant));
+        switch (op) {
+            case '+':
+                jit_emit(jit, 5, 0x49, 0x01, 0x4c, 0x24, tos); // add [r12 + tos], rcx
+                break;
+            case '-':
+                jit_emit(jit, 5, 0x49, 0x29, 0x4c, 0x24, tos); // sub [r12 + tos], rcx
+                break;
+            case '*':
+                jit_emit(jit, 5, 0x49, 0x8b, 0x44, 0x24, tos); // mov rax, [r12 + tos]
+                jit_emit(jit, 4, 0x48, 0x0f, 0xaf, 0xc1); // imul rax, rcx
+                jit_emit(jit, 5, 0x49, 0x89, 0x44, 0x24, tos); // mov [r12 + tos], rax
+                break;
+            case '/':
+                jit_emit(jit, 5, 0x49, 0x8b, 0x44, 0x24, tos); // mov rax, [r12 + tos]
+                jit_emit(jit, 5, 0x31, 0xd2, 0x48, 0xf7, 0xf1); // xor edx, edx; div rcx (fth_int is unsigned)
+                jit_emit(jit, 5, 0x49, 0x89, 0x44, 0x24, tos); // mov [r12 + tos], rax
+                break;
+        }
+    } else {
+        slow[count++] = jit_type_guard(jit, -JIT_VALUE, FTH_VALUE_NUMBER);
+        jit_emit(jit, 7, 0xf2, 0x41, 0x0f, 0x10, 0x44, 0x24, tos); // movsd xmm0, [r12 + tos]
+        jit_emit(jit, 5, 0xf2, 0x41, 0x0f, jit_float_op(op), 0x87); // op xmm0, [r15 + constant]
+        jit_emit32(jit, (uint32_t)(index * JIT_VALUE + JIT_AS));
+        jit_emit(jit, 7, 0xf2, 0x41, 0x0f, 0x11, 0x44, 0x24, tos); // movsd [r12 + tos], xmm0
+    }
+    return count;
+}
+
+#undef JIT_AS
+#endif
+
+// Data movement and arithmetic are inlined behind the same checks
+// the helpers make. The slow paths are kept out of line, after the body,
+// where a failed guard runs the helper, which raises the error itself or
+// handles the operands the template didn't
+static bool jit_inline(jit_state *jit, fth_chunk *chunk, const uint8_t *ip) {
+    jit_slow slow = { .ip = ip };
+#ifdef FTH_NAN_BOXING
+    (void)chunk; // only the tagged arithmetic templates read constants
+#endif
+    switch (*ip) {
+        case FTH_OP_CONSTANT:
+            slow.guards[slow.count++] = jit_room(jit, 1);
+            jit_load_constant(jit, ip[1]);
+            jit_store(jit, 0, 0);
+            jit_bump(jit, 1);
+            break;
+        case FTH_OP_CONSTANT_LONG:
+            slow.guards[slow.count++] = jit_room(jit, 1);
+            jit_load_constant(jit, ip[1] | ip[2] << 8 | ip[3] << 16);
+            jit_store(jit, 0, 0);
+            jit_bump(jit, 1);
+            break;
+        case FTH_OP_CONSTANT2:
+            slow.guards[slow.count++] = jit_room(jit, 2);
+            jit_load_constant(jit, ip[1]);
+            jit_store(jit, 0, 0);
+            jit_load_constant(jit, ip[2]);
+            jit_store(jit, 0, JIT_VALUE);
+            jit_bump(jit, 2);
+            break;
+        case FTH_OP_CLEAR:
+            jit_emit(jit, 3, 0x4d, 0x89, 0xf4); // mov r12, r14
+            return true;
+        case FTH_OP_DUP:
+            slow.guards[slow.count++] = jit_need(jit, 1);
+            slow.guards[slow.count++] = jit_room(jit, 1);
+            jit_load(jit, 0, -JIT_VALUE);
+            jit_store(jit, 0, 0);
+            jit_bump(jit, 1);
+            break;
+        case FTH_OP_DROP:
+            slow.guards[slow.count++] = jit_need(jit, 1);
+            jit_bump(jit, -1);
+            break;
+        case FTH_OP_SWAP:
+            slow.guards[slow.count++] = jit_need(jit, 2);
+            jit_load(jit, 0, -JIT_VALUE);
+            jit_load(jit, 1, -2 * JIT_VALUE);
+            jit_store(jit, 0, -2 * JIT_VALUE);
+            jit_store(jit, 1, -JIT_VALUE);
+            break;
+        case FTH_OP_OVER:
+            slow.guards[slow.count++] = jit_need(jit, 2);
+            slow.guards[slow.count++] = jit_room(jit, 1);
+            jit_load(jit, 0, -2 * JIT_VALUE);
+            jit_store(jit, 0, 0);
+            jit_bump(jit, 1);
+            break;
+        // The return stack stays in memory, helpers use it too
+        case FTH_OP_PUSH:
+            slow.guards[slow.count++] = jit_need(jit, 1);
+            jit_emit(jit, 3, 0x48, 0x8b, 0x8b); // mov rcx, [rbx + rtop]
+            jit_emit32(jit, JIT_DISP(return_stack.top));
+            jit_emit(jit, 3, 0x48, 0x3b, 0x8b); // cmp rcx, [rbx + rend]
+            jit_emit32(jit, JIT_DISP(return_stack.end));
+            jit_emit(jit, 2, 0x0f, 0x83); // jae slow
+            slow.guards[slow.count++] = jit_forward(jit);
+            jit_load(jit, 0, -JIT_VALUE);
+            jit_move_rcx(jit, 0x89);
+            jit_emit(jit, 4, 0x48, 0x83, 0xc1, JIT_VALUE); // add rcx, 1
+            jit_emit(jit, 3, 0x48, 0x89, 0x8b); // mov [rbx + rtop], rcx
+            jit_emit32(jit, JIT_DISP(return_stack.top));
+            jit_bump(jit, -1);
+            break;
+        case FTH_OP_POP:
+            slow.guards[slow.count++] = jit_room(jit, 1);
+            jit_emit(jit, 3, 0x48, 0x8b, 0x8b); // mov rcx, [rbx + rtop]
+            jit_emit32(jit, JIT_DISP(return_stack.top));
+            jit_emit(jit, 3, 0x48, 0x3b, 0x8b); // cmp rcx, [rbx + rbase]
+            jit_emit32(jit, JIT_DISP(return_stack.base));
+            jit_emit(jit, 2, 0x0f, 0x86); // jbe slow
+            slow.guards[slow.count++] = jit_forward(jit);
+            jit_emit(jit, 4, 0x48, 0x83, 0xe9, JIT_VALUE); // sub rcx, 1
+            jit_move_rcx(jit, 0x8b);
+            jit_emit(jit, 3, 0x48, 0x89, 0x8b); // mov [rbx + rtop], rcx
+            jit_emit32(jit, JIT_DISP(return_stack.top));
+            jit_store(jit, 0, 0);
+            jit_bump(jit, 1);
+            break;
+#ifndef FTH_NAN_BOXING
+        case FTH_OP_ADD: case FTH_OP_SUB: case FTH_OP_MUL: case FTH_OP_DIV:
+        case FTH_OP_MIXED_ADD: case FTH_OP_MIXED_SUB: case FTH_OP_MIXED_MUL: case FTH_OP_MIXED_DIV:
+            slow.count = jit_arith_binary(jit, jit_arith_op(*ip), JIT_INTEGERS | JIT_FLOATS, slow.guards);
+            break;
+        case FTH_OP_INT_ADD: case FTH_OP_INT_SUB: case FTH_OP_INT_MUL: case FTH_OP_INT_DIV:
+            slow.count = jit_arith_binary(jit, jit_arith_op(*ip), JIT_INTEGERS, slow.guards);
+            break;
+        case FTH_OP_FLOAT_ADD: case FTH_OP_FLOAT_SUB: case FTH_OP_FLOAT_MUL: case FTH_OP_FLOAT_DIV:
+            slow.count = jit_arith_binary(jit, jit_arith_op(*ip), JIT_FLOATS, slow.guards);
+            break;
+        case FTH_OP_ADD_CONSTANT: case FTH_OP_SUB_CONSTANT: case FTH_OP_MUL_CONSTANT: case FTH_OP_DIV_CONSTANT:
+        case FTH_OP_INT_ADD_CONSTANT: case FTH_OP_INT_SUB_CONSTANT: case FTH_OP_INT_MUL_CONSTANT: case FTH_OP_INT_DIV_CONSTANT:
+        case FTH_OP_FLOAT_ADD_CONSTANT: case FTH_OP_FLOAT_SUB_CONSTANT: case FTH_OP_FLOAT_MUL_CONSTANT: case FTH_OP_FLOAT_DIV_CONSTANT:
+        case FTH_OP_MIXED_ADD_CONSTANT: case FTH_OP_MIXED_SUB_CONSTANT: case FTH_OP_MIXED_MUL_CONSTANT: case FTH_OP_MIXED_DIV_CONSTANT: {
+            fth_value constant = chunk->constants[ip[1]];
+            // Integer division by zero is left to the helper's error
+            if (fth_is_integer(constant) ? jit_arith_op(*ip) == '/' && !fth_as_integer(constant) : !fth_is_number(constant))
+                return false;
+            slow.count = jit_arith_constant(jit, jit_arith_op(*ip), chunk, ip[1], slow.guards);
+            break;
+        }
+#endif
+        default:
+            return false;
+    }
+    slow.resume = jit_label(jit);
+    garry_append(jit->slow, slow);
+    return true;
+}
+
+static void jit_slow_paths(jit_state *jit) {
+    for (int i = 0; i < garry_count(jit->slow); i++) {
+        jit_slow *slow = &jit->slow[i];
+        for (int j = 0; j < slow->count; j++)
+            jit_patch(jit, slow->guards[j], jit_label(jit));
+        jit_call_helper(jit, jit_helpers[*slow->ip], slow->ip);
+        jit_exit_if(jit, false);
+        jit_emit(jit, 1, 0xe9); // jmp resume
+        jit_patch(jit, jit_forward(jit), slow->resume);
+    }
+}
+
+static bool jit_translate(jit_state *jit, fth_chunk *chunk) {
+    // push rbx; push r12; push r13; push r14; push r15 (keeps rsp 16-byte aligned)
+    jit_emit(jit, 9, 0x53, 0x41, 0x54, 0x41, 0x55, 0x41, 0x56, 0x41, 0x57);
+    jit_emit(jit, 3, 0x48, 0x89, 0xfb); // mov rbx, rdi
+    jit_emit(jit, 3, 0x4c, 0x8b, 0xa3); // mov r12, [rbx + top]
+    jit_emit32(jit, JIT_DISP(stack.top));
+    jit_emit(jit, 3, 0x4c, 0x8b, 0xab); // mov r13, [rbx + end]
+    jit_emit32(jit, JIT_DISP(stack.end));
+    jit_emit(jit, 3, 0x4c, 0x8b, 0xb3); // mov r14, [rbx + base]
+    jit_emit32(jit, JIT_DISP(stack.base));
+    jit_emit(jit, 2, 0x49, 0xbf); // mov r15, imm64
+    jit_emit64(jit, (uint64_t)(uintptr_t)chunk->constants);
+    for (int offset = 0; offset < garry_count(chunk->data); offset += op_length(chunk->data[offset])) {
+        const uint8_t *ip = &chunk->data[offset];
+        if (*ip >= FTH_OP_COUNT || !jit_helpers[*ip])
+            return false;
+        if (jit_inline(jit, chunk, ip))
+            continue;
+        jit_call_helper(jit, jit_helpers[*ip], ip);
+        jit_exit_if(jit, *ip == FTH_OP_RETURN || *ip == FTH_OP_RET);
+    }
+    jit_emit(jit, 2, 0x31, 0xc0); // xor eax, eax
+    int exit = jit_label(jit);
+    jit_emit(jit, 3, 0x4c, 0x89, 0xa3); // mov [rbx + top], r12
+    jit_emit32(jit, JIT_DISP(stack.top));
+    // pop r15; pop r14; pop r13; pop r12; pop rbx; ret
+    jit_emit(jit, 10, 0x41, 0x5f, 0x41, 0x5e, 0x41, 0x5d, 0x41, 0x5c, 0x5b, 0xc3);
+    jit_slow_paths(jit);
+    for (int i = 0; i < garry_count(jit->exits); i++)
+        jit_patch(jit, jit->exits[i], exit);
+    return true;
+}
+
+#undef JIT_DISP
+#undef JIT_VALUE
+
+static bool jit_compile(fth_chunk *chunk) {
+    jit_state jit = {0};
+    bool success = false;
+    // Size the mapping from the largest template, and ask for it next to
+    // the helpers so calls can be direct rel32 branches
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t size = ((size_t)garry_count(chunk->data) * 128 + 128 + page - 1) & ~(page - 1);
+    uintptr_t helpers = (uintptr_t)&jit_op_RETURN;
+    void *hint = (void*)((helpers + ((uintptr_t)1 << 26)) & ~(uintptr_t)(page - 1));
+    uint8_t *mem = mmap(hint, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem == MAP_FAILED)
+        goto BAIL;
+    intptr_t distance = (intptr_t)mem - (intptr_t)helpers;
+    jit.base = mem;
+    jit.near = distance < ((intptr_t)1 << 30) && distance > -((intptr_t)1 << 30);
+    if (!jit_translate(&jit, chunk) || (size_t)garry_count(jit.code) > size) {
+        munmap(mem, size);
+        goto BAIL;
+    }
+    memcpy(mem, jit.code, garry_count(jit.code));
+    if (mprotect(mem, size, PROT_READ | PROT_EXEC) != 0) {
+        munmap(mem, size);
+        goto BAIL;
+    }
+    chunk->jit = mem;
+    chunk->jit_size = size;
+    success = true;
+BAIL:
+    if (!success)
+        chunk->jit_failed = true;
+    garry_free(jit.code);
+    garry_free(jit.exits);
+    garry_free(jit.slow);
+    return success;
+}
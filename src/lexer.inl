@@ -6,7 +6,19 @@
 //
 
 #define KEYWORDS \
-    X(POP, )
+    X("+", ADD) \
+    X("-", SUB) \
+    X("*", MUL) \
+    X("/", DIV) \
+    X("dup", DUP) \
+    X("drop", DROP) \
+    X("swap", SWAP) \
+    X("over", OVER) \
+    X(">r", PUSH) \
+    X("r>", POP) \
+    X(".", PERIOD) \
+    X(".s", DUMP) \
+    X(".rs", DUMP_RSTACK)
 
 typedef enum {
     FTH_TOKEN_ERROR,
@@ -27,17 +39,36 @@ typedef struct {
     int line;
 } fth_token;
 
+// A streamed source is read into `buffer` as the lexer reaches the NUL
+// written at `limit`. A refill keeps everything from the start of the current
+// token, so tokens can span reads and the buffer only grows for a token that
+// doesn't fit. Token pointers are only good until the next token is read
+typedef size_t(*fth_stream_reader)(void *source, unsigned char *buffer, size_t size, bool *failed);
+
+typedef struct {
+    fth_stream_reader reader;
+    void *source;
+    unsigned char *buffer, *limit;
+    size_t capacity;
+    bool done, failed;
+} fth_stream;
+
 typedef struct {
+    fth_vm *vm;
+    fth_stream *stream;
+    // Set when the source lives in an object (a mapped file), strings are
+    // then made to point into it instead of copying
+    fth_object *source;
     const unsigned char *begin;
     struct {
         const unsigned char *ptr;
         wchar_t ch;
         int ch_length;
     } cursor;
-    int line;
+    int line, start_line;
     fth_token current;
     fth_token previous;
-    const char *error;
+    char *error;
 } fth_parser;
 
 static int utf8read(const unsigned char* c, wchar_t* out) {
@@ -65,17 +96,91 @@ static inline int is_eof(fth_parser *parser) {
 
 static inline void update_start(fth_parser *parser) {
     parser->begin = parser->cursor.ptr;
+    parser->start_line = parser->line;
 }
 
-static inline wchar_t advance(fth_parser *parser) {
-    int l = utf8read(parser->cursor.ptr, NULL);
-    parser->cursor.ptr += l;
-    parser->cursor.ch_length = utf8read(parser->cursor.ptr, &parser->cursor.ch);
+// Longest sequence utf8read will consume
+#define FTH_UTF8_MAX 6
+
+static bool stream_grow(fth_stream *stream) {
+    unsigned char *buffer = realloc(stream->buffer, stream->capacity * 2 + 1);
+    if (!buffer) {
+        stream->done = stream->failed = true;
+        return false;
+    }
+    stream->buffer = buffer;
+    stream->capacity *= 2;
+    return true;
+}
+
+static void stream_fill(fth_parser *parser, size_t lookahead) {
+    fth_stream *stream = parser->stream;
+    size_t keep = stream->limit - parser->begin;
+    size_t cursor = parser->cursor.ptr - parser->begin;
+    if (parser->begin != stream->buffer)
+        memmove(stream->buffer, parser->begin, keep);
+    // Leave at least half the buffer for reading
+    if (keep * 2 > stream->capacity)
+        stream_grow(stream);
+    while (!stream->done && keep < cursor + lookahead) {
+        if (keep == stream->capacity && !stream_grow(stream))
+            break;
+        size_t read = stream->reader(stream->source, stream->buffer + keep, stream->capacity - keep, &stream->failed);
+        if (read)
+            keep += read;
+        else
+            stream->done = true;
+    }
+    stream->limit = stream->buffer + keep;
+    *stream->limit = '\0';
+    parser->begin = stream->buffer;
+    parser->cursor.ptr = stream->buffer + cursor;
+}
+
+// Make sure `lookahead` bytes from the cursor are buffered, or the source is done
+static inline void stream_need(fth_parser *parser, size_t lookahead) {
+    fth_stream *stream = parser->stream;
+    if (stream && !stream->done && parser->cursor.ptr + lookahead > stream->limit)
+        stream_fill(parser, lookahead);
+}
+
+static inline void decode(fth_parser *parser) {
+    unsigned char c = *parser->cursor.ptr;
+    if (!c || c >= 0x80) {
+        stream_need(parser, FTH_UTF8_MAX);
+        c = *parser->cursor.ptr;
+    }
+    if (c < 0x80) {
+        parser->cursor.ch = c;
+        parser->cursor.ch_length = 1;
+    } else
+        parser->cursor.ch_length = utf8read(parser->cursor.ptr, &parser->cursor.ch);
     if (parser->cursor.ch == '\n')
         parser->line++;
+}
+
+static inline wchar_t advance(fth_parser *parser) {
+    parser->cursor.ptr += parser->cursor.ch_length;
+    decode(parser);
     return parser->cursor.ch;
 }
 
+// Skip an ASCII run in one go, see scan.inl. The current character has
+// already been counted if it was a '\n', the one landed on is counted by
+// decode. Returns false if the cursor didn't move
+static inline bool skip_run(fth_parser *parser, scan_mode mode) {
+    if (parser->cursor.ch >= 0x80)
+        return false;
+    int newlines;
+    const unsigned char *stop = scan_ascii(parser->cursor.ptr, mode, &newlines);
+    if (stop == parser->cursor.ptr)
+        return false;
+    parser->line += newlines - (parser->cursor.ch == '\n');
+    parser->cursor.ptr = stop;
+    decode(parser);
+    return true;
+}
+
 static inline void advance_n(fth_parser *parser, int _n) {
     int n = _n;
     while (!is_eof(parser) && n-- > 0)
@@ -86,12 +191,14 @@ static inline wchar_t next(fth_parser *parser) {
     if (is_eof(parser))
         return '\0';
     wchar_t next;
+    stream_need(parser, parser->cursor.ch_length + FTH_UTF8_MAX);
     utf8read(parser->cursor.ptr + parser->cursor.ch_length, &next);
     return next;
 }
 
 static void skip_line(fth_parser *parser) {
     for (;;) {
+        update_start(parser); // nothing skipped has to stay buffered
         if (is_eof(parser))
             return;
         switch (peek(parser)) {
@@ -109,6 +216,10 @@ static void skip_line(fth_parser *parser) {
             case '\n':
                 advance(parser);
                 return;
+            default:
+                if (skip_run(parser, SCAN_LINE))
+                    continue;
+                break;
         }
         advance(parser);
     }
@@ -116,6 +227,7 @@ static void skip_line(fth_parser *parser) {
 
 static void skip_whitespace(fth_parser *parser) {
     for (;;) {
+        update_start(parser); // nothing skipped has to stay buffered
         if (is_eof(parser))
             return;
         switch (peek(parser)) {
@@ -128,7 +240,7 @@ static void skip_whitespace(fth_parser *parser) {
             case '\r':
             case '\n':
             case '\f':
-                advance(parser);
+                skip_run(parser, SCAN_SPACE);
                 break;
             default:
                 return;
@@ -141,7 +253,7 @@ static fth_token fth_token_make(fth_parser *parser, fth_token_t type) {
         .type = type,
         .begin = parser->begin,
         .length = (int)(parser->cursor.ptr - parser->begin),
-        .line = parser->line
+        .line = parser->start_line
     };
 }
 
@@ -166,7 +278,8 @@ static fth_token read_symbol(fth_parser *parser) {
             case ';':
                 goto BREAK;
             default:
-                advance(parser);
+                if (!skip_run(parser, SCAN_SYMBOL))
+                    advance(parser);
                 break;
         }
     }
@@ -206,7 +319,7 @@ static fth_token read_number(fth_parser *parser) {
                 break;
             case '.':
                 if (is_float) {
-                    parser->error = "unexpected second '.' in number literal";
+                    parser->error = strdup("unexpected second '.' in number literal");
                     return fth_token_make(parser, FTH_TOKEN_ERROR);
                 }
                 is_float = 1;
@@ -226,16 +339,18 @@ static fth_token read_string(fth_parser *parser) {
     update_start(parser);
     for (;;) {
         if (is_eof(parser)) {
-            parser->error = "unterminated string";
+            parser->error = strdup("unterminated string");
             return fth_token_make(parser, FTH_TOKEN_ERROR); // unterminated string
         }
         switch (peek(parser)) {
             case '"':;
                 fth_token token = fth_token_make(parser, FTH_TOKEN_STRING);
                 advance(parser); // skip second "
+                token.begin = parser->begin; // in case that refilled
                 return token;
             default:
-                advance(parser);
+                if (!skip_run(parser, SCAN_STRING))
+                    advance(parser);
         }
     }
 }
@@ -264,6 +379,9 @@ static fth_token next_token(fth_parser *parser) {
             return read_string(parser);
         case '$':
             return read_atom(parser);
+        case ';':
+            advance(parser);
+            return fth_token_make(parser, FTH_TOKEN_ATOM);
         default:
             return read_atom(parser);
     }
@@ -290,20 +408,38 @@ static const char* fth_token_str(fth_token *token) {
     }
 }
 
-static void fth_print_token(fth_token *token) {
-    printf("[%s] %.*s\n", fth_token_str(token), token->length, token->begin);
-}
-
-static void parser_init(fth_parser *parser, const unsigned char *source) {
+static void parser_init(fth_parser *parser, fth_vm *vm, const unsigned char *source) {
     memset(parser, 0, sizeof(fth_parser));
+    parser->vm = vm;
     parser->begin = source;
     parser->cursor.ptr = source;
-    utf8read(source, &parser->cursor.ch);
-    parser->line = 1;
+    parser->cursor.ch_length = utf8read(source, &parser->cursor.ch);
+    parser->line = parser->start_line = 1;
+}
+
+static bool parser_init_stream(fth_parser *parser, fth_vm *vm, fth_stream *stream, fth_stream_reader reader, void *source) {
+    memset(stream, 0, sizeof(fth_stream));
+    stream->reader = reader;
+    stream->source = source;
+    stream->capacity = FTH_STREAM_BUFFER;
+    if (!(stream->buffer = malloc(stream->capacity + 1)))
+        return false;
+    stream->limit = stream->buffer;
+    *stream->limit = '\0';
+    parser_init(parser, vm, stream->buffer);
+    parser->stream = stream;
+    stream_fill(parser, FTH_UTF8_MAX);
+    parser->cursor.ch_length = utf8read(parser->cursor.ptr, &parser->cursor.ch);
+    return true;
+}
+
+// Line 0 leaves the line table empty
+static int emit_line(fth_parser *parser) {
+    return parser->vm && parser->vm->strip_lines ? 0 : parser->current.line;
 }
 
 static void emit(fth_parser *parser, fth_chunk *chunk, uint8_t byte) {
-    chunk_write(chunk, byte, parser->previous.line);
+    chunk_write(chunk, byte, emit_line(parser));
 }
 
 static void emit_op(fth_parser *parser, fth_chunk *chunk, uint8_t byte1, uint8_t byte2) {
@@ -311,31 +447,91 @@ static void emit_op(fth_parser *parser, fth_chunk *chunk, uint8_t byte1, uint8_t
     emit(parser, chunk, byte2);
 }
 
-static void emit_constant(fth_parser *parser, fth_chunk *chunk, fth_value value) {
-    chunk_write_constant(chunk, value, parser->previous.line);
+static bool emit_constant(fth_parser *parser, fth_chunk *chunk, fth_value value) {
+    int index = vm_constant(parser->vm, chunk, value);
+    if (index < 0) {
+        parser->error = strdup("too many constants");
+        return false;
+    }
+    chunk_write_constant(chunk, index, emit_line(parser));
+    return true;
+}
+
+// Short literals live in the value itself and never touch the heap
+static bool emit_string(fth_parser *parser, fth_chunk *chunk) {
+    const unsigned char *chars = parser->current.begin;
+    int length = parser->current.length;
+    if (length <= FTH_SMALL_STRING_MAX && !memchr(chars, '\0', length))
+        return emit_constant(parser, chunk, fth_small_string(chars, length));
+    fth_string *string = intern_string_from(parser->vm, chars, length, parser->source);
+    if (!string) {
+        parser->error = strdup("out of memory");
+        return false;
+    }
+    return emit_constant(parser, chunk, fth_obj(string));
 }
 
-static void emit_number(fth_parser *parser, fth_chunk *chunk) {
-    static char buf[513];
-    memset(buf, 0, sizeof(char) * 513);
-    if (parser->current.length >= 512)
-        abort();
+// Literals are copied out to be terminated for strtod/strtoull, onto the
+// stack so any number of parsers can compile at once
+static bool literal_copy(fth_parser *parser, char *buf, size_t size) {
+    if ((size_t)parser->current.length >= size) {
+        parser->error = format("number literal longer than %zu characters", NULL, size - 1);
+        return false;
+    }
     memcpy(buf, parser->begin, parser->current.length);
-    buf[parser->current.length+1] = '\0';
+    buf[parser->current.length] = '\0';
+    return true;
+}
+
+static bool emit_number(fth_parser *parser, fth_chunk *chunk) {
+    char buf[513];
+    if (!literal_copy(parser, buf, sizeof(buf)))
+        return false;
     double value = strtod(buf, NULL);
-    emit_constant(parser, chunk, fth_number(value));
+    return emit_constant(parser, chunk, fth_number(value));
 }
 
-static void emit_integer(fth_parser *parser, fth_chunk *chunk) {
-    static char buf[21];
-    memset(buf, 0, sizeof(char) * 20);
-    if (parser->current.length >= 20)
-        abort();
-    memcpy(buf, parser->begin, parser->current.length);
-    buf[parser->current.length+1] = '\0';
-    char *end;
-    uint64_t value = strtoull(buf, &end, 10);
-    emit_constant(parser, chunk, fth_integer(value));
+static bool emit_integer(fth_parser *parser, fth_chunk *chunk) {
+    char buf[21];
+    if (!literal_copy(parser, buf, sizeof(buf)))
+        return false;
+    uint64_t value = strtoull(buf, NULL, 10);
+    return emit_constant(parser, chunk, fth_integer(value));
+}
+
+static bool compile_keyword(fth_parser *parser, fth_chunk *chunk) {
+    fth_token *token = &parser->current;
+#define X(NAME, OP) \
+    if (token->length == sizeof(NAME) - 1 && !memcmp(token->begin, NAME, sizeof(NAME) - 1)) { \
+        emit(parser, chunk, FTH_OP_##OP); \
+        return true; \
+    }
+    KEYWORDS
+#undef X
+    return false;
+}
+
+static bool token_is(fth_token *token, const char *str) {
+    return token->length == strlen(str) && !memcmp(token->begin, str, token->length);
+}
+
+// Words are resolved to their dictionary index here, newest definition
+// first, so CALL never looks a name up at run time. Names are interned, so a
+// name that was never interned or defined can't be a word and the rest is
+// pointer tests
+static bool compile_word(fth_parser *parser, fth_chunk *chunk) {
+    fth_string *name = intern_find(parser->vm, parser->current.begin, parser->current.length);
+    if (!name || !name->defined)
+        return false;
+    for (int i = garry_count(parser->vm->words) - 1; i >= 0; i--) {
+        if (parser->vm->words[i].name == name) {
+            emit(parser, chunk, FTH_OP_CALL);
+            emit(parser, chunk, i & 0xff);
+            emit(parser, chunk, i >> 8);
+            return true;
+        }
+    }
+    return false;
 }
 
 int read_basic_int(const unsigned char *start, int *size) {
@@ -362,153 +558,210 @@ BAIL:
     return result;
 }
 
+// $[r][range][op]
+//   r      work on the return stack instead of the data stack
+//   range  cells counted from the top of the stack, 0 being the top:
+//            n    cell n           *    the whole stack
+//            n~m  cells n to m     n~   cell n to the bottom
+//            ~m   cells 0 to m
+//          defaults to the top cell, or the whole stack when there is no op
+//   op     >  move the range onto the other stack
+//          <  move the range to the top of its own stack
+//          ~  copy the range onto the data stack
+//          =  pop the data stack and fill the range with the value
+//          .  print the range
+//          with no op the range is dropped
+// A `~` after a lone index is the copy op, so `$1~` is over and `$1~~`
+// copies everything from cell 1 down
 #define SE_OPS \
-    X(POP, '>') \
-    X(PUSH, '<') \
+    X(MOVE, '>') \
+    X(ROLL, '<') \
     X(COPY, '~') \
     X(SET, '=') \
-    X(PRINT, '.') \
-
-typedef enum {
-    FTH_SE_OP_CLEAR,
-#define X(N, C) FTH_SE_OP_##N,
-    SE_OPS
-#undef X
-} stack_expr_op;
+    X(PRINT, '.')
 
 static bool compile_stack_expr(fth_parser *parser, fth_chunk *chunk) {
-    bool success = true;
     const unsigned char *str = parser->current.begin;
     int length = parser->current.length;
     int cursor = 0;
-    int from = 0, to = 0;
-    stack_expr_op op = FTH_SE_OP_CLEAR;
-    bool is_return_stack = false;
+    int from = 0, to = FTH_RANGE_BOTTOM;
+    uint8_t flags = 0, op = FTH_OP_RANGE_DROP;
+    bool has_range = false;
 #define _PEEK (cursor >= length ? '\0' : str[cursor])
 #define _NEXT (cursor + 1 >= length ? '\0' : str[cursor+1])
+#define _IS_DIGIT(C) ((C) >= '0' && (C) <= '9')
 #define _READ_INT (read_basic_int(str + cursor, &cursor))
     // parse source
-    switch (_PEEK) {
-        case 'r':
-        case 'R':
-            is_return_stack = true;
-            cursor++;
-            break;
-        case '0' ... '9':
-        case '~':
-        case '*':
-        case '>':
-        case '<':
-        case '=':
-        case '.':
-            break;
-        case '\0':
-            goto SKIP;
-        default:
-            parser->error = strdup("unexpected character in stack expr source");
-            success = false;
-            goto BAIL;
+    if (_PEEK == 'r' || _PEEK == 'R') {
+        flags |= FTH_RANGE_RSTACK;
+        cursor++;
     }
     // parse range
-    
     switch (_PEEK) {
         case '*':
-            from = -1;
-            to = -1;
+            has_range = true;
             cursor++;
             break;
-        case '0' ... '9': {
-            int a = _READ_INT;
-            if (_PEEK == '~') {
-                from = a;
-                to = -1;
-            } else {
-                from = a;
-                to = a;
+        case '0' ... '9':
+            has_range = true;
+            from = to = _READ_INT;
+            if (_PEEK == '~' && _NEXT != '\0') {
+                cursor++;
+                to = _IS_DIGIT(_PEEK) ? _READ_INT : FTH_RANGE_BOTTOM;
             }
             break;
-        }
         case '~':
-            switch (_NEXT) {
-                case '0' ... '9':
-                    from = _READ_INT;
-                    to = -1;
-                    break;
-                default:
-                    break;
+            if (_IS_DIGIT(_NEXT)) {
+                has_range = true;
+                cursor++;
+                to = _READ_INT;
             }
-        case '>':
-        case '<':
-        case '=':
-        case '.':
             break;
-        case '\0':
-            goto SKIP;
-        default:
-            parser->error = strdup("unexpected char in stack expr range");
-            success = false;
-            goto BAIL;
     }
     // parse op
-    switch (_PEEK) {
+    if (cursor < length) {
+        switch (_PEEK) {
 #define X(N, C) \
-        case C: \
-            op = FTH_SE_OP_##N; \
-            break;
-        SE_OPS
+            case C: \
+                op = FTH_OP_RANGE_##N; \
+                break;
+            SE_OPS
 #undef X
-        case '\0':
-            goto SKIP;
-        default:
-            parser->error = strdup("unexpected char in stack expr op");
-            success = false;
-            goto BAIL;
+            default:
+                parser->error = format("unexpected '%c' in stack expression", NULL, _PEEK);
+                return false;
+        }
+        cursor++;
+        if (!has_range)
+            to = 0;
     }
-SKIP:
-    // form expression + write ops
-    // TODO ...
-    // > FTH_OP_EXPR
-    // > FTH_OP_EXPR_DSTACK | FTH_OP_EXPR_RSTACK
-    // > FTH_OP_EXPR_ALL |  FTH_EXPR_RANGE
-    // > FTH_OP_EXPR_CLEAR ...
-BAIL:
-    return success;
+    if (cursor < length) {
+        parser->error = format("unexpected '%c' in stack expression", NULL, _PEEK);
+        return false;
+    }
+    if (from >= FTH_RANGE_BOTTOM || (to != FTH_RANGE_BOTTOM && (to >= FTH_RANGE_BOTTOM || to < from))) {
+        parser->error = strdup("invalid stack expression range");
+        return false;
+    }
+#undef _PEEK
+#undef _NEXT
+#undef _IS_DIGIT
+#undef _READ_INT
+    emit(parser, chunk, op);
+    emit(parser, chunk, flags);
+    emit(parser, chunk, from & 0xff);
+    emit(parser, chunk, from >> 8);
+    emit(parser, chunk, to & 0xff);
+    emit(parser, chunk, to >> 8);
+    return true;
 }
 
+// `: name ... ;` compiles the body into a chunk of its own, which only
+// becomes visible to lookups once the definition is closed
 static fth_result_t fth_compile(fth_parser *parser, fth_chunk *chunk) {
+    fth_chunk *target = chunk, *definition = NULL;
+    fth_string *name = NULL;
+    // Constants in the chunks being built aren't reachable yet
+    parser->vm->gc.paused++;
     for (;;) {
         parser->current = next_token(parser);
-        fth_print_token(&parser->current);
+        if (TRACING(parser->vm, FTH_TRACE_TOKEN))
+            trace_token(parser->vm, fth_token_str(&parser->current), parser->current.begin, parser->current.length, parser->current.line);
+        fth_chunk *emitting = target;
+        int emitted = garry_count(target->data);
         switch (parser->current.type) {
             case FTH_TOKEN_EOF:
-                emit(parser, chunk, FTH_OP_RETURN);
+                if (parser->stream && parser->stream->failed)
+                    parser->error = strdup("failed to read source");
+                else if (definition)
+                    parser->error = format("unterminated definition of '%.*s'", NULL, name->length, name->chars);
+                else {
+                    emit(parser, chunk, FTH_OP_RETURN);
+                    if (TRACING(parser->vm, FTH_TRACE_EMIT))
+                        trace_emits(parser->vm, chunk, emitted, parser->current.line);
+                }
             case FTH_TOKEN_ERROR:
                 goto BAIL;
             case FTH_TOKEN_ATOM:
+                if (token_is(&parser->current, ":")) {
+                    if (definition) {
+                        parser->error = strdup("nested definition");
+                        goto BAIL;
+                    }
+                    if (garry_count(parser->vm->words) > 0xffff) {
+                        parser->error = strdup("too many words");
+                        goto BAIL;
+                    }
+                    // Interned now, a streamed token won't outlive the next read
+                    fth_token token = next_token(parser);
+                    if (token.type != FTH_TOKEN_ATOM || token_is(&token, ":") || token_is(&token, ";")) {
+                        parser->error = strdup("expected a name after ':'");
+                        goto BAIL;
+                    }
+                    if (!(name = intern_string_from(parser->vm, token.begin, token.length, parser->source))) {
+                        parser->error = strdup("out of memory");
+                        goto BAIL;
+                    }
+                    target = definition = malloc(sizeof(fth_chunk));
+                    chunk_init(definition);
+                } else if (token_is(&parser->current, ";")) {
+                    if (!definition) {
+                        parser->error = strdup("unexpected ';'");
+                        goto BAIL;
+                    }
+                    emit(parser, definition, FTH_OP_RET);
+                    chunk_optimize(definition);
+                    fth_word word = {
+                        .name = name,
+                        .chunk = definition
+                    };
+                    define_word(parser->vm, word);
+                    target = chunk;
+                    definition = NULL;
+                } else if (!compile_word(parser, target) && !compile_keyword(parser, target)) {
+                    parser->error = format("unknown word '%.*s'", NULL, parser->current.length, parser->current.begin);
+                    goto BAIL;
+                }
                 break;
-            
             case FTH_TOKEN_STRING:
-                emit_constant(parser, chunk, fth_obj(fth_string_new(parser->current.begin, parser->current.length, false)));
+                if (!emit_string(parser, target))
+                    goto BAIL;
                 break;
             case FTH_TOKEN_NUMBER:
-                emit_number(parser, chunk);
+                if (!emit_number(parser, target))
+                    goto BAIL;
                 break;
             case FTH_TOKEN_INTEGER:
-                emit_integer(parser, chunk);
+                if (!emit_integer(parser, target))
+                    goto BAIL;
                 break;
             case FTH_TOKEN_STACK_EXPR:
-                if (!compile_stack_expr(parser, chunk))
+                if (!compile_stack_expr(parser, target))
                     goto BAIL;
                 break;
             case FTH_TOKEN_STACK_CLEAR:
-                emit(parser, chunk, parser->current.type);
+                emit(parser, target, parser->current.type);
                 break;
             default:
                 parser->error = strdup("unknown token");
                 goto BAIL;
         }
+        if (TRACING(parser->vm, FTH_TRACE_EMIT))
+            trace_emits(parser->vm, emitting, emitted, parser->current.line);
         parser->previous = parser->current;
     }
 BAIL:
+    if (parser->error && TRACING(parser->vm, FTH_TRACE_ERROR)) {
+        // vm->error is where the caller will put it
+        char *error = parser->vm->error;
+        parser->vm->error = parser->error;
+        trace_error(parser->vm, parser->current.line);
+        parser->vm->error = error;
+    }
+    if (definition) {
+        chunk_free(definition);
+        free(definition);
+    }
+    parser->vm->gc.paused--;
     return parser->error == NULL ? FTH_OK : FTH_COMPILE_ERROR;
 }
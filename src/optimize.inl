@@ -0,0 +1,101 @@
+// Peephole pass over a freshly compiled chunk. Instructions are decoded into
+// a list and each one is matched against the tail of the output as it is
+// appended, so rewrites cascade (`>r >r r> r>` disappears entirely). The
+// output is then re-encoded through chunk_write, which rebuilds the line
+// table; every fused instruction keeps the line of its first component, and
+// constant pairs are only merged on the same line so a later split can't
+// misattribute the second one.
+//
+// Cancelled pairs (>r r>, r> >r, dup drop, swap swap) are removed outright,
+// so a program that would have underflowed inside the pair no longer does.
+
+typedef struct {
+    uint8_t op;
+    uint8_t operands[5];
+    int line;
+} fth_peephole_insn;
+
+static bool peephole_cancels(uint8_t a, uint8_t b) {
+    switch (a) {
+        case FTH_OP_PUSH:
+            return b == FTH_OP_POP;
+        case FTH_OP_POP:
+            return b == FTH_OP_PUSH;
+        case FTH_OP_DUP:
+            return b == FTH_OP_DROP;
+        case FTH_OP_SWAP:
+            return b == FTH_OP_SWAP;
+        default:
+            return false;
+    }
+}
+
+static bool peephole_constant_form(uint8_t op, uint8_t *out) {
+    switch (op) {
+        case FTH_OP_ADD:
+            *out = FTH_OP_ADD_CONSTANT;
+            return true;
+        case FTH_OP_SUB:
+            *out = FTH_OP_SUB_CONSTANT;
+            return true;
+        case FTH_OP_MUL:
+            *out = FTH_OP_MUL_CONSTANT;
+            return true;
+        case FTH_OP_DIV:
+            *out = FTH_OP_DIV_CONSTANT;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void peephole_append(fth_peephole_insn **out, fth_peephole_insn insn) {
+    int count = garry_count(*out);
+    if (!count) {
+        garry_append(*out, insn);
+        return;
+    }
+    fth_peephole_insn *last = &(*out)[count - 1];
+    uint8_t fused;
+    if (peephole_cancels(last->op, insn.op)) {
+        garry_pop(*out);
+    } else if (last->op == FTH_OP_CONSTANT && peephole_constant_form(insn.op, &fused)) {
+        last->op = fused;
+    } else if (last->op == FTH_OP_CONSTANT2 && peephole_constant_form(insn.op, &fused)) {
+        // CONSTANT2 a b, ADD -> CONSTANT a, ADD_CONSTANT b: same dispatches, one less push
+        fth_peephole_insn tail = {
+            .op = fused,
+            .operands = { last->operands[1] },
+            .line = last->line
+        };
+        last->op = FTH_OP_CONSTANT;
+        garry_append(*out, tail);
+    } else if (last->op == FTH_OP_CONSTANT && insn.op == FTH_OP_CONSTANT && last->line == insn.line) {
+        last->op = FTH_OP_CONSTANT2;
+        last->operands[1] = insn.operands[0];
+    } else
+        garry_append(*out, insn);
+}
+
+static void chunk_optimize(fth_chunk *chunk) {
+    fth_peephole_insn *out = NULL;
+    for (int offset = 0; offset < garry_count(chunk->data);) {
+        fth_peephole_insn insn = {
+            .op = chunk->data[offset],
+            .line = get_line(chunk, offset)
+        };
+        int length = op_length(insn.op);
+        for (int i = 1; i < length && offset + i < garry_count(chunk->data); i++)
+            insn.operands[i - 1] = chunk->data[offset + i];
+        peephole_append(&out, insn);
+        offset += length;
+    }
+    garry_free(chunk->data);
+    chunk_strip_lines(chunk);
+    for (int i = 0; i < garry_count(out); i++) {
+        chunk_write(chunk, out[i].op, out[i].line);
+        for (int j = 0; j < op_operands[out[i].op]; j++)
+            chunk_write(chunk, out[i].operands[j], out[i].line);
+    }
+    garry_free(out);
+}
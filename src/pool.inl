@@ -0,0 +1,156 @@
+// Workers each own a VM and take jobs off a bounded queue of slots shared
+// by every submitter and worker (Vyukov's MPMC ring). A slot's sequence says
+// whose turn it is: equal to the tail it is free to fill, one past the head
+// it holds a job, and claiming either end is a compare and swap, so neither
+// side ever takes a lock.
+//
+// The lock only comes in when there's nothing to do. A worker that finds the
+// queue empty counts itself asleep and looks again before waiting, and a
+// submitter that sees anyone asleep signals after pushing. With a full fence
+// between each side's write and read, one of them sees the other.
+
+#if FTH_THREADS
+typedef struct {
+    unsigned char *source;
+    const fth_program *program;
+    fth_pool_done done;
+    void *user;
+} fth_pool_job;
+
+typedef struct {
+    atomic_size_t sequence;
+    fth_pool_job job;
+} fth_pool_slot;
+
+typedef struct {
+    pthread_t thread;
+    fth_vm vm;
+    fth_pool *pool;
+} fth_pool_worker;
+
+struct fth_pool {
+    fth_pool_slot *slots;
+    size_t mask;
+    // Submitters and workers each write their own line
+    atomic_size_t tail;
+    char tail_line[64 - sizeof(atomic_size_t)];
+    atomic_size_t head;
+    char head_line[64 - sizeof(atomic_size_t)];
+    // Submitted and not yet finished
+    atomic_int pending;
+    atomic_int sleepers;
+    atomic_int stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t work;
+    pthread_cond_t idle;
+    fth_pool_worker *workers;
+    int count;
+};
+
+static bool pool_push(fth_pool *pool, const fth_pool_job *job) {
+    size_t tail = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+    for (;;) {
+        fth_pool_slot *slot = &pool->slots[tail & pool->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t turn = (intptr_t)(sequence - tail);
+        if (!turn) {
+            if (atomic_compare_exchange_weak_explicit(&pool->tail, &tail, tail + 1, memory_order_relaxed, memory_order_relaxed)) {
+                slot->job = *job;
+                atomic_store_explicit(&slot->sequence, tail + 1, memory_order_release);
+                return true;
+            }
+        } else if (turn < 0)
+            return false;
+        else
+            tail = atomic_load_explicit(&pool->tail, memory_order_relaxed);
+    }
+}
+
+static bool pool_pop(fth_pool *pool, fth_pool_job *job) {
+    size_t head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    for (;;) {
+        fth_pool_slot *slot = &pool->slots[head & pool->mask];
+        size_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        intptr_t turn = (intptr_t)(sequence - (head + 1));
+        if (!turn) {
+            if (atomic_compare_exchange_weak_explicit(&pool->head, &head, head + 1, memory_order_relaxed, memory_order_relaxed)) {
+                *job = slot->job;
+                atomic_store_explicit(&slot->sequence, head + pool->mask + 1, memory_order_release);
+                return true;
+            }
+        } else if (turn < 0)
+            return false;
+        else
+            head = atomic_load_explicit(&pool->head, memory_order_relaxed);
+    }
+}
+
+static void pool_finished(fth_pool *pool) {
+    if (atomic_fetch_sub(&pool->pending, 1) == 1) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->idle);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+static void pool_run(fth_pool_worker *worker, fth_pool_job *job) {
+    fth_vm *vm = &worker->vm;
+    stack_reset(vm);
+    fth_result_t result = job->program ? fth_run_program(vm, job->program) : fth_exec(vm, job->source);
+    if (job->done)
+        job->done(job->user, vm, result);
+    free(vm->error);
+    vm->error = NULL;
+    free(job->source);
+    pool_finished(worker->pool);
+}
+
+// Takes the next job, sleeping until there is one. False once the pool is
+// stopping and the queue has drained
+static bool pool_take(fth_pool *pool, fth_pool_job *job) {
+    if (pool_pop(pool, job))
+        return true;
+    bool result = true;
+    pthread_mutex_lock(&pool->lock);
+    atomic_fetch_add(&pool->sleepers, 1);
+    atomic_thread_fence(memory_order_seq_cst);
+    while (!pool_pop(pool, job)) {
+        if (atomic_load(&pool->stopping)) {
+            result = false;
+            break;
+        }
+        pthread_cond_wait(&pool->work, &pool->lock);
+    }
+    atomic_fetch_sub(&pool->sleepers, 1);
+    pthread_mutex_unlock(&pool->lock);
+    return result;
+}
+
+static void* pool_worker(void *arg) {
+    fth_pool_worker *worker = arg;
+    fth_pool_job job;
+    while (pool_take(worker->pool, &job))
+        pool_run(worker, &job);
+    return NULL;
+}
+
+static bool pool_submit(fth_pool *pool, fth_pool_job *job) {
+    atomic_fetch_add(&pool->pending, 1);
+    if (!pool_push(pool, job)) {
+        pool_finished(pool);
+        return false;
+    }
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load(&pool->sleepers)) {
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_signal(&pool->work);
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return true;
+}
+
+static int pool_cores(void) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    return cores > 0 ? (int)cores : 1;
+}
+#endif
@@ -0,0 +1,174 @@
+// The profiler counts every instruction fth_run_observed runs, the pairs
+// they run in (candidates for superinstructions) and calls to each word. An
+// instruction is charged the time until the next one is dispatched, read
+// from the TSC on x86 and the monotonic clock elsewhere, and converted to
+// nanoseconds against the clock when profiling stops.
+
+#if FTH_PROFILE
+#define PROFILING(VM) ((VM)->profile != NULL)
+#else
+#define PROFILING(VM) 0
+#endif
+
+struct fth_profile {
+    uint64_t counts[FTH_OP_COUNT];
+    uint64_t ticks[FTH_OP_COUNT];
+    uint64_t pairs[FTH_OP_COUNT][FTH_OP_COUNT];
+    // Calls by dictionary index, names are filled in by fth_profile_stop
+    uint64_t *calls;
+    char **names;
+    // FTH_OP_COUNT when no instruction is being timed
+    uint8_t previous;
+    uint64_t last;
+    uint64_t start_ticks, start_ns;
+    double ns_per_tick;
+};
+
+#if FTH_PROFILE
+static inline uint64_t profile_ticks(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return gc_now_ns();
+#endif
+}
+
+static void profile_op(fth_profile *profile, const uint8_t *ip) {
+    uint64_t now = profile_ticks();
+    uint8_t op = *ip;
+    if (profile->previous < FTH_OP_COUNT) {
+        profile->ticks[profile->previous] += now - profile->last;
+        profile->pairs[profile->previous][op]++;
+    }
+    profile->counts[op]++;
+    if (op == FTH_OP_CALL) {
+        int word = ip[1] | ip[2] << 8;
+        while (garry_count(profile->calls) <= word)
+            garry_append(profile->calls, 0);
+        profile->calls[word]++;
+    }
+    profile->previous = op;
+    profile->last = now;
+}
+
+// Charges the last instruction of a run, so the time between runs isn't
+static void profile_close(fth_profile *profile) {
+    if (profile->previous < FTH_OP_COUNT)
+        profile->ticks[profile->previous] += profile_ticks() - profile->last;
+    profile->previous = FTH_OP_COUNT;
+}
+#endif
+
+static void profile_free(fth_profile *profile) {
+    if (!profile)
+        return;
+    if (profile->names)
+        for (int i = 0; i < garry_count(profile->calls); i++)
+            free(profile->names[i]);
+    free(profile->names);
+    garry_free(profile->calls);
+    free(profile);
+}
+
+static int profile_compare(const void *a, const void *b) {
+    const fth_profile_entry *x = a, *y = b;
+    return x->count < y->count ? 1 : x->count > y->count ? -1 : 0;
+}
+
+static uint64_t profile_ns(const fth_profile *profile, uint64_t ticks) {
+    return (uint64_t)(ticks * profile->ns_per_tick + 0.5);
+}
+
+// Every entry of a kind, most frequent first, for the caller to free
+static fth_profile_entry* profile_entries(const fth_profile *profile, fth_profile_kind kind, int *count) {
+    fth_profile_entry *result = NULL;
+    switch (kind) {
+        case FTH_PROFILE_OPS:
+            for (int i = 0; i < FTH_OP_COUNT; i++)
+                if (profile->counts[i])
+                    garry_append(result, ((fth_profile_entry) {
+                        .name = op_names[i],
+                        .count = profile->counts[i],
+                        .ns = profile_ns(profile, profile->ticks[i])
+                    }));
+            break;
+        case FTH_PROFILE_PAIRS:
+            for (int i = 0; i < FTH_OP_COUNT; i++)
+                for (int j = 0; j < FTH_OP_COUNT; j++)
+                    if (profile->pairs[i][j])
+                        garry_append(result, ((fth_profile_entry) {
+                            .name = op_names[i],
+                            .next = op_names[j],
+                            .count = profile->pairs[i][j]
+                        }));
+            break;
+        case FTH_PROFILE_WORDS:
+            for (int i = 0; i < garry_count(profile->calls); i++)
+                if (profile->calls[i])
+                    garry_append(result, ((fth_profile_entry) {
+                        .name = profile->names ? profile->names[i] : NULL,
+                        .count = profile->calls[i]
+                    }));
+            break;
+    }
+    *count = garry_count(result);
+    if (result)
+        qsort(result, *count, sizeof(fth_profile_entry), profile_compare);
+    return result;
+}
+
+// Word names are the only text that needs quoting, in either format
+static void profile_write_name(fth_writer *out, const char *name, fth_profile_format format) {
+    write_format(out, "\"");
+    for (const char *c = name ? name : ""; *c; c++) {
+        if (*c == '"')
+            write_format(out, format == FTH_PROFILE_CSV ? "\"\"" : "\\\"");
+        else if (format == FTH_PROFILE_JSON && *c == '\\')
+            write_format(out, "\\\\");
+        else if (format == FTH_PROFILE_JSON && (unsigned char)*c < 0x20)
+            write_format(out, "\\u%04x", *c);
+        else
+            out->sink(out->user, c, 1);
+    }
+    write_format(out, "\"");
+}
+
+static const char *profile_kinds[] = { "ops", "pairs", "words" };
+
+static void profile_write(const fth_profile *profile, fth_profile_format format, fth_writer *out) {
+    if (format == FTH_PROFILE_CSV)
+        write_format(out, "kind,name,next,count,ns\n");
+    else
+        write_format(out, "{");
+    for (int kind = FTH_PROFILE_OPS; kind <= FTH_PROFILE_WORDS; kind++) {
+        int count;
+        fth_profile_entry *entries = profile_entries(profile, kind, &count);
+        if (format == FTH_PROFILE_JSON)
+            write_format(out, "%s\"%s\":[", kind == FTH_PROFILE_OPS ? "" : ",", profile_kinds[kind]);
+        for (int i = 0; i < count; i++) {
+            fth_profile_entry *entry = &entries[i];
+            if (format == FTH_PROFILE_CSV) {
+                write_format(out, "%s,", profile_kinds[kind]);
+                profile_write_name(out, entry->name, format);
+                write_format(out, ",%s,%llu,", entry->next ? entry->next : "", (unsigned long long)entry->count);
+                if (kind == FTH_PROFILE_OPS)
+                    write_format(out, "%llu", (unsigned long long)entry->ns);
+                write_format(out, "\n");
+            } else {
+                write_format(out, "%s{\"name\":", i ? "," : "");
+                profile_write_name(out, entry->name, format);
+                if (entry->next)
+                    write_format(out, ",\"next\":\"%s\"", entry->next);
+                write_format(out, ",\"count\":%llu", (unsigned long long)entry->count);
+                if (kind == FTH_PROFILE_OPS)
+                    write_format(out, ",\"ns\":%llu", (unsigned long long)entry->ns);
+                write_format(out, "}");
+            }
+        }
+        if (format == FTH_PROFILE_JSON)
+            write_format(out, "]");
+        garry_free(entries);
+    }
+    if (format == FTH_PROFILE_JSON)
+        write_format(out, "}\n");
+}
@@ -0,0 +1,394 @@
+// The interpreter loop. fth.c includes this once per dispatch strategy:
+//   FTH_RUN_NAME       name of the generated function
+//   FTH_RUN_THREADED   1 to give every handler its own indirect jump through a
+//                      labels-as-values table, 0 for a portable switch
+//   FTH_RUN_TOS_CACHE  1 to keep the top of the data stack in a local
+//   FTH_RUN_OBSERVE    1 to show every instruction to observe_op (the trace
+//                      hook and profiler) before it runs, and never hand
+//                      over to native code
+//
+// With the cache on, `tos` holds the top cell and the memory slot at sp[-1]
+// is stale until SPILL() writes it back. Handlers that look deeper than NOS,
+// or call out of the loop, spill first; every exit spills so the host only
+// ever sees the stack in memory.
+//
+// Quickening: the first time a generic arithmetic op runs on two integers or
+// two floats it rewrites its opcode in place to the INT_ or FLOAT_ variant,
+// which only has to check its operands are still what it was specialized for.
+// When they aren't it rewrites itself to the MIXED_ variant, which runs the
+// generic arithmetic and never specializes again, so a site that sees both
+// types settles instead of flipping back and forth. Sealed chunks are shared
+// and never rewritten.
+
+#ifndef FTH_RUN_NAME
+#error FTH_RUN_NAME must be defined before including run.inl
+#endif
+#ifndef FTH_RUN_OBSERVE
+#define FTH_RUN_OBSERVE 0
+#endif
+
+static fth_result_t FTH_RUN_NAME(fth_vm *vm) {
+    uint8_t *ip = vm->sp;
+    fth_value *sp = vm->stack.top;
+    fth_value *const base = vm->stack.base;
+    fth_value *const end = vm->stack.end;
+    fth_value *constants = vm->chunk->constants;
+    fth_value value;
+#if FTH_RUN_TOS_CACHE
+    fth_value tos = sp[-1];
+#define TOS tos
+#define SPILL() (sp[-1] = tos, vm->stack.top = sp)
+#define RELOAD() (sp = vm->stack.top, tos = sp[-1])
+#define PUSH_VALUE(V) \
+    do { \
+        fth_value _v = (V); \
+        sp[-1] = tos; \
+        sp++; \
+        tos = _v; \
+    } while (0)
+#define DROP_VALUE() (--sp, tos = sp[-1])
+#else
+#define TOS sp[-1]
+#define SPILL() (vm->stack.top = sp)
+#define RELOAD() (sp = vm->stack.top)
+#define PUSH_VALUE(V) \
+    do { \
+        fth_value _v = (V); \
+        *sp++ = _v; \
+    } while (0)
+#define DROP_VALUE() (--sp)
+#endif
+#define NOS sp[-2]
+#define DEPTH() (sp - base)
+#define THROW(MSG) \
+    do { \
+        SPILL(); \
+        vm->sp = ip; \
+        vm->error = strdup(MSG); \
+        return FTH_RUNTIME_ERROR; \
+    } while (0)
+#define NEED(N) \
+    if (DEPTH() < (N)) \
+        THROW("data stack underflow")
+#define ROOM(N) \
+    if (end - sp < (N)) \
+        THROW("data stack overflow")
+#if FTH_QUICKEN
+// Rewrites the op being run, ip is still just past the opcode
+#define QUICKEN(N) ((void)(vm->chunk->sealed || (ip[-1] = FTH_OP_##N)))
+#else
+#define QUICKEN(N) ((void)0)
+#endif
+// SPECIALIZE is 0 for the MIXED_ ops, which stay generic
+#define ARITH(A, B, OP, CHECK, N, SPECIALIZE) \
+    do { \
+        fth_value _a = (A), _b = (B); \
+        if (fth_is_integer(_a) && fth_is_integer(_b)) { \
+            fth_int a = fth_as_integer(_a), b = fth_as_integer(_b); \
+            CHECK \
+            value = fth_integer(a OP b); \
+            if (SPECIALIZE) \
+                QUICKEN(INT_##N); \
+        } else { \
+            fth_float a, b; \
+            if (!as_float(_a, &a) || !as_float(_b, &b)) \
+                THROW("arithmetic on non-numeric value"); \
+            value = fth_number(a OP b); \
+            if (SPECIALIZE && fth_is_number(_a) && fth_is_number(_b)) \
+                QUICKEN(FLOAT_##N); \
+        } \
+    } while (0)
+#define BINARY(OP, CHECK, N, SPECIALIZE) \
+    NEED(2); \
+    ARITH(NOS, TOS, OP, CHECK, N, SPECIALIZE); \
+    DROP_VALUE(); \
+    TOS = value; \
+    NEXT
+#define BINARY_CONSTANT(OP, CHECK, N, SPECIALIZE) \
+    NEED(1); \
+    ARITH(TOS, constants[*ip], OP, CHECK, N, SPECIALIZE); \
+    ip++; \
+    TOS = value; \
+    NEXT
+// GUARD(X) is the type check for one operand, AS(X) its unboxing and BOX
+// the result's boxing. A constant operand never changes, so only the stack
+// operand needs checking
+#define BINARY_QUICK(GUARD, AS, BOX, OP, CHECK, N) \
+    NEED(2); \
+    if (GUARD(NOS) && GUARD(TOS)) { \
+        __typeof__(AS(TOS)) a = AS(NOS), b = AS(TOS); \
+        CHECK \
+        value = BOX(a OP b); \
+    } else { \
+        QUICKEN(MIXED_##N); \
+        ARITH(NOS, TOS, OP, CHECK, N, 0); \
+    } \
+    DROP_VALUE(); \
+    TOS = value; \
+    NEXT
+#define BINARY_QUICK_CONSTANT(GUARD, AS, BOX, OP, CHECK, N) \
+    NEED(1); \
+    if (GUARD(TOS)) { \
+        __typeof__(AS(TOS)) a = AS(TOS), b = AS(constants[*ip]); \
+        CHECK \
+        value = BOX(a OP b); \
+    } else { \
+        QUICKEN(MIXED_##N); \
+        ARITH(TOS, constants[*ip], OP, CHECK, N, 0); \
+    } \
+    ip++; \
+    TOS = value; \
+    NEXT
+#if FTH_RUN_OBSERVE
+#define OBSERVE() (SPILL(), observe_op(vm, ip))
+#else
+#define OBSERVE() ((void)0)
+#endif
+#if FTH_RUN_THREADED
+    static void *dispatch_table[256] = {
+        [0 ... 255] = &&UNKNOWN,
+#define X(N, _) [FTH_OP_##N] = &&OP_##N,
+        OPS
+#undef X
+    };
+#define CASE(N) OP_##N:
+#if FTH_RUN_OBSERVE
+#define NEXT do { OBSERVE(); goto *dispatch_table[*ip++]; } while (0)
+#else
+#define NEXT goto *dispatch_table[*ip++]
+#endif
+    NEXT;
+#else
+#define CASE(N) case FTH_OP_##N:
+#define NEXT continue
+    for (;;) switch (OBSERVE(), *ip++) {
+#endif
+    CASE(RETURN)
+        NEED(1);
+        value = TOS;
+        DROP_VALUE();
+        SPILL();
+        vm->sp = ip;
+        fth_print_value(value);
+        printf("\n");
+        return FTH_OK;
+    CASE(CONSTANT)
+        ROOM(1);
+        PUSH_VALUE(constants[*ip++]);
+        NEXT;
+    CASE(CONSTANT_LONG)
+        ROOM(1);
+        PUSH_VALUE(constants[ip[0] | ip[1] << 8 | ip[2] << 16]);
+        ip += 3;
+        NEXT;
+    CASE(CLEAR)
+        sp = base;
+        NEXT;
+    CASE(PERIOD)
+        NEED(1);
+        fth_print_value(TOS);
+        printf("\n");
+        NEXT;
+    CASE(PUSH)
+        NEED(1);
+        if (vm->return_stack.top == vm->return_stack.end)
+            THROW("return stack overflow");
+        *vm->return_stack.top++ = TOS;
+        DROP_VALUE();
+        NEXT;
+    CASE(POP)
+        if (vm->return_stack.top == vm->return_stack.base)
+            THROW("return stack underflow");
+        ROOM(1);
+        PUSH_VALUE(*--vm->return_stack.top);
+        NEXT;
+    CASE(DUMP)
+        SPILL();
+        dump_stack(&vm->stack);
+        NEXT;
+    CASE(DUMP_RSTACK)
+        dump_stack(&vm->return_stack);
+        NEXT;
+    CASE(ADD)
+        BINARY(+, , ADD, 1);
+    CASE(SUB)
+        BINARY(-, , SUB, 1);
+    CASE(MUL)
+        BINARY(*, , MUL, 1);
+    CASE(DIV)
+        BINARY(/, if (!b) THROW("division by zero");, DIV, 1);
+    CASE(DUP)
+        NEED(1);
+        ROOM(1);
+        PUSH_VALUE(TOS);
+        NEXT;
+    CASE(DROP)
+        NEED(1);
+        DROP_VALUE();
+        NEXT;
+    CASE(SWAP)
+        NEED(2);
+        value = NOS;
+        NOS = TOS;
+        TOS = value;
+        NEXT;
+    CASE(OVER)
+        NEED(2);
+        ROOM(1);
+        PUSH_VALUE(NOS);
+        NEXT;
+    CASE(CONSTANT2)
+        ROOM(2);
+        PUSH_VALUE(constants[ip[0]]);
+        PUSH_VALUE(constants[ip[1]]);
+        ip += 2;
+        NEXT;
+    CASE(ADD_CONSTANT)
+        BINARY_CONSTANT(+, , ADD_CONSTANT, 1);
+    CASE(SUB_CONSTANT)
+        BINARY_CONSTANT(-, , SUB_CONSTANT, 1);
+    CASE(MUL_CONSTANT)
+        BINARY_CONSTANT(*, , MUL_CONSTANT, 1);
+    CASE(DIV_CONSTANT)
+        BINARY_CONSTANT(/, if (!b) THROW("division by zero");, DIV_CONSTANT, 1);
+    CASE(INT_ADD)
+        BINARY_QUICK(fth_is_integer, fth_as_integer, fth_integer, +, , ADD);
+    CASE(INT_SUB)
+        BINARY_QUICK(fth_is_integer, fth_as_integer, fth_integer, -, , SUB);
+    CASE(INT_MUL)
+        BINARY_QUICK(fth_is_integer, fth_as_integer, fth_integer, *, , MUL);
+    CASE(INT_DIV)
+        BINARY_QUICK(fth_is_integer, fth_as_integer, fth_integer, /, if (!b) THROW("division by zero");, DIV);
+    CASE(FLOAT_ADD)
+        BINARY_QUICK(fth_is_number, fth_as_number, fth_number, +, , ADD);
+    CASE(FLOAT_SUB)
+        BINARY_QUICK(fth_is_number, fth_as_number, fth_number, -, , SUB);
+    CASE(FLOAT_MUL)
+        BINARY_QUICK(fth_is_number, fth_as_number, fth_number, *, , MUL);
+    CASE(FLOAT_DIV)
+        BINARY_QUICK(fth_is_number, fth_as_number, fth_number, /, , DIV);
+    CASE(INT_ADD_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_integer, fth_as_integer, fth_integer, +, , ADD_CONSTANT);
+    CASE(INT_SUB_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_integer, fth_as_integer, fth_integer, -, , SUB_CONSTANT);
+    CASE(INT_MUL_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_integer, fth_as_integer, fth_integer, *, , MUL_CONSTANT);
+    CASE(INT_DIV_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_integer, fth_as_integer, fth_integer, /, if (!b) THROW("division by zero");, DIV_CONSTANT);
+    CASE(FLOAT_ADD_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_number, fth_as_number, fth_number, +, , ADD_CONSTANT);
+    CASE(FLOAT_SUB_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_number, fth_as_number, fth_number, -, , SUB_CONSTANT);
+    CASE(FLOAT_MUL_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_number, fth_as_number, fth_number, *, , MUL_CONSTANT);
+    CASE(FLOAT_DIV_CONSTANT)
+        BINARY_QUICK_CONSTANT(fth_is_number, fth_as_number, fth_number, /, , DIV_CONSTANT);
+    CASE(MIXED_ADD)
+        BINARY(+, , ADD, 0);
+    CASE(MIXED_SUB)
+        BINARY(-, , SUB, 0);
+    CASE(MIXED_MUL)
+        BINARY(*, , MUL, 0);
+    CASE(MIXED_DIV)
+        BINARY(/, if (!b) THROW("division by zero");, DIV, 0);
+    CASE(MIXED_ADD_CONSTANT)
+        BINARY_CONSTANT(+, , ADD_CONSTANT, 0);
+    CASE(MIXED_SUB_CONSTANT)
+        BINARY_CONSTANT(-, , SUB_CONSTANT, 0);
+    CASE(MIXED_MUL_CONSTANT)
+        BINARY_CONSTANT(*, , MUL_CONSTANT, 0);
+    CASE(MIXED_DIV_CONSTANT)
+        BINARY_CONSTANT(/, if (!b) THROW("division by zero");, DIV_CONSTANT, 0);
+    CASE(RANGE_DROP)
+    CASE(RANGE_MOVE)
+    CASE(RANGE_ROLL)
+    CASE(RANGE_COPY)
+    CASE(RANGE_SET)
+    CASE(RANGE_PRINT) {
+        SPILL();
+        const char *error = range_op(vm, ip[-1], ip);
+        RELOAD();
+        ip += 5;
+        if (error)
+            THROW(error);
+        NEXT;
+    }
+    CASE(CALL) {
+        fth_chunk *callee = vm->words[ip[0] | ip[1] << 8].chunk;
+        ip += 2;
+#if FTH_JIT && !FTH_RUN_OBSERVE
+        if (jit_ready(vm, callee)) {
+            fth_chunk *caller = vm->chunk;
+            SPILL();
+            vm->chunk = callee;
+            fth_result_t result = ((fth_jit_fn)callee->jit)(vm);
+            vm->chunk = caller;
+            RELOAD();
+            if (result != FTH_OK)
+                return result;
+            NEXT;
+        }
+#endif
+        if (vm->return_stack.end - vm->return_stack.top < 2)
+            THROW("return stack overflow");
+        *vm->return_stack.top++ = fth_integer(ip - vm->chunk->data);
+        *vm->return_stack.top++ = frame_value(vm->chunk);
+        vm->chunk = callee;
+        constants = callee->constants;
+        ip = callee->data;
+        NEXT;
+    }
+    CASE(RET) {
+        fth_value *frame = vm->return_stack.top;
+        if (frame - vm->return_stack.base < 2 || fth_type(frame[-1]) != FTH_VALUE_FRAME || !fth_is_integer(frame[-2]))
+            THROW("bad return frame");
+        fth_chunk *caller = as_frame(frame[-1]);
+        fth_int offset = fth_as_integer(frame[-2]);
+        if (caller && offset >= garry_count(caller->data))
+            THROW("bad return frame");
+        vm->return_stack.top -= 2;
+        if (!caller) {
+            // The word was called from native code, which resumes the caller
+            SPILL();
+            vm->sp = ip;
+            return FTH_OK;
+        }
+        vm->chunk = caller;
+        constants = caller->constants;
+        ip = caller->data + offset;
+        NEXT;
+    }
+#if FTH_RUN_THREADED
+UNKNOWN:
+#else
+    default:
+#endif
+        abort();
+#if !FTH_RUN_THREADED
+    }
+#endif
+#undef CASE
+#undef NEXT
+#undef OBSERVE
+#undef TOS
+#undef NOS
+#undef SPILL
+#undef RELOAD
+#undef PUSH_VALUE
+#undef DROP_VALUE
+#undef DEPTH
+#undef THROW
+#undef NEED
+#undef ROOM
+#undef QUICKEN
+#undef ARITH
+#undef BINARY
+#undef BINARY_CONSTANT
+#undef BINARY_QUICK
+#undef BINARY_QUICK_CONSTANT
+}
+
+#undef FTH_RUN_NAME
+#undef FTH_RUN_THREADED
+#undef FTH_RUN_TOS_CACHE
+#undef FTH_RUN_OBSERVE
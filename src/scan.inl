@@ -0,0 +1,134 @@
+// Block scanners for the lexer's ASCII runs. Each one returns the first byte
+// at or after `p` that the lexer has to look at itself and counts the '\n's
+// it skipped on the way. Every mode stops on NUL and on any byte >= 0x80, so
+// UTF-8 is always left to utf8read and a scan never runs off the source.
+//
+// Blocks are aligned loads, which can read up to a block past the NUL (or
+// before the start) but never across a page, so ASan is told to look away.
+//
+//   SCAN_SYMBOL   control characters, space and #()[]{};
+//   SCAN_SPACE    anything that isn't " \t\n\v\f\r"
+//   SCAN_STRING   '"'
+//   SCAN_LINE     '\n' and '\r'
+
+typedef enum {
+    SCAN_SYMBOL,
+    SCAN_SPACE,
+    SCAN_STRING,
+    SCAN_LINE
+} scan_mode;
+
+#if defined(__has_feature)
+#if __has_feature(address_sanitizer)
+#define FTH_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#endif
+#if !defined(FTH_NO_SANITIZE) && defined(__SANITIZE_ADDRESS__)
+#define FTH_NO_SANITIZE __attribute__((no_sanitize_address))
+#endif
+#ifndef FTH_NO_SANITIZE
+#define FTH_NO_SANITIZE
+#endif
+
+#if FTH_SCAN_WIDTH
+#if FTH_SCAN_WIDTH == 32
+typedef __m256i scan_vector;
+#define SCAN_LOAD(P) _mm256_load_si256((const __m256i*)(P))
+#define SCAN_SET(C) _mm256_set1_epi8((char)(C))
+#define SCAN_EQ(A, B) _mm256_cmpeq_epi8((A), (B))
+#define SCAN_OR(A, B) _mm256_or_si256((A), (B))
+#define SCAN_MIN(A, B) _mm256_min_epu8((A), (B))
+#define SCAN_SUB(A, B) _mm256_sub_epi8((A), (B))
+#define SCAN_MASK(V) ((uint32_t)_mm256_movemask_epi8((V)))
+#define SCAN_ALL 0xffffffffu
+#else
+typedef __m128i scan_vector;
+#define SCAN_LOAD(P) _mm_load_si128((const __m128i*)(P))
+#define SCAN_SET(C) _mm_set1_epi8((char)(C))
+#define SCAN_EQ(A, B) _mm_cmpeq_epi8((A), (B))
+#define SCAN_OR(A, B) _mm_or_si128((A), (B))
+#define SCAN_MIN(A, B) _mm_min_epu8((A), (B))
+#define SCAN_SUB(A, B) _mm_sub_epi8((A), (B))
+#define SCAN_MASK(V) ((uint32_t)_mm_movemask_epi8((V)))
+#define SCAN_ALL 0xffffu
+#endif
+// Unsigned A <= B per byte
+#define SCAN_LE(A, B) SCAN_EQ(SCAN_MIN((A), (B)), (A))
+
+FTH_NO_SANITIZE static inline uint32_t scan_stops(scan_vector c, scan_mode mode) {
+    uint32_t high = SCAN_MASK(c);
+    switch (mode) {
+        case SCAN_SYMBOL: {
+            scan_vector stops = SCAN_LE(c, SCAN_SET(' '));
+            stops = SCAN_OR(stops, SCAN_OR(SCAN_EQ(c, SCAN_SET('#')), SCAN_EQ(c, SCAN_SET(';'))));
+            stops = SCAN_OR(stops, SCAN_OR(SCAN_EQ(c, SCAN_SET('(')), SCAN_EQ(c, SCAN_SET(')'))));
+            stops = SCAN_OR(stops, SCAN_OR(SCAN_EQ(c, SCAN_SET('[')), SCAN_EQ(c, SCAN_SET(']'))));
+            stops = SCAN_OR(stops, SCAN_OR(SCAN_EQ(c, SCAN_SET('{')), SCAN_EQ(c, SCAN_SET('}'))));
+            return high | SCAN_MASK(stops);
+        }
+        case SCAN_SPACE: {
+            // \t \n \v \f \r are 9..13
+            scan_vector space = SCAN_OR(SCAN_EQ(c, SCAN_SET(' ')), SCAN_LE(SCAN_SUB(c, SCAN_SET('\t')), SCAN_SET(4)));
+            return ~SCAN_MASK(space) & SCAN_ALL;
+        }
+        case SCAN_STRING:
+            return high | SCAN_MASK(SCAN_OR(SCAN_EQ(c, SCAN_SET('"')), SCAN_EQ(c, SCAN_SET(0))));
+        case SCAN_LINE: {
+            scan_vector stops = SCAN_OR(SCAN_EQ(c, SCAN_SET('\n')), SCAN_EQ(c, SCAN_SET('\r')));
+            return high | SCAN_MASK(SCAN_OR(stops, SCAN_EQ(c, SCAN_SET(0))));
+        }
+    }
+    return SCAN_ALL;
+}
+
+// Newlines are sparse, and popcount is a libcall without -mpopcnt
+static inline int scan_count(uint32_t bits) {
+    int count = 0;
+    for (; bits; bits &= bits - 1)
+        count++;
+    return count;
+}
+
+FTH_NO_SANITIZE static inline const unsigned char* scan_ascii(const unsigned char *p, scan_mode mode, int *newlines) {
+    const unsigned char *block = (const unsigned char*)((uintptr_t)p & ~(uintptr_t)(FTH_SCAN_WIDTH - 1));
+    int skip = (int)(p - block);
+    scan_vector c = SCAN_LOAD(block);
+    uint32_t stops = scan_stops(c, mode) >> skip;
+    uint32_t lines = SCAN_MASK(SCAN_EQ(c, SCAN_SET('\n'))) >> skip;
+    int count = 0;
+    while (!stops) {
+        count += scan_count(lines);
+        p = block += FTH_SCAN_WIDTH;
+        c = SCAN_LOAD(block);
+        stops = scan_stops(c, mode);
+        lines = SCAN_MASK(SCAN_EQ(c, SCAN_SET('\n')));
+    }
+    int at = __builtin_ctz(stops);
+    *newlines = count + scan_count(lines & ((1u << at) - 1));
+    return p + at;
+}
+#else
+static inline bool scan_stop(unsigned char c, scan_mode mode) {
+    if (!c || c >= 0x80)
+        return true;
+    switch (mode) {
+        case SCAN_SYMBOL:
+            return c <= ' ' || strchr("#;()[]{}", c);
+        case SCAN_SPACE:
+            return c != ' ' && (c < '\t' || c > '\r');
+        case SCAN_STRING:
+            return c == '"';
+        case SCAN_LINE:
+            return c == '\n' || c == '\r';
+    }
+    return true;
+}
+
+static inline const unsigned char* scan_ascii(const unsigned char *p, scan_mode mode, int *newlines) {
+    int count = 0;
+    for (; !scan_stop(*p, mode); p++)
+        count += *p == '\n';
+    *newlines = count;
+    return p;
+}
+#endif
@@ -0,0 +1,76 @@
+// Trace hooks, see fth_trace in fth.h. Call sites test TRACING first, so the
+// events are only built for a hook that asked for them, and with
+// FTH_NO_TRACE the test is a constant and the calls go away.
+
+#if FTH_TRACE
+#define TRACING(VM, EVENT) ((VM)->trace.hook && ((VM)->trace.flags & (EVENT)))
+#else
+#define TRACING(VM, EVENT) 0
+#endif
+
+static void trace_send(fth_vm *vm, fth_trace_event *event) {
+    vm->trace.hook(vm, event, vm->trace.user);
+}
+
+static void trace_token(fth_vm *vm, const char *kind, const unsigned char *text, int length, int line) {
+    fth_trace_event event = {
+        .type = FTH_TRACE_TOKEN,
+        .name = kind,
+        .text = text,
+        .length = length,
+        .line = line
+    };
+    trace_send(vm, &event);
+}
+
+// One event per instruction written to the chunk since `from`
+static void trace_emits(fth_vm *vm, fth_chunk *chunk, int from, int line) {
+    for (int offset = from; offset < garry_count(chunk->data); offset += op_length(chunk->data[offset])) {
+        fth_trace_event event = {
+            .type = FTH_TRACE_EMIT,
+            .name = op_name(chunk->data[offset]),
+            .line = line,
+            .chunk = chunk,
+            .offset = offset
+        };
+        trace_send(vm, &event);
+    }
+}
+
+// Only fth_run_observed reports instructions
+#if FTH_TRACE
+static void trace_op(fth_vm *vm, const uint8_t *ip) {
+    fth_trace_event event = {
+        .type = FTH_TRACE_OP,
+        .name = op_name(*ip),
+        .line = get_line(vm->chunk, (int)(ip - vm->chunk->data)),
+        .chunk = vm->chunk,
+        .offset = (int)(ip - vm->chunk->data)
+    };
+    trace_send(vm, &event);
+}
+#endif
+
+// Compile errors pass their line. Runtime errors pass -1 and are placed from
+// vm->sp, which is left just past the failing instruction, in vm->chunk
+// unless native code has already returned to its caller
+static void trace_error(fth_vm *vm, int line) {
+    fth_trace_event event = {
+        .type = FTH_TRACE_ERROR,
+        .name = vm->error,
+        .line = line
+    };
+    fth_chunk *chunk = vm->chunk;
+    if (line < 0 && chunk && vm->sp > chunk->data && vm->sp <= chunk->data + garry_count(chunk->data)) {
+        event.chunk = chunk;
+        event.offset = (int)(vm->sp - chunk->data) - 1;
+        // Back up to the start of the instruction
+        for (int offset = 0; offset <= event.offset; offset += op_length(chunk->data[offset]))
+            if (offset + op_length(chunk->data[offset]) > event.offset) {
+                event.offset = offset;
+                break;
+            }
+        event.line = get_line(chunk, event.offset);
+    }
+    trace_send(vm, &event);
+}
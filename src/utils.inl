@@ -56,12 +56,12 @@ static void *__garry_shrinkf(void *arr, int itemsize) {
 static char* __format(const char *fmt, size_t *size, va_list args) {
     va_list _copy;
     va_copy(_copy, args);
-    size_t _size = vsnprintf(NULL, 0, fmt, args);
+    size_t _size = vsnprintf(NULL, 0, fmt, _copy);
     va_end(_copy);
     char *result = malloc(_size + 1);
     if (!result)
         return NULL;
-    vsnprintf(result, _size, fmt, args);
+    vsnprintf(result, _size + 1, fmt, args);
     result[_size] = '\0';
     if (size)
         *size = _size;
@@ -583,12 +583,15 @@ static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
     uint32_t c2 = 0xab0e9789;
     uint32_t c3 = 0x38b34ae5;
     uint32_t c4 = 0xa1e38b93;
-    const uint32_t * blocks = (const uint32_t *)(data + nblocks*16);
+    // Keys can start anywhere, so blocks are copied out rather than read
+    // through a uint32_t pointer; the copies compile to plain loads
+    const uint8_t * blocks = data + nblocks*16;
     for (int i = -nblocks; i; i++) {
-        uint32_t k1 = blocks[i*4+0];
-        uint32_t k2 = blocks[i*4+1];
-        uint32_t k3 = blocks[i*4+2];
-        uint32_t k4 = blocks[i*4+3];
+        uint32_t k1, k2, k3, k4;
+        memcpy(&k1, blocks + i*16 + 0, sizeof(uint32_t));
+        memcpy(&k2, blocks + i*16 + 4, sizeof(uint32_t));
+        memcpy(&k3, blocks + i*16 + 8, sizeof(uint32_t));
+        memcpy(&k4, blocks + i*16 + 12, sizeof(uint32_t));
         k1 *= c1; k1  = ROTL32(k1,15); k1 *= c2; h1 ^= k1;
         h1 = ROTL32(h1,19); h1 += h2; h1 = h1*5+0x561ccd1b;
         k2 *= c2; k2  = ROTL32(k2,16); k2 *= c3; h2 ^= k2;
@@ -645,16 +648,14 @@ static void MM86128(const void *key, const int len, uint32_t seed, void *out) {
     FMIX32(h1); FMIX32(h2); FMIX32(h3); FMIX32(h4);
     h1 += h2; h1 += h3; h1 += h4;
     h2 += h1; h3 += h1; h4 += h1;
-    ((uint32_t*)out)[0] = h1;
-    ((uint32_t*)out)[1] = h2;
-    ((uint32_t*)out)[2] = h3;
-    ((uint32_t*)out)[3] = h4;
+    uint32_t hash[4] = { h1, h2, h3, h4 };
+    memcpy(out, hash, sizeof(hash));
 }
 
 static uint64_t murmur(const void *data, size_t len, uint32_t seed) {
-    char out[16];
-    MM86128(data, (int)len, (uint32_t)seed, &out);
-    return *(uint64_t*)out;
+    uint64_t out[2];
+    MM86128(data, (int)len, (uint32_t)seed, out);
+    return out[0];
 }
 
 static int unordered_map_set_string(unordered_map_t *map, const unsigned char *strkey, uint64_t val) {